@@ -0,0 +1,205 @@
+#include <sys/types.h>
+#include <termios.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <sched.h>
+#include "affinity.h"
+
+/* A set of cpus sharing one cache. Last-level domains (usually L3) carry a
+ * load count so that independent jobs can be spread apart; L2 domains record
+ * the last-level domain they belong to. */
+typedef struct cache_domain {
+	cpu_set_t cpus;
+	int ncpus;
+	int load;	/* jobs currently placed here (last-level domains only) */
+	int parent;	/* index of the enclosing last-level domain (L2 only) */
+} cache_domain_t;
+
+#define SYSFS_CPU "/sys/devices/system/cpu"
+
+static int policy = PLACE_NONE;
+static bool topology_read = false;
+static cache_domain_t *llc = NULL;	/* last-level cache domains */
+static int nllc = 0;
+static cache_domain_t *l2 = NULL;	/* L2 domains */
+static int nl2 = 0;
+
+/* Read the placement policy; the topology itself is read on first use. */
+void affinity_init() {
+	char *env = getenv("DSH_PLACEMENT");
+	if(env && strcmp(env, "cache") == 0)
+		policy = PLACE_CACHE;
+}
+
+/* Parse a cpu list such as "0-3,6,8-9" (the format used by sysfs and
+ * taskset -c). Returns false on malformed input. */
+bool parse_cpulist(const char *list, cpu_set_t *set) {
+	const char *s = list;
+	CPU_ZERO(set);
+	while(*s && *s != '\n') {
+		char *end;
+		long lo, hi;
+		if(!isdigit((unsigned char)*s))
+			return false;
+		lo = hi = strtol(s, &end, 10);
+		s = end;
+		if(*s == '-') {
+			if(!isdigit((unsigned char)*++s))
+				return false;
+			hi = strtol(s, &end, 10);
+			s = end;
+		}
+		if(lo > hi || hi >= CPU_SETSIZE)
+			return false;
+		for(; lo <= hi; lo++)
+			CPU_SET(lo, set);
+		if(*s == ',') {
+			if(!isdigit((unsigned char)*++s))
+				return false; /* "0,1," ends in an empty item */
+		}
+		else if(*s && *s != '\n')
+			return false;
+	}
+	return CPU_COUNT(set) > 0;
+}
+
+static bool read_sysfs(const char *path, char *buf, size_t len) {
+	FILE *f = fopen(path, "r");
+	if(!f)
+		return false;
+	bool ok = fgets(buf, len, f) != NULL;
+	fclose(f);
+	return ok;
+}
+
+/* Returns the index of the domain equal to set, adding it if new. */
+static int add_domain(cache_domain_t **doms, int *n, cpu_set_t *set) {
+	int i;
+	for(i = 0; i < *n; i++)
+		if(CPU_EQUAL(&(*doms)[i].cpus, set))
+			return i;
+	cache_domain_t *grown = realloc(*doms, (*n + 1) * sizeof(cache_domain_t));
+	if(!grown)
+		return -1;
+	*doms = grown;
+	grown[*n].cpus = *set;
+	grown[*n].ncpus = CPU_COUNT(set);
+	grown[*n].load = 0;
+	grown[*n].parent = -1;
+	return (*n)++;
+}
+
+/* Group the cpus we may run on by shared L2 and last-level cache, using
+ * /sys/devices/system/cpu/cpuN/cache/indexK/{level,type,shared_cpu_list}.
+ * Without sysfs everything collapses into a single domain. */
+static void read_topology() {
+	cpu_set_t allowed;
+	char path[128], buf[256];
+	int cpu, idx;
+
+	topology_read = true;
+	if(sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+		return;
+
+	for(cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if(!CPU_ISSET(cpu, &allowed))
+			continue;
+		cpu_set_t l2set, llcset;
+		int llclevel = 0;
+		CPU_ZERO(&l2set);
+		CPU_ZERO(&llcset);
+		for(idx = 0; ; idx++) {
+			int level;
+			cpu_set_t shared;
+			snprintf(path, sizeof(path), SYSFS_CPU "/cpu%d/cache/index%d/level", cpu, idx);
+			if(!read_sysfs(path, buf, sizeof(buf)))
+				break;
+			level = atoi(buf);
+			snprintf(path, sizeof(path), SYSFS_CPU "/cpu%d/cache/index%d/type", cpu, idx);
+			if(read_sysfs(path, buf, sizeof(buf)) && strncmp(buf, "Instruction", 11) == 0)
+				continue;
+			snprintf(path, sizeof(path), SYSFS_CPU "/cpu%d/cache/index%d/shared_cpu_list", cpu, idx);
+			if(!read_sysfs(path, buf, sizeof(buf)) || !parse_cpulist(buf, &shared))
+				continue;
+			CPU_AND(&shared, &shared, &allowed);
+			if(level == 2)
+				l2set = shared;
+			if(level >= llclevel) {
+				llclevel = level;
+				llcset = shared;
+			}
+		}
+		if(!CPU_COUNT(&llcset))
+			CPU_SET(cpu, &llcset);
+		if(!CPU_COUNT(&l2set))
+			l2set = llcset;
+		int d = add_domain(&llc, &nllc, &llcset);
+		int e = add_domain(&l2, &nl2, &l2set);
+		if(d < 0 || e < 0)
+			return;
+		l2[e].parent = d;
+	}
+}
+
+/* Choose where a job will run before its stages are forked. Jobs with an
+ * explicit @cpu= list keep it; otherwise the cache policy assigns the job to
+ * the least-loaded last-level domain, so independent (background) jobs are
+ * spread apart while the stages of one pipeline stay together. */
+void place_job(job_t *j) {
+	int i;
+	if(j->pinned || policy != PLACE_CACHE || j->llc >= 0)
+		return;
+	if(!topology_read)
+		read_topology();
+	if(nllc == 0)
+		return;
+	int best = 0;
+	for(i = 1; i < nllc; i++)
+		if(llc[i].load * llc[best].ncpus < llc[best].load * llc[i].ncpus)
+			best = i;
+	llc[best].load++;
+	j->llc = best;
+}
+
+/* The CPUs a stage of j should run on; false to leave it unrestricted.
+ * A single-stage job may use its whole last-level domain. Pipeline stages
+ * fill the L2 domains of that last-level domain in order, so adjacent
+ * stages share an L2 where the hardware allows and an L3 otherwise. */
+bool placement_cpus(job_t *j, int stage, cpu_set_t *set) {
+	int i;
+
+	if(j->pinned) {
+		*set = j->cpus;
+		return true;
+	}
+	if(j->llc < 0)
+		return false;
+	*set = llc[j->llc].cpus;
+	if(j->first_process && j->first_process->next) {
+		int groups[nl2], ngroups = 0;
+		for(i = 0; i < nl2; i++)
+			if(l2[i].parent == j->llc)
+				groups[ngroups++] = i;
+		if(ngroups > 0) {
+			int per = l2[groups[0]].ncpus;
+			*set = l2[groups[(stage / per) % ngroups]].cpus;
+		}
+	}
+	return true;
+}
+
+/* Called in the child before exec. */
+void apply_placement(job_t *j, int stage) {
+	cpu_set_t set;
+	if(placement_cpus(j, stage, &set))
+		sched_setaffinity(0, sizeof(set), &set);
+}
+
+/* Give back the domain a job was placed on once the job is freed. */
+void release_placement(job_t *j) {
+	if(j->llc >= 0 && j->llc < nllc)
+		llc[j->llc].load--;
+	j->llc = -1;
+}
@@ -0,0 +1,17 @@
+#ifndef __AFFINITY_H__       /* check if this header file is already defined elsewhere */
+#define __AFFINITY_H__
+
+#include "dsh.h"
+
+/* Placement policies, selected with the DSH_PLACEMENT environment variable */
+#define PLACE_NONE  0   /* leave placement to the kernel scheduler (default) */
+#define PLACE_CACHE 1   /* DSH_PLACEMENT=cache: keep pipelines on a shared cache */
+
+void affinity_init();
+bool parse_cpulist(const char *list, cpu_set_t *set);
+void place_job(job_t *j);
+bool placement_cpus(job_t *j, int stage, cpu_set_t *set);
+void apply_placement(job_t *j, int stage);
+void release_placement(job_t *j);
+
+#endif /* __AFFINITY_H__ */
@@ -0,0 +1,343 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <termios.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "aio.h"
+
+/* Asynchronous I/O for what the shell writes itself: the output of
+ * builtins (a cache hit copying its stored output) and the records of the
+ * trace and event logs. aio_write() copies the data into one of a few
+ * AIO_CHUNK buffers and returns; the write completes while the shell goes
+ * on. Writes to one descriptor complete in the order they were made, one
+ * at a time. aio_copy() keeps a read of the source going while the
+ * previous chunks are written, or splices it into a pipe, and reaps
+ * children between completions so that jobs finishing meanwhile are
+ * noticed.
+ *
+ * The operations go through an io_uring set up with raw syscalls. Where
+ * io_uring is not available, or with DSH_AIO=epoll, they are queued the
+ * same way and each is done with read() or write() once epoll says its
+ * descriptor is ready; regular files, which epoll cannot watch, are always
+ * ready. DSH_AIO=0 makes aio_write() a plain write() loop.
+ *
+ * Only the process that called aio_init() uses the ring: a forked child
+ * writes directly. A descriptor must be flushed with aio_flush() before it
+ * is closed. */
+
+static aio_backend_t backend = AIO_OFF;
+static pid_t owner;                     /* the shell; children write directly */
+static aio_slot_t slots[AIO_SLOTS];
+static unsigned long next_seq = 0;
+static int copy_in = -1, copy_out = -1; /* the copy in progress */
+static bool copy_eof, copy_failed;
+static int epfd = -1;
+
+static struct {
+	int fd;
+	unsigned *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+} ring = { -1 };
+
+static bool uring_init() {
+	struct io_uring_params p;
+	size_t len;
+	char *sq;
+
+	memset(&p, 0, sizeof(p));
+	if((ring.fd = syscall(__NR_io_uring_setup, AIO_SLOTS, &p)) < 0)
+		return false;
+	/* one mmap for both rings (5.4), cur_pos reads and writes (5.6), timed waits (5.11) */
+	if(!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_RW_CUR_POS)
+	   || !(p.features & IORING_FEAT_EXT_ARG)) {
+		close(ring.fd);
+		return false;
+	}
+	len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	if(len < p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe))
+		len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	sq = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+	ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+	                 MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+	if(sq == MAP_FAILED || ring.sqes == MAP_FAILED) {
+		close(ring.fd); /* the mappings go with the shell */
+		return false;
+	}
+	ring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	ring.sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	ring.sq_array = (unsigned *)(sq + p.sq_off.array);
+	ring.cq_head = (unsigned *)(sq + p.cq_off.head);
+	ring.cq_tail = (unsigned *)(sq + p.cq_off.tail);
+	ring.cq_mask = (unsigned *)(sq + p.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *)(sq + p.cq_off.cqes);
+	return true;
+}
+
+/* Picks the backend: io_uring unless DSH_AIO says epoll or 0 */
+void aio_init() {
+	char *env = getenv("DSH_AIO");
+	owner = getpid();
+	if(env && (strcmp(env, "0") == 0 || strcmp(env, "off") == 0))
+		return;
+	if((!env || strcmp(env, "epoll") != 0) && uring_init()) {
+		backend = AIO_URING;
+		return;
+	}
+	if((epfd = epoll_create1(EPOLL_CLOEXEC)) >= 0)
+		backend = AIO_EPOLL;
+	else
+		perror("epoll_create1");
+}
+
+aio_backend_t aio_backend() {
+	return backend;
+}
+
+/* A descriptor that polls readable when operations have completed, for
+ * the event loop; -1 if aio is off */
+int aio_fd() {
+	return backend == AIO_URING ? ring.fd : epfd;
+}
+
+static bool write_all(int fd, const char *data, size_t len) {
+	while(len > 0) {
+		ssize_t n = write(fd, data, len);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n <= 0)
+			return false;
+		data += n;
+		len -= n;
+	}
+	return true;
+}
+
+static void submit(aio_slot_t *s) {
+	s->state = SLOT_INFLIGHT;
+	if(backend == AIO_URING) {
+		unsigned tail = *ring.sq_tail, i = tail & *ring.sq_mask;
+		struct io_uring_sqe *e = &ring.sqes[i];
+		memset(e, 0, sizeof(*e));
+		e->opcode = s->reading ? IORING_OP_READ : IORING_OP_WRITE;
+		e->fd = s->fd;
+		e->addr = (unsigned long)(s->buf + s->off);
+		e->len = s->reading ? AIO_CHUNK : s->len - s->off;
+		e->off = (__u64) -1; /* at the file position, like read() and write() */
+		if(s->reading && s->splice) {
+			e->opcode = IORING_OP_SPLICE;
+			e->fd = s->out;
+			e->splice_fd_in = s->fd;
+			e->splice_off_in = (__u64) -1; /* replaces addr */
+		}
+		e->user_data = s - slots;
+		ring.sq_array[i] = i;
+		__atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+		while(syscall(__NR_io_uring_enter, ring.fd, 1, 0, 0, NULL, 0) < 0 && errno == EINTR)
+			;
+	}
+	else {
+		struct epoll_event ev = { s->reading ? EPOLLIN : EPOLLOUT, { .u32 = s - slots } };
+		s->ready = epoll_ctl(epfd, EPOLL_CTL_ADD, s->fd, &ev) < 0; /* e.g. EPERM for a file */
+	}
+}
+
+/* A queued operation waits for the earlier ones on its descriptor, and a
+ * write of a copy also for the reads before it, whose data comes first. */
+static bool blocked(aio_slot_t *s) {
+	int i;
+	for(i = 0; i < AIO_SLOTS; i++) {
+		aio_slot_t *t = &slots[i];
+		if(t == s || t->state == SLOT_FREE)
+			continue;
+		if(t->fd == s->fd && (t->state == SLOT_INFLIGHT || t->seq < s->seq))
+			return true;
+		if(!s->reading && t->reading && t->out == s->fd && t->seq < s->seq)
+			return true;
+	}
+	return false;
+}
+
+static void pump() {
+	int i;
+	for(i = 0; i < AIO_SLOTS; i++)
+		if(slots[i].state == SLOT_QUEUED && !blocked(&slots[i]))
+			submit(&slots[i]);
+}
+
+/* The descriptor failed: what is queued for it is dropped */
+static void fail(int fd) {
+	int i;
+	for(i = 0; i < AIO_SLOTS; i++)
+		if(slots[i].state == SLOT_QUEUED && (slots[i].fd == fd || (slots[i].reading && slots[i].out == fd)))
+			slots[i].state = SLOT_FREE;
+	if(fd == copy_out || fd == copy_in)
+		copy_failed = copy_eof = true;
+}
+
+static void complete(aio_slot_t *s, int res) {
+	s->state = SLOT_FREE;
+	if(res == -EINTR || res == -EAGAIN)
+		s->state = SLOT_QUEUED; /* again */
+	else if(s->reading && s->splice && (res > 0 || res == -EINVAL)) {
+		s->splice = res > 0; /* EINVAL: in cannot be spliced, so read it */
+		s->state = SLOT_QUEUED;
+	}
+	else if(s->reading && res > 0) { /* now write what was read */
+		s->reading = false;
+		s->fd = s->out;
+		s->len = res;
+		s->off = 0;
+		s->state = SLOT_QUEUED;
+	}
+	else if(s->reading) {
+		copy_eof = true;
+		copy_failed |= res < 0;
+	}
+	else if(res <= 0)
+		fail(s->fd);
+	else if((s->off += res) < s->len)
+		s->state = SLOT_QUEUED; /* the rest of a short write */
+	pump();
+}
+
+/* Waits up to ms (-1: without a limit) for operations to complete */
+static void wait_some(int ms) {
+	int i;
+	if(backend == AIO_URING) {
+		struct __kernel_timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+		struct io_uring_getevents_arg arg;
+		unsigned head = *ring.cq_head;
+		memset(&arg, 0, sizeof(arg));
+		arg.ts = ms < 0 ? 0 : (unsigned long) &ts;
+		if(head == __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE))
+			syscall(__NR_io_uring_enter, ring.fd, 0, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+			        &arg, sizeof(arg)); /* ETIME and EINTR just end the wait */
+		while(head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+			struct io_uring_cqe *c = &ring.cqes[head++ & *ring.cq_mask];
+			__u64 slot = c->user_data;
+			int res = c->res;
+			__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+			complete(&slots[slot], res);
+		}
+		return;
+	}
+
+	struct epoll_event ev[AIO_SLOTS];
+	int n = 0;
+	for(i = 0; i < AIO_SLOTS; i++)
+		if(slots[i].state == SLOT_INFLIGHT && slots[i].ready)
+			ev[n++].data.u32 = i;
+	if(n == 0)
+		n = epoll_wait(epfd, ev, AIO_SLOTS, ms);
+	for(i = 0; i < n; i++) {
+		aio_slot_t *s = &slots[ev[i].data.u32];
+		ssize_t r;
+		if(!s->ready)
+			epoll_ctl(epfd, EPOLL_CTL_DEL, s->fd, NULL);
+		r = s->reading ? read(s->fd, s->buf, AIO_CHUNK) : write(s->fd, s->buf + s->off, s->len - s->off);
+		complete(s, r < 0 ? -errno : r);
+	}
+}
+
+static bool busy(int fd) {
+	int i;
+	for(i = 0; i < AIO_SLOTS; i++)
+		if(slots[i].state != SLOT_FREE && (slots[i].fd == fd || (slots[i].reading && slots[i].out == fd)))
+			return true;
+	return false;
+}
+
+/* A free slot with its buffer; NULL if there is none (wait: wait for one) */
+static aio_slot_t *take_slot(bool wait) {
+	int i;
+	for(;;) {
+		for(i = 0; i < AIO_SLOTS; i++)
+			if(slots[i].state == SLOT_FREE) {
+				if(!slots[i].buf && !(slots[i].buf = (char *)malloc(AIO_CHUNK)))
+					return NULL;
+				slots[i].seq = ++next_seq;
+				slots[i].off = slots[i].len = 0;
+				return &slots[i];
+			}
+		if(!wait)
+			return NULL;
+		wait_some(-1);
+	}
+}
+
+/* Queues a write of data to fd. Returns false if it could not be written;
+ * a failure after this returns loses the data, like a failed write(). */
+bool aio_write(int fd, const void *data, size_t len) {
+	const char *d = data;
+	aio_slot_t *s;
+	if(backend == AIO_OFF || getpid() != owner)
+		return write_all(fd, d, len);
+	while(len > 0) {
+		if(!(s = take_slot(true))) {
+			aio_flush(fd); /* no memory: the rest goes directly, after what is queued */
+			return write_all(fd, d, len);
+		}
+		s->reading = false;
+		s->fd = fd;
+		s->out = -1;
+		s->len = len < AIO_CHUNK ? len : AIO_CHUNK;
+		memcpy(s->buf, d, s->len);
+		s->state = SLOT_QUEUED;
+		d += s->len;
+		len -= s->len;
+		pump();
+	}
+	return true;
+}
+
+/* Completes what is done without waiting, and queues what can go next */
+void aio_poll() {
+	if(backend != AIO_OFF && getpid() == owner)
+		wait_some(0);
+}
+
+/* Waits until everything written to fd is done */
+void aio_flush(int fd) {
+	if(backend == AIO_OFF || getpid() != owner)
+		return;
+	while(busy(fd))
+		wait_some(-1);
+}
+
+/* Copies in to out until the end of in, reaping children meanwhile. With
+ * io_uring, a pipe is filled with splices, without a copy through the
+ * shell. Returns false if the copy has to be done some other way: aio is
+ * off. */
+bool aio_copy(int in, int out) {
+	struct stat st;
+	aio_slot_t *s;
+	if(backend == AIO_OFF || getpid() != owner)
+		return false;
+	bool pipe = backend == AIO_URING && fstat(out, &st) == 0 && S_ISFIFO(st.st_mode);
+	copy_in = in;
+	copy_out = out;
+	copy_eof = copy_failed = false;
+	while(!copy_eof || busy(out)) {
+		if(!copy_eof && !busy(in) && (s = take_slot(false))) {
+			s->reading = true; /* the next chunk, while the last ones are written */
+			s->splice = pipe;
+			s->fd = in;
+			s->out = out;
+			s->state = SLOT_QUEUED;
+			pump();
+			continue;
+		}
+		wait_some(AIO_WAIT_MS);
+		reap_children();
+	}
+	copy_in = copy_out = -1;
+	return true;
+}
@@ -0,0 +1,33 @@
+#ifndef __AIO_H__            /* check if this header file is already defined elsewhere */
+#define __AIO_H__
+
+#include "dsh.h"
+
+#define AIO_SLOTS    8          /* operations queued or in flight at once */
+#define AIO_CHUNK    (1 << 18)  /* bytes per read or write */
+#define AIO_WAIT_MS  100        /* longest wait between reaping children during a copy */
+
+typedef enum { AIO_OFF, AIO_URING, AIO_EPOLL } aio_backend_t;
+
+/* One read or write of the shell's own output */
+typedef struct aio_slot {
+        enum { SLOT_FREE, SLOT_QUEUED, SLOT_INFLIGHT } state;
+        bool reading;               /* a read of aio_copy(); a write otherwise */
+        bool splice;                /* io_uring: the read goes straight to out, a pipe */
+        int fd;                     /* descriptor of the current operation */
+        int out;                    /* for a read: where its data goes next */
+        char *buf;                  /* AIO_CHUNK bytes, allocated on first use */
+        size_t len, off;            /* bytes to write and bytes written so far */
+        unsigned long seq;          /* order of the operations on one descriptor */
+        bool ready;                 /* epoll: a file that cannot be polled */
+} aio_slot_t;
+
+void aio_init();
+aio_backend_t aio_backend();
+int aio_fd();
+void aio_poll();
+bool aio_write(int fd, const void *data, size_t len);
+void aio_flush(int fd);
+bool aio_copy(int in, int out);
+
+#endif /* __AIO_H__ */
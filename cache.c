@@ -0,0 +1,349 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <termios.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <limits.h>
+#include "cache.h"
+#include "pipes.h"
+#include "vars.h"
+#include "aio.h"
+
+/* The cache builtin:
+ *
+ *   cache [--key-files FILE... ] [--key-env NAME... ] [--] command [args]
+ *
+ * remembers the stdout and exit status of a command that depends only on
+ * its arguments and inputs. The key hashes the words, the FOO=1 prefixes,
+ * the redirections, the directory, PATH, the named variables and the
+ * device, inode, size and mtime of the named files and of the files the
+ * command reads by redirection. A command whose stdin is a descriptor or
+ * a coprocess has no key and is refused. On a hit the stored output is copied to the
+ * command's stdout, or given to the rest of a pipeline as its stdin,
+ * without spawning anything. On a miss the command runs in the foreground
+ * with its stdout going to the store; a command killed by a signal or
+ * stopped is not stored.
+ *
+ * Entries are files named by the key in DSH_CACHE_DIR (default
+ * $XDG_CACHE_HOME/dsh or ~/.cache/dsh). A hit touches the entry's mtime;
+ * after every store the oldest other entries are removed until the total
+ * is under DSH_CACHE_MAX bytes (default 64M). */
+
+typedef struct cache_key {
+	unsigned long long a, b;    /* two FNV-1a hashes with different seeds */
+} cache_key_t;
+
+static void hash_bytes(cache_key_t *k, const void *data, size_t len) {
+	const unsigned char *s = data;
+	while(len--) {
+		k->a = (k->a ^ *s) * 1099511628211ULL;
+		k->b = (k->b ^ *s++) * 1099511628211ULL;
+	}
+}
+
+/* Strings are hashed with their NUL so that "ab","c" differs from "a","bc" */
+static void hash_str(cache_key_t *k, const char *s) {
+	hash_bytes(k, s ? s : "", s ? strlen(s) + 1 : 1);
+}
+
+static void hash_file(cache_key_t *k, const char *path) {
+	struct stat st;
+	hash_str(k, path);
+	if(stat(path, &st) < 0) {
+		hash_str(k, "(missing)");
+		return;
+	}
+	hash_bytes(k, &st.st_dev, sizeof(st.st_dev));
+	hash_bytes(k, &st.st_ino, sizeof(st.st_ino));
+	hash_bytes(k, &st.st_size, sizeof(st.st_size));
+	hash_bytes(k, &st.st_mtim, sizeof(st.st_mtim));
+}
+
+/* The redirections, with a file read by its identity as --key-files has
+ * it. Returns false if stdin comes from a descriptor or a coprocess, whose
+ * contents cannot be keyed. */
+static bool hash_redirs(cache_key_t *k, process_t *p) {
+	redir_t *r;
+	for(r = p->redirs; r; r = r->next) {
+		if(r->fd == STDIN_FILENO && (r->type == REDIR_DUP || r->type == REDIR_COPROC))
+			return false;
+		hash_bytes(k, &r->type, sizeof(r->type));
+		hash_bytes(k, &r->fd, sizeof(r->fd));
+		hash_bytes(k, &r->target, sizeof(r->target));
+		if(r->type == REDIR_IN)
+			hash_file(k, r->file);
+		else
+			hash_str(k, r->file);
+	}
+	return true;
+}
+
+/* mkdir -p for the store; false if it cannot be created */
+static bool make_dirs(char *path) {
+	char *s;
+	for(s = path + 1; *s; s++)
+		if(*s == '/') {
+			*s = '\0';
+			if(mkdir(path, 0700) < 0 && errno != EEXIST) {
+				*s = '/';
+				return false;
+			}
+			*s = '/';
+		}
+	return mkdir(path, 0700) == 0 || errno == EEXIST;
+}
+
+static bool cache_dir(char *dir, size_t len) {
+	const char *d = var_get("DSH_CACHE_DIR"), *base;
+	int n;
+	if(d && *d)
+		n = snprintf(dir, len, "%s", d);
+	else if((base = var_get("XDG_CACHE_HOME")) && *base)
+		n = snprintf(dir, len, "%s/dsh", base);
+	else if((base = var_get("HOME")) && *base)
+		n = snprintf(dir, len, "%s/.cache/dsh", base);
+	else
+		return false;
+	return n > 0 && (size_t) n < len && make_dirs(dir);
+}
+
+/* Removes the least recently used entries, other than keep, until the
+ * store fits in max */
+static void evict(const char *dir, long max, const char *keep) {
+	typedef struct { char name[40]; off_t size; struct timespec used; } entry_t;
+	entry_t *v = NULL;
+	int n = 0, cap = 0, i;
+	long total = 0;
+	struct dirent *e;
+	char path[PATH_MAX];
+	DIR *d = opendir(dir);
+
+	if(!d)
+		return;
+	while((e = readdir(d))) {
+		struct stat st;
+		if(strlen(e->d_name) != 32 || fstatat(dirfd(d), e->d_name, &st, 0) < 0)
+			continue; /* only entries; temporary files are skipped */
+		if(strcmp(e->d_name, keep) == 0) { /* counted, not removed */
+			total += st.st_size;
+			continue;
+		}
+		if(n == cap) {
+			entry_t *grown = realloc(v, (cap = cap ? cap * 2 : 64) * sizeof(entry_t));
+			if(!grown)
+				break;
+			v = grown;
+		}
+		strcpy(v[n].name, e->d_name);
+		v[n].size = st.st_size;
+		v[n++].used = st.st_mtim;
+		total += st.st_size;
+	}
+	closedir(d);
+	while(total > max && n > 0) {
+		int old = 0;
+		for(i = 1; i < n; i++)
+			if(v[i].used.tv_sec < v[old].used.tv_sec
+			   || (v[i].used.tv_sec == v[old].used.tv_sec && v[i].used.tv_nsec < v[old].used.tv_nsec))
+				old = i;
+		snprintf(path, sizeof(path), "%s/%s", dir, v[old].name);
+		unlink(path);
+		total -= v[old].size;
+		v[old] = v[--n];
+	}
+	free(v);
+}
+
+/* Where the command's stdout would go: its last redirection of fd 1, or
+ * the shell's stdout. Returns -1 for >&-, or if a file cannot be opened. */
+static int stdout_target(process_t *p, bool *owned) {
+	redir_t *r, *last = NULL;
+	*owned = false;
+	for(r = p->redirs; r; r = r->next)
+		if(r->fd == STDOUT_FILENO)
+			last = r;
+	if(!last)
+		return STDOUT_FILENO;
+	switch(last->type) {
+	   case REDIR_DUP:
+		return last->target;
+	   case REDIR_OUT:
+	   case REDIR_APPEND:
+		*owned = true;
+		return open_redir(last);
+	   default:
+		return -1;
+	}
+}
+
+static void copy_out(int in, int out) {
+	char buf[1 << 16];
+	ssize_t n;
+	fflush(stdout);
+	if(aio_copy(in, out))
+		return;
+	while((n = sendfile(out, in, NULL, 1 << 30)) > 0)
+		;
+	if(n < 0) /* e.g. out is a terminal: copy by hand */
+		while((n = read(in, buf, sizeof(buf))) > 0)
+			if(write(out, buf, n) != n)
+				break;
+}
+
+/* Runs the command of jc in the foreground with stdout going to a new
+ * entry at path. Returns the entry opened for reading, or -1 if the
+ * result is not to be stored; *status is the command's status. */
+static int run_and_store(job_t *jc, const char *dir, const char *path, int *status) {
+	char tmp[PATH_MAX];
+	cache_header_t h;
+	redir_t *r, **tail;
+	int fd;
+
+	snprintf(tmp, sizeof(tmp), "%s/tmp.%d", dir, (int) getpid());
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, CACHE_MAGIC, sizeof(h.magic));
+	if((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) < 0
+	   || write(fd, &h, sizeof(h)) != sizeof(h)
+	   || !(r = (redir_t *)calloc(1, sizeof(redir_t))) || !(r->file = strdup(tmp))) {
+		perror(tmp);
+		if(fd >= 0)
+			close(fd);
+		unlink(tmp);
+		free_jobs(jc);
+		*status = 1;
+		return -1;
+	}
+	r->type = REDIR_APPEND; /* after the header, and after the command's own redirections */
+	r->fd = STDOUT_FILENO;
+	for(tail = &jc->first_process->redirs; *tail; tail = &(*tail)->next)
+		;
+	*tail = r;
+
+	*status = start_job(jc); /* frees jc unless the command was stopped */
+	if(*status >= 128) { /* signalled or stopped: not a result */
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+	h.status = *status;
+	if(pwrite(fd, &h, sizeof(h), 0) != sizeof(h) || rename(tmp, path) < 0) {
+		perror(path);
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+	close(fd);
+	if((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+		perror(path);
+		return -1;
+	}
+	long max = CACHE_MAX_DEFAULT;
+	const char *env = var_get("DSH_CACHE_MAX");
+	if(env && (max = parse_size(env)) < 0)
+		max = CACHE_MAX_DEFAULT;
+	evict(dir, max, strrchr(path, '/') + 1); /* not the entry just made */
+	return fd;
+}
+
+/* Runs cache for the first process of j. Returns true when the whole job
+ * is done, with its status in *status. Returns false if the rest of a
+ * pipeline is to run as j, its stdin now being the output. */
+bool cache_builtin(job_t *j, int *status) {
+	process_t *p = j->first_process;
+	cache_key_t k = { 14695981039346656037ULL, 0x6c62272e07bb0142ULL };
+	char cwd[PATH_MAX], dir[PATH_MAX - 40], path[PATH_MAX];
+	bool files = false, owned = false;
+	cache_header_t h;
+	job_t *jc;
+	int i, cmd, fd, out = -1;
+
+	*status = 1;
+	for(i = 1; i < p->argc; ) { /* options: lists up to the next option */
+		if(strcmp(p->argv[i], "--") == 0) {
+			i++;
+			break;
+		}
+		if(strcmp(p->argv[i], "--key-files") != 0 && strcmp(p->argv[i], "--key-env") != 0)
+			break;
+		files = p->argv[i][6] == 'f';
+		for(i++; i < p->argc && strncmp(p->argv[i], "--", 2) != 0; i++)
+			if(files)
+				hash_file(&k, p->argv[i]);
+			else {
+				hash_str(&k, p->argv[i]);
+				hash_str(&k, var_get(p->argv[i]));
+			}
+	}
+	if((cmd = i) >= p->argc) {
+		fprintf(stderr, "usage: cache [--key-files FILE...] [--key-env NAME...] [--] command [args]\n");
+		return true;
+	}
+	if(!getcwd(cwd, sizeof(cwd)) || !cache_dir(dir, sizeof(dir))) {
+		fprintf(stderr, "cache: no directory for the store\n");
+		return true;
+	}
+	hash_str(&k, cwd);
+	hash_str(&k, var_get("PATH"));
+	for(i = 0; i < p->nassigns; i++)
+		hash_str(&k, p->assigns[i]);
+	for(i = cmd; i < p->argc; i++)
+		hash_str(&k, p->argv[i]);
+	if(!hash_redirs(&k, p)) {
+		fprintf(stderr, "cache: %s: stdin is not a file\n", p->argv[cmd]);
+		return true;
+	}
+	snprintf(path, sizeof(path), "%s/%016llx%016llx", dir, k.a, k.b);
+
+	/* the command becomes a job of its own; j keeps the rest of a pipeline */
+	for(i = 0; i < cmd; i++)
+		free(p->argv[i]);
+	memmove(p->argv, p->argv + cmd, (p->argc - cmd + 1) * sizeof(char *));
+	p->argc -= cmd;
+	j->first_process = p->next;
+	p->next = NULL;
+	if(!(jc = (job_t *)malloc(sizeof(job_t))) || !init_job(jc)) {
+		fprintf(stderr, "malloc: no space\n");
+		free(jc);
+		p->next = j->first_process; /* freed with j */
+		j->first_process = p;
+		return true;
+	}
+	strcpy(jc->commandinfo, j->commandinfo);
+	jc->first_process = p;
+	if(!j->first_process && (out = stdout_target(p, &owned)) < 0) {
+		free_jobs(jc);
+		return true;
+	}
+
+	if((fd = open(path, O_RDONLY | O_CLOEXEC)) >= 0) { /* a hit */
+		free_jobs(jc);
+		futimens(fd, NULL); /* most recently used */
+	}
+	else if((fd = run_and_store(jc, dir, path, status)) < 0) {
+		if(owned)
+			close(out);
+		return true;
+	}
+	if(read(fd, &h, sizeof(h)) != sizeof(h) || memcmp(h.magic, CACHE_MAGIC, sizeof(h.magic)) != 0) {
+		fprintf(stderr, "cache: %s: not an entry\n", path);
+		close(fd);
+		if(owned)
+			close(out);
+		return true;
+	}
+	*status = h.status;
+	if(j->first_process) { /* the rest of the pipeline reads the output */
+		j->mystdin = fd;
+		return false;
+	}
+	copy_out(fd, out);
+	close(fd);
+	if(owned)
+		close(out);
+	return true;
+}
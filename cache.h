@@ -0,0 +1,18 @@
+#ifndef __CACHE_H__          /* check if this header file is already defined elsewhere */
+#define __CACHE_H__
+
+#include "dsh.h"
+
+#define CACHE_MAX_DEFAULT (64L << 20) /* store size when DSH_CACHE_MAX is not set */
+#define CACHE_MAGIC "dshcach1"
+
+/* Start of every stored entry; the command's stdout follows */
+typedef struct cache_header {
+        char magic[8];
+        int status;                 /* exit status of the command */
+        int unused;
+} cache_header_t;
+
+bool cache_builtin(job_t *j, int *status);
+
+#endif /* __CACHE_H__ */
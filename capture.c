@@ -0,0 +1,218 @@
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <termios.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include "capture.h"
+#include "pipes.h"
+#include "vars.h"
+#include "aio.h"
+#include "loop.h"
+
+/* Output capture for background jobs, turned on by setting DSH_CAPTURE=1.
+ * The stdout and stderr of a background job go into one pipe that the
+ * event loop drains into a ring holding the last DSH_CAPTURE_MAX bytes of
+ * it (1M by default): in memory while it is small, in a memfd once it
+ * outgrows CAPTURE_MEM. Nothing reaches the terminal or dsh.log while the
+ * job runs; output %n, or jobs -o %n, replays what was kept. At the
+ * terminal a finished job stays in the job list until its output has been
+ * replayed once. */
+
+static char chunk[CAPTURE_CHUNK];   /* one read from a pipe, or one replay */
+
+static void close_pipe(capture_t *c) {
+	loop_unwatch(c->fd);
+	close(c->fd);
+	c->fd = -1;
+}
+
+/* Moves the ring from memory into a memfd that can grow to limit bytes.
+ * Without one the ring stays in memory, as it is. */
+static void spill(capture_t *c) {
+	size_t start = (c->head + c->cap - c->len) % c->cap;
+	size_t first = c->len < c->cap - start ? c->len : c->cap - start;
+	int fd = memfd_create("dsh-output", MFD_CLOEXEC);
+	if(fd < 0 || pwrite(fd, c->buf + start, first, 0) != (ssize_t) first
+	   || pwrite(fd, c->buf, c->len - first, first) != (ssize_t)(c->len - first)) {
+		perror("capture: memfd");
+		if(fd >= 0)
+			close(fd);
+		c->limit = c->cap;
+		return;
+	}
+	free(c->buf);
+	c->buf = NULL;
+	c->memfd = fd;
+	c->head = c->len;
+	c->cap = c->limit;
+}
+
+/* Appends n bytes to the ring, overwriting the oldest once it is full */
+static void keep(capture_t *c, const char *d, size_t n) {
+	c->total += n;
+	if(c->len + n > c->cap && c->cap < c->limit)
+		spill(c);
+	if(c->memfd < 0 && !c->buf && !(c->buf = (char *)malloc(c->cap))) {
+		fprintf(stderr, "malloc: no space\n");
+		return;
+	}
+	if(n > c->cap) { /* only the end of it fits */
+		d += n - c->cap;
+		n = c->cap;
+	}
+	while(n > 0) {
+		size_t k = n < c->cap - c->head ? n : c->cap - c->head;
+		if(c->memfd < 0)
+			memcpy(c->buf + c->head, d, k);
+		else if(pwrite(c->memfd, d, k, c->head) != (ssize_t) k)
+			perror("capture: pwrite"); /* a hole in the replay */
+		c->head = (c->head + k) % c->cap;
+		c->len = c->len + k < c->cap ? c->len + k : c->cap;
+		d += k;
+		n -= k;
+	}
+}
+
+/* One read from the job's pipe. Returns false when there is nothing to
+ * read now, or nothing more at all. */
+static bool take(capture_t *c) {
+	ssize_t n = read(c->fd, chunk, sizeof(chunk));
+	if(n > 0) {
+		keep(c, chunk, n);
+		return true;
+	}
+	if(n == 0 || (errno != EAGAIN && errno != EINTR))
+		close_pipe(c); /* every process of the job closed it */
+	return false;
+}
+
+static void on_output(int fd, unsigned events, void *arg) {
+	take(((job_t *) arg)->capture);
+}
+
+/* Sets up capture for a background job about to be spawned, if
+ * DSH_CAPTURE asks for it. Returns the write end of its pipe, now the
+ * job's stdout and stderr, or -1 if its output goes where it always did. */
+int capture_start(job_t *j) {
+	const char *on = var_get("DSH_CAPTURE"), *max = var_get("DSH_CAPTURE_MAX");
+	long limit = CAPTURE_MAX_DEFAULT;
+	capture_t *c;
+	int fds[2];
+	if(!on || !*on || strcmp(on, "0") == 0)
+		return -1;
+	if(max && (limit = parse_size(max)) <= 0) {
+		fprintf(stderr, "DSH_CAPTURE_MAX: could not fathom %s\n", max);
+		limit = CAPTURE_MAX_DEFAULT;
+	}
+	if(!(c = (capture_t *)calloc(1, sizeof(capture_t)))) {
+		fprintf(stderr, "malloc: no space\n");
+		return -1;
+	}
+	if(pipe2(fds, O_CLOEXEC) < 0) {
+		perror("capture: pipe");
+		free(c);
+		return -1;
+	}
+	/* the read end stays open in the shell, out of the way of redirections */
+	if((c->fd = fcntl(fds[0], F_DUPFD_CLOEXEC, FIRST_SHELL_FD)) < 0)
+		c->fd = fds[0];
+	else
+		close(fds[0]);
+	fcntl(c->fd, F_SETFL, O_NONBLOCK);
+	/* watched before the job exists, so a failure leaves it uncaptured
+	 * rather than with nobody reading its pipe */
+	if(!loop_watch(c->fd, EPOLLIN, on_output, j)) {
+		perror("capture: epoll_ctl");
+		close(c->fd);
+		close(fds[1]);
+		free(c);
+		return -1;
+	}
+	c->memfd = -1;
+	c->limit = limit;
+	c->cap = limit < CAPTURE_MEM ? limit : CAPTURE_MEM;
+	j->capture = c;
+	j->mystdout = j->mystderr = fds[1];
+	return fds[1];
+}
+
+/* Lets go of the write end once the job that was just spawned has it */
+void capture_started(job_t *j, int wfd) {
+	close(wfd); /* only the job writes to it now */
+	j->mystdout = STDOUT_FILENO;
+	j->mystderr = STDERR_FILENO;
+}
+
+/* Drops the capture of a job that is going away */
+void capture_free(job_t *j) {
+	capture_t *c = j->capture;
+	if(!c)
+		return;
+	if(c->fd >= 0)
+		close_pipe(c);
+	if(c->memfd >= 0)
+		close(c->memfd);
+	free(c->buf);
+	free(c);
+	j->capture = NULL;
+}
+
+/* Whether j has output nobody has seen yet, so it must not be forgotten */
+bool capture_pending(job_t *j) {
+	return j->capture && !j->capture->replayed;
+}
+
+/* Writes what c holds to out, oldest first */
+static void replay(capture_t *c, int out) {
+	size_t start = (c->head + c->cap - c->len) % c->cap, done = 0;
+	while(done < c->len) {
+		size_t at = (start + done) % c->cap;
+		size_t k = c->len - done < c->cap - at ? c->len - done : c->cap - at;
+		if(c->memfd < 0)
+			aio_write(out, c->buf + at, k);
+		else {
+			ssize_t n = pread(c->memfd, chunk, k < sizeof(chunk) ? k : sizeof(chunk), at);
+			if(n <= 0) {
+				perror("capture: pread");
+				break;
+			}
+			aio_write(out, chunk, n);
+			k = n;
+		}
+		done += k;
+	}
+	aio_flush(out);
+}
+
+/* output [%job...], and jobs -o [%job...] with first pointing past the -o:
+ * replays the captured output of each job, or of the current one. At the
+ * terminal a finished job is forgotten once its output has been shown. */
+int output_builtin(process_t *p, int first) {
+	int i, status = 0;
+	for(i = first; i == first || i < p->argc; i++) {
+		job_t *j = job_operand("output", i < p->argc ? p->argv[i] : NULL);
+		capture_t *c;
+		if(!j) {
+			status = 1;
+			continue;
+		}
+		if(!(c = j->capture)) {
+			fprintf(stderr, "output: %s: output not captured\n", i < p->argc ? p->argv[i] : "%+");
+			status = 1;
+			continue;
+		}
+		if(job_is_completed(j))
+			while(c->fd >= 0 && take(c))
+				; /* what it wrote just before it exited */
+		if(c->total > c->len)
+			printf("[%llu earlier bytes dropped]\n", c->total - c->len);
+		fflush(stdout);
+		replay(c, STDOUT_FILENO);
+		c->replayed = true; /* update_jobs() may forget it now */
+	}
+	return status;
+}
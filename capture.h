@@ -0,0 +1,30 @@
+#ifndef __CAPTURE_H__        /* check if this header file is already defined elsewhere */
+#define __CAPTURE_H__
+
+#include "dsh.h"
+
+#define CAPTURE_MEM (16 << 10)          /* bytes kept in memory before spilling to a memfd */
+#define CAPTURE_MAX_DEFAULT (1L << 20)  /* bytes kept per job when DSH_CAPTURE_MAX is not set */
+#define CAPTURE_CHUNK (64 << 10)        /* bytes read from a job's pipe at a time */
+
+/* The output of a background job, kept as the last cap bytes of it */
+typedef struct capture {
+        int fd;                     /* read end of the job's pipe; -1 after its end */
+        char *buf;                  /* the ring while it is in memory */
+        int memfd;                  /* the ring once it outgrew CAPTURE_MEM; -1 before */
+        size_t cap;                 /* size of the ring */
+        size_t limit;               /* size it may grow to */
+        size_t head;                /* where the next byte goes */
+        size_t len;                 /* bytes held, at most cap */
+        unsigned long long total;   /* bytes captured in all */
+        bool replayed;              /* shown by output at least once */
+        bool waited;                /* reported by wait; kept only for output */
+} capture_t;
+
+int capture_start(job_t *j);
+void capture_started(job_t *j, int wfd);
+void capture_free(job_t *j);
+bool capture_pending(job_t *j);
+int output_builtin(process_t *p, int first);
+
+#endif /* __CAPTURE_H__ */
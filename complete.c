@@ -0,0 +1,631 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <termios.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <stdint.h>
+#include <poll.h>
+#include <pthread.h>
+#include "complete.h"
+#include "vars.h"
+
+/* Tab completion for the line editor.
+ *
+ * Command names come from a trie of the executables in $PATH. A helper
+ * thread builds it after startup, one directory at a time, and then keeps
+ * it current from inotify events, so nothing is rescanned on a keypress.
+ * When an exported PATH changes the thread builds it anew.
+ * Each name records which $PATH directories hold it, so a name shadowed in
+ * several directories survives the removal of one of them, and each node
+ * counts the names below it, so finding the matches of a prefix and their
+ * common extension costs O(prefix length) plus the matches listed.
+ *
+ * File names come from a small cache of sorted directory listings, marked
+ * stale by the same inotify instance. A listing that is missing or stale
+ * is read by the helper thread too, so a slow or huge directory never
+ * holds up the prompt.
+ *
+ * The prompt never waits on the helper thread: lookups only trylock the
+ * index and report "no completion" while it is busy or has not read what
+ * was asked for yet; the next tab finds it. */
+
+#define MAX_PATH_DIRS 63    /* bit 63 of tnode_t.dirs marks builtins */
+#define BUILTIN_BIT 63
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_ONLYDIR)
+#define DEFAULT_PATH "/usr/local/bin:/usr/bin:/bin"
+
+typedef struct tnode {
+	unsigned char *keys;        /* next byte of each child, sorted */
+	struct tnode **kids;
+	int nkids, cap;
+	uint64_t dirs;              /* $PATH directories holding this name, one bit each */
+	int live;                   /* names ending at or below this node */
+} tnode_t;
+
+typedef struct entry {
+	char *name;
+	bool dir;
+} entry_t;
+
+/* A cached directory listing, most recently used first */
+typedef struct dircache {
+	struct dircache *next;
+	char *path;
+	int wd;                     /* inotify watch descriptor; -1 if none */
+	bool stale;                 /* changed since it was read */
+	bool queued;                /* waiting for the helper thread to read it */
+	int n;
+	entry_t *entries;           /* sorted by name */
+} dircache_t;
+
+static const char *builtins[] = { "cd", "jobs", "fg", "bg", "export", "unset", "coproc", "read", "cache", "wait", "kill", "disown", "output" };
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER; /* guards everything below */
+static tnode_t root;
+static bool ready = false;          /* all of $PATH has been read */
+static char *path_value = NULL;     /* the $PATH indexed */
+static char *path_copy = NULL;      /* path_value cut into path_dirs */
+static char *path_dirs[MAX_PATH_DIRS];
+static int path_wd[MAX_PATH_DIRS];
+static int npath = 0;
+static char *want_path = NULL;      /* a changed $PATH to index; NULL if none */
+static int ifd = -1;                /* inotify instance */
+static int wake[2] = { -1, -1 };    /* the prompt has work for the helper thread */
+static dircache_t *dirs = NULL;
+static int ndirs = 0;
+static unsigned long path_version;  /* var_env_version() when PATH was last compared; prompt only */
+
+/* Returns the child of t for byte c, adding it if asked to */
+static tnode_t *child(tnode_t *t, unsigned char c, bool add) {
+	int lo = 0, hi = t->nkids;
+	while(lo < hi) {
+		int mid = (lo + hi) / 2;
+		if(t->keys[mid] < c)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if(lo < t->nkids && t->keys[lo] == c)
+		return t->kids[lo];
+	if(!add)
+		return NULL;
+	if(t->nkids == t->cap) {
+		int cap = t->cap ? t->cap * 2 : 2;
+		unsigned char *keys = realloc(t->keys, cap);
+		if(!keys)
+			return NULL;
+		t->keys = keys;
+		tnode_t **kids = realloc(t->kids, cap * sizeof(tnode_t *));
+		if(!kids)
+			return NULL;
+		t->kids = kids;
+		t->cap = cap;
+	}
+	tnode_t *k = calloc(1, sizeof(tnode_t));
+	if(!k)
+		return NULL;
+	memmove(t->keys + lo + 1, t->keys + lo, t->nkids - lo);
+	memmove(t->kids + lo + 1, t->kids + lo, (t->nkids - lo) * sizeof(tnode_t *));
+	t->keys[lo] = c;
+	t->kids[lo] = k;
+	t->nkids++;
+	return k;
+}
+
+static void trie_free(tnode_t *t) {
+	int i;
+	for(i = 0; i < t->nkids; i++) {
+		trie_free(t->kids[i]);
+		free(t->kids[i]);
+	}
+	free(t->keys);
+	free(t->kids);
+	memset(t, 0, sizeof(*t));
+}
+
+/* Records whether directory bit d holds the executable name. Nodes are
+ * kept when names go away; their live counts drop to zero instead. */
+static void trie_set(const char *name, int d, bool present) {
+	tnode_t *path[NAME_MAX + 1], *t = &root;
+	int depth = 0, i;
+	if(strlen(name) > NAME_MAX)
+		return;
+	path[depth++] = t;
+	for(; *name; name++) {
+		if(!(t = child(t, (unsigned char) *name, present)))
+			return;
+		path[depth++] = t;
+	}
+	bool was = t->dirs != 0;
+	if(present)
+		t->dirs |= 1ULL << d;
+	else
+		t->dirs &= ~(1ULL << d);
+	int delta = (t->dirs != 0) - was;
+	for(i = 0; i < depth; i++)
+		path[i]->live += delta;
+}
+
+/* Keeps a match for listing while there is room */
+static void add_match(completion_t *c, const char *name, size_t len) {
+	if(c->nlist == COMPLETE_LIST || c->used + len + 1 > sizeof(c->pool))
+		return;
+	char *s = c->pool + c->used;
+	memcpy(s, name, len);
+	s[len] = '\0';
+	c->used += len + 1;
+	c->list[c->nlist++] = s;
+}
+
+static void collect(tnode_t *t, char *name, size_t len, completion_t *c) {
+	int i;
+	if(t->dirs)
+		add_match(c, name, len);
+	for(i = 0; i < t->nkids && c->nlist < COMPLETE_LIST; i++)
+		if(t->kids[i]->live && len < NAME_MAX) {
+			name[len] = t->keys[i];
+			collect(t->kids[i], name, len + 1, c);
+		}
+}
+
+static void complete_command(const char *word, size_t len, completion_t *c) {
+	char name[NAME_MAX + 1];
+	tnode_t *t = &root;
+	size_t i, k = 0;
+	if(len > NAME_MAX)
+		return;
+	for(i = 0; i < len; i++)
+		if(!(t = child(t, (unsigned char) word[i], false)))
+			return;
+	if(!(c->n = t->live))
+		return;
+	/* the common extension runs while exactly one live branch continues */
+	tnode_t *at = t;
+	while(!at->dirs && k < sizeof(c->suffix) - 1) {
+		int live = -1;
+		for(i = 0; i < (size_t) at->nkids; i++)
+			if(at->kids[i]->live) {
+				if(live >= 0)
+					break;
+				live = i;
+			}
+		if(live < 0 || i < (size_t) at->nkids)
+			break;
+		c->suffix[k++] = at->keys[live];
+		at = at->kids[live];
+	}
+	c->suffix[k] = '\0';
+	memcpy(name, word, len);
+	collect(t, name, len, c);
+}
+
+static bool is_exec(const char *dir, const char *name) {
+	char path[PATH_MAX];
+	struct stat st;
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	return stat(path, &st) == 0 && S_ISREG(st.st_mode) && access(path, X_OK) == 0;
+}
+
+/* Adds the executables of one $PATH directory. The directory is read
+ * without the lock; the names go in under it in one batch. */
+static void scan_path_dir(int d) {
+	DIR *dir = opendir(path_dirs[d]);
+	struct dirent *e;
+	char **names = NULL;
+	int n = 0, cap = 0, i;
+	if(!dir)
+		return;
+	while((e = readdir(dir))) {
+		if(e->d_type == DT_DIR || strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0)
+			continue;
+		if(!is_exec(path_dirs[d], e->d_name))
+			continue;
+		if(n == cap) {
+			char **grown = realloc(names, (cap = cap ? cap * 2 : 64) * sizeof(char *));
+			if(!grown)
+				break;
+			names = grown;
+		}
+		if(!(names[n] = strdup(e->d_name)))
+			break;
+		n++;
+	}
+	closedir(dir);
+	pthread_mutex_lock(&lock);
+	for(i = 0; i < n; i++)
+		trie_set(names[i], d, true);
+	pthread_mutex_unlock(&lock);
+	for(i = 0; i < n; i++)
+		free(names[i]);
+	free(names);
+}
+
+static void handle_event(struct inotify_event *ev) {
+	dircache_t *dc;
+	int d;
+	pthread_mutex_lock(&lock);
+	for(dc = dirs; dc; dc = dc->next)
+		if(dc->wd == ev->wd)
+			dc->stale = true;
+	pthread_mutex_unlock(&lock);
+	if(!ev->len)
+		return;
+	for(d = 0; d < npath; d++) {
+		if(path_wd[d] != ev->wd)
+			continue;
+		bool present = !(ev->mask & (IN_DELETE | IN_MOVED_FROM)) && is_exec(path_dirs[d], ev->name);
+		pthread_mutex_lock(&lock);
+		trie_set(ev->name, d, present);
+		pthread_mutex_unlock(&lock);
+	}
+}
+
+/* Splits value, which it takes over, into the $PATH directories; called
+ * with the lock held */
+static void set_path(char *value) {
+	char *dir, *save;
+	free(path_value);
+	free(path_copy);
+	path_value = value;
+	npath = 0;
+	if(!(path_copy = strdup(value)))
+		return;
+	for(dir = strtok_r(path_copy, ":", &save); dir && npath < MAX_PATH_DIRS; dir = strtok_r(NULL, ":", &save))
+		path_wd[npath] = -1, path_dirs[npath++] = dir;
+}
+
+/* Reads and watches every $PATH directory */
+static void index_path() {
+	int d;
+	for(d = 0; d < npath; d++) {
+		/* watch first, so nothing created during the scan is missed */
+		int wd = ifd >= 0 ? inotify_add_watch(ifd, path_dirs[d], WATCH_MASK) : -1;
+		pthread_mutex_lock(&lock);
+		path_wd[d] = wd;
+		pthread_mutex_unlock(&lock);
+		scan_path_dir(d);
+	}
+	pthread_mutex_lock(&lock);
+	ready = true;
+	pthread_mutex_unlock(&lock);
+}
+
+/* Builds the index anew for value, a changed $PATH */
+static void reindex(char *value) {
+	int old[MAX_PATH_DIRS], nold = npath, d, i;
+	dircache_t *dc;
+	memcpy(old, path_wd, sizeof(old));
+	pthread_mutex_lock(&lock);
+	ready = false;
+	trie_free(&root);
+	for(i = 0; i < (int)(sizeof(builtins) / sizeof(builtins[0])); i++)
+		trie_set(builtins[i], BUILTIN_BIT, true);
+	set_path(value);
+	pthread_mutex_unlock(&lock);
+	index_path();
+	/* the watches of directories that left $PATH, unless a listing uses them */
+	pthread_mutex_lock(&lock);
+	for(i = 0; i < nold; i++) {
+		bool used = old[i] < 0;
+		for(d = 0; d < npath && !used; d++)
+			used = path_wd[d] == old[i];
+		for(dc = dirs; dc && !used; dc = dc->next)
+			used = dc->wd == old[i];
+		if(!used)
+			inotify_rm_watch(ifd, old[i]);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+static int cmp_entry(const void *a, const void *b) {
+	return strcmp(((const entry_t *)a)->name, ((const entry_t *)b)->name);
+}
+
+static void free_entries(dircache_t *dc) {
+	int i;
+	for(i = 0; i < dc->n; i++)
+		free(dc->entries[i].name);
+	free(dc->entries);
+	dc->entries = NULL;
+	dc->n = 0;
+}
+
+/* Reads the listing of path into the empty dc */
+static bool read_dir(const char *path, dircache_t *dc) {
+	DIR *dir = opendir(path);
+	struct dirent *e;
+	int cap = 0;
+	if(!dir)
+		return false;
+	while((e = readdir(dir))) {
+		if(strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0)
+			continue;
+		if(dc->n == cap) {
+			entry_t *grown = realloc(dc->entries, (cap = cap ? cap * 2 : 64) * sizeof(entry_t));
+			if(!grown)
+				break;
+			dc->entries = grown;
+		}
+		bool isdir = e->d_type == DT_DIR;
+		if(e->d_type == DT_LNK || e->d_type == DT_UNKNOWN) {
+			struct stat st;
+			isdir = fstatat(dirfd(dir), e->d_name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+		}
+		if(!(dc->entries[dc->n].name = strdup(e->d_name)))
+			break;
+		dc->entries[dc->n++].dir = isdir;
+	}
+	closedir(dir);
+	qsort(dc->entries, dc->n, sizeof(entry_t), cmp_entry);
+	return true;
+}
+
+static bool watched_path_dir(int wd) {
+	int d;
+	for(d = 0; d < npath; d++)
+		if(path_wd[d] == wd)
+			return true;
+	return false;
+}
+
+/* Reads the listings lookup_dir() asked for. A directory is read without
+ * the lock; its listing replaces the old one under it, if it is still
+ * cached. */
+static void scan_dirs() {
+	for(;;) {
+		dircache_t *dc, fresh = { 0 };
+		char *path = NULL;
+		bool ok, added = false;
+		int wd = -1;
+		pthread_mutex_lock(&lock);
+		for(dc = dirs; dc && !dc->queued; dc = dc->next)
+			;
+		if(dc && (path = strdup(dc->path))) {
+			dc->stale = false; /* events from here on mark it stale again */
+			wd = dc->wd;
+		}
+		else if(dc)
+			dc->queued = false;
+		pthread_mutex_unlock(&lock);
+		if(!dc)
+			return;
+		if(!path)
+			continue;
+		if(wd < 0 && ifd >= 0) /* watch first, so nothing is missed */
+			added = (wd = inotify_add_watch(ifd, path, WATCH_MASK)) >= 0;
+		ok = read_dir(path, &fresh);
+		pthread_mutex_lock(&lock);
+		for(dc = dirs; dc && strcmp(dc->path, path) != 0; dc = dc->next)
+			;
+		if(dc) {
+			dc->wd = wd;
+			dc->queued = ok && dc->stale; /* changed while it was read: again */
+			free_entries(dc);
+			dc->entries = fresh.entries;
+			dc->n = fresh.n;
+			fresh.entries = NULL;
+			fresh.n = 0;
+		}
+		else if(added && !watched_path_dir(wd)) /* evicted meanwhile */
+			inotify_rm_watch(ifd, wd);
+		pthread_mutex_unlock(&lock);
+		free_entries(&fresh);
+		free(path);
+	}
+}
+
+/* Serves the prompt's requests: a new $PATH, then directory listings */
+static void serve_requests() {
+	char drain[64], *value;
+	while(read(wake[0], drain, sizeof(drain)) > 0)
+		;
+	pthread_mutex_lock(&lock);
+	value = want_path;
+	want_path = NULL;
+	pthread_mutex_unlock(&lock);
+	if(value)
+		reindex(value);
+	scan_dirs();
+}
+
+/* Builds the index, then follows changes and serves the prompt for as
+ * long as the shell runs */
+static void *index_thread(void *arg) {
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct pollfd pfd[2] = { { wake[0], POLLIN, 0 }, { ifd, POLLIN, 0 } }; /* ifd -1 is skipped */
+	index_path();
+	for(;;) {
+		if(poll(pfd, 2, -1) < 0) {
+			if(errno == EINTR)
+				continue;
+			break;
+		}
+		if(pfd[1].revents & POLLIN) {
+			ssize_t n = read(ifd, buf, sizeof(buf)), off;
+			for(off = 0; off < n; ) {
+				struct inotify_event *ev = (struct inotify_event *)(buf + off);
+				handle_event(ev);
+				off += sizeof(struct inotify_event) + ev->len;
+			}
+		}
+		if(pfd[0].revents & POLLIN)
+			serve_requests();
+	}
+	return NULL;
+}
+
+/* Hands the helper thread work; called with the lock held */
+static void wake_thread() {
+	ssize_t n = write(wake[1], "", 1); /* a full pipe has a wakeup pending already */
+	(void) n;
+}
+
+/* Returns the listing of path (absolute), or NULL while the helper thread
+ * has yet to read it because it is not cached or has changed. The least
+ * recently used listing makes room. */
+static dircache_t *lookup_dir(const char *path) {
+	dircache_t *dc, **link;
+	for(link = &dirs; (dc = *link); link = &dc->next)
+		if(strcmp(dc->path, path) == 0)
+			break;
+	if(dc) {
+		*link = dc->next;
+	} else {
+		if(ndirs == DIRCACHE_MAX) {
+			for(link = &dirs; (*link)->next; link = &(*link)->next)
+				;
+			dc = *link;
+			*link = NULL;
+			if(dc->wd >= 0 && !watched_path_dir(dc->wd))
+				inotify_rm_watch(ifd, dc->wd);
+			free_entries(dc);
+			free(dc->path);
+		} else if(!(dc = (dircache_t *)malloc(sizeof(dircache_t))))
+			return NULL;
+		else
+			ndirs++;
+		dc->entries = NULL;
+		dc->n = 0;
+		dc->stale = true;
+		dc->queued = false;
+		dc->wd = -1;
+		if(!(dc->path = strdup(path))) {
+			free(dc);
+			ndirs--;
+			return NULL;
+		}
+	}
+	dc->next = dirs;
+	dirs = dc;
+	if(dc->stale && !dc->queued) {
+		dc->queued = true;
+		wake_thread();
+	}
+	return dc->queued ? NULL : dc;
+}
+
+/* Completes a file name; false if its directory has not been read yet */
+static bool complete_file(const char *word, size_t len, completion_t *c) {
+	char path[PATH_MAX], cwd[PATH_MAX];
+	const char *slash = memrchr(word, '/', len), *base = slash ? slash + 1 : word;
+	size_t blen = word + len - base, dlen = slash ? (size_t)(slash - word) + 1 : 0;
+	int lo, hi, k;
+
+	if(dlen && word[0] == '/')
+		k = snprintf(path, sizeof(path), "%.*s", (int) dlen, word);
+	else if(getcwd(cwd, sizeof(cwd)))
+		k = snprintf(path, sizeof(path), "%s/%.*s", cwd, (int) dlen, word);
+	else
+		return true;
+	if(k >= (int) sizeof(path))
+		return true;
+	dircache_t *dc = lookup_dir(path);
+	if(!dc)
+		return false;
+	for(lo = 0, hi = dc->n; lo < hi; ) { /* first name not below base */
+		int mid = (lo + hi) / 2;
+		if(strncmp(dc->entries[mid].name, base, blen) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for(; lo < dc->n && strncmp(dc->entries[lo].name, base, blen) == 0; lo++) {
+		entry_t *e = &dc->entries[lo];
+		if(e->name[0] == '.' && (blen == 0 || base[0] != '.'))
+			continue; /* hidden unless asked for */
+		if(c->n++ == 0) {
+			snprintf(c->suffix, sizeof(c->suffix), "%s", e->name + blen);
+			c->dir = e->dir;
+		} else {
+			size_t k = 0;
+			while(c->suffix[k] && c->suffix[k] == e->name[blen + k])
+				k++;
+			c->suffix[k] = '\0';
+		}
+		add_match(c, e->name, strlen(e->name));
+	}
+	return true;
+}
+
+/* Asks for a new index when PATH is exported with another value */
+static void check_path() {
+	const char *value;
+	var_envp(); /* brings var_env_version() up to date */
+	if(var_env_version() == path_version)
+		return;
+	path_version = var_env_version();
+	if(!(value = var_get("PATH")))
+		value = DEFAULT_PATH;
+	if(strcmp(value, want_path ? want_path : path_value ? path_value : "") == 0)
+		return;
+	free(want_path);
+	if((want_path = strdup(value)))
+		wake_thread();
+}
+
+/* Completes line[start..end), a command name in command position and a
+ * file name otherwise. Returns false without waiting if the index is busy
+ * or not built yet. */
+bool complete_word(const char *line, size_t start, size_t end, completion_t *c) {
+	size_t i = start;
+	c->n = c->nlist = 0;
+	c->used = 0;
+	c->suffix[0] = '\0';
+	c->dir = false;
+	while(i > 0 && line[i - 1] == ' ')
+		i--;
+	bool command = (i == 0 || strchr("|;&", line[i - 1])) && !memchr(line + start, '/', end - start);
+	bool found = true;
+	if(wake[1] < 0 || pthread_mutex_trylock(&lock) != 0)
+		return false;
+	if(!command)
+		found = complete_file(line + start, end - start, c);
+	else {
+		check_path();
+		if((found = ready && !want_path))
+			complete_command(line + start, end - start, c);
+	}
+	pthread_mutex_unlock(&lock);
+	return found;
+}
+
+/* Starts indexing $PATH in the background */
+void complete_init() {
+	char *env = getenv("PATH"), *value;
+	pthread_t tid;
+	sigset_t all, old;
+	size_t i;
+
+	if(!(value = strdup(env ? env : DEFAULT_PATH)))
+		return;
+	set_path(value);
+	path_version = var_env_version();
+	for(i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++)
+		trie_set(builtins[i], BUILTIN_BIT, true);
+	if(pipe2(wake, O_CLOEXEC | O_NONBLOCK) < 0) {
+		perror("pipe");
+		return;
+	}
+	if((ifd = inotify_init1(IN_CLOEXEC)) < 0)
+		perror("inotify_init1");
+
+	/* signals stay with the main thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	if(pthread_create(&tid, NULL, index_thread, NULL) != 0) {
+		perror("pthread_create");
+		close(wake[0]);
+		close(wake[1]);
+		wake[0] = wake[1] = -1; /* no completion */
+	}
+	else
+		pthread_detach(tid);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
@@ -0,0 +1,23 @@
+#ifndef __COMPLETE_H__       /* check if this header file is already defined elsewhere */
+#define __COMPLETE_H__
+
+#include "dsh.h"
+
+#define COMPLETE_LIST 64    /* matches kept for listing */
+#define DIRCACHE_MAX 32     /* directories kept in the filename cache */
+
+/* Result of completing one word */
+typedef struct completion {
+        int n;                          /* number of matches */
+        char suffix[MAX_LEN_CMDLINE];   /* text every match adds to the word */
+        bool dir;                       /* the only match is a directory */
+        int nlist;                      /* matches stored in list (at most COMPLETE_LIST) */
+        char *list[COMPLETE_LIST];      /* first matches in order, pointing into pool */
+        char pool[8192];
+        size_t used;                    /* bytes of pool in use */
+} completion_t;
+
+void complete_init();
+bool complete_word(const char *line, size_t start, size_t end, completion_t *c);
+
+#endif /* __COMPLETE_H__ */
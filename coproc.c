@@ -0,0 +1,239 @@
+#include <sys/types.h>
+#include <termios.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include "coproc.h"
+#include "pipes.h"
+#include "vars.h"
+
+/* Coprocesses: coproc NAME cmd starts cmd as a background job whose stdin
+ * and stdout are pipes kept open by the shell. Commands reach them with
+ * >&NAME and <&NAME, and read -u NAME takes one line of the output in the
+ * shell itself, so a filter can answer many queries for one fork. The
+ * shell's ends are close-on-exec; only the redirections hand them on. */
+
+static coproc_t *coprocs = NULL;
+static volatile sig_atomic_t interrupted;
+
+static coproc_t *find_coproc(const char *name) {
+	coproc_t *c;
+	for(c = coprocs; c; c = c->next)
+		if(strcmp(c->name, name) == 0)
+			return c;
+	return NULL;
+}
+
+static void drop_coproc(coproc_t *c) {
+	coproc_t **pc;
+	for(pc = &coprocs; *pc; pc = &(*pc)->next)
+		if(*pc == c) {
+			*pc = c->next;
+			break;
+		}
+	if(c->in >= 0)
+		close(c->in);
+	close(c->out);
+	free(c->name);
+	free(c);
+}
+
+/* Moves a descriptor out of the range users can name (see FIRST_SHELL_FD) */
+static int keep_high(int fd) {
+	int high = fcntl(fd, F_DUPFD_CLOEXEC, FIRST_SHELL_FD);
+	if(high < 0)
+		return fd;
+	close(fd);
+	return high;
+}
+
+/* coproc NAME cmd [args]: j still holds the builtin's own words. Starts
+ * the rest of the job in the background with its ends of two pipes. */
+int start_coproc(job_t *j) {
+	process_t *p = j->first_process;
+	int to[2], from[2];
+	coproc_t *c, *old;
+
+	if(p->argc < 3 || !valid_name(p->argv[1], strlen(p->argv[1]))) {
+		fprintf(stderr, "usage: coproc NAME command [args]\n");
+		return 1;
+	}
+	if(find_lowest_index() < 0) {
+		fprintf(stderr, "dsh: too many jobs\n");
+		return 1;
+	}
+	if(!(c = (coproc_t *)calloc(1, sizeof(coproc_t))) || !(c->name = strdup(p->argv[1]))) {
+		free(c);
+		fprintf(stderr, "malloc: no space\n");
+		return 1;
+	}
+	if(make_pipe(to, 0) < 0) {
+		perror("pipe");
+		free(c->name);
+		free(c);
+		return 1;
+	}
+	if(make_pipe(from, 0) < 0) {
+		perror("pipe");
+		close(to[0]);
+		close(to[1]);
+		free(c->name);
+		free(c);
+		return 1;
+	}
+	if((old = find_coproc(c->name))) /* the old one loses its name */
+		drop_coproc(old);
+
+	free(p->argv[0]);
+	free(p->argv[1]);
+	memmove(p->argv, p->argv + 2, (p->argc - 1) * sizeof(char *)); /* with the NULL */
+	p->argc -= 2;
+	j->bg = true;
+	j->mystdin = to[0];
+	j->mystdout = from[1];
+	spawn_job(j, false);
+	close(to[0]);
+	close(from[1]);
+	j->mystdin = STDIN_FILENO;
+	j->mystdout = STDOUT_FILENO;
+
+	c->pgid = j->pgid;
+	c->in = keep_high(to[1]);
+	c->out = keep_high(from[0]);
+	c->next = coprocs;
+	coprocs = c;
+	return 0;
+}
+
+/* The shell's end of a coprocess's stdout (output) or stdin; -1 if there
+ * is no such coprocess or it has finished. */
+int coproc_fd(const char *name, bool output) {
+	coproc_t *c = find_coproc(name);
+	if(!c)
+		return -1;
+	return output ? c->out : c->in;
+}
+
+/* The job of a coprocess finished: nothing can be written to it anymore,
+ * but what it wrote can still be read. */
+void coproc_released(pid_t pgid) {
+	coproc_t *c;
+	for(c = coprocs; c; c = c->next)
+		if(c->pgid == pgid && c->in >= 0) {
+			close(c->in);
+			c->in = -1;
+		}
+}
+
+static void on_interrupt(int sig) {
+	interrupted = 1;
+}
+
+/* read() that ctrl-c can break even though the shell ignores SIGINT */
+static ssize_t read_interruptible(int fd, void *buf, size_t n) {
+	struct sigaction sa, old;
+	ssize_t r;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_interrupt; /* no SA_RESTART: read() fails with EINTR */
+	sigemptyset(&sa.sa_mask);
+	interrupted = 0;
+	sigaction(SIGINT, &sa, &old);
+	do
+		r = read(fd, buf, n);
+	while(r < 0 && errno == EINTR && !interrupted);
+	sigaction(SIGINT, &old, NULL);
+	return r;
+}
+
+/* Reads one line without its newline into line. Returns its length, -1
+ * at the end of input and -2 when interrupted. A coprocess's output is
+ * read ahead into its buffer; stdin is read a byte at a time so that
+ * nothing after the line is consumed. */
+static ssize_t get_line(coproc_t *c, char *line, size_t cap) {
+	size_t n = 0;
+	ssize_t r;
+	char ch;
+
+	if(!c) {
+		while(n < cap - 1 && (r = read_interruptible(STDIN_FILENO, &ch, 1)) == 1 && ch != '\n')
+			line[n++] = ch;
+		if(r < 0)
+			return interrupted ? -2 : -1;
+		line[n] = '\0';
+		return r == 0 && n == 0 ? -1 : (ssize_t) n;
+	}
+	for(;;) {
+		char *nl = memchr(c->buf + c->start, '\n', c->len);
+		if(nl || c->len == COPROC_BUF) { /* a line, or a full buffer without one */
+			n = nl ? (size_t)(nl - (c->buf + c->start)) : c->len;
+			break;
+		}
+		memmove(c->buf, c->buf + c->start, c->len);
+		c->start = 0;
+		r = read_interruptible(c->out, c->buf + c->len, COPROC_BUF - c->len);
+		if(r < 0 && interrupted)
+			return -2;
+		if(r <= 0) {
+			if(c->len == 0)
+				return -1;
+			n = c->len; /* the last line had no newline */
+			break;
+		}
+		c->len += r;
+	}
+	if(n > cap - 1)
+		n = cap - 1;
+	memcpy(line, c->buf + c->start, n);
+	line[n] = '\0';
+	if(n < c->len && c->buf[c->start + n] == '\n')
+		n++;
+	c->start += n;
+	c->len -= n;
+	return n;
+}
+
+/* read [-u NAME] [var...]: assigns the words of one line to the variables,
+ * the last one getting the rest of the line; REPLY without variables.
+ * Status 1 at the end of input. */
+int read_builtin(process_t *p) {
+	char line[MAX_LEN_CMDLINE], *s;
+	coproc_t *c = NULL;
+	int i = 1;
+	ssize_t n;
+
+	if(p->argc > 2 && strcmp(p->argv[1], "-u") == 0) {
+		if(!(c = find_coproc(p->argv[2]))) {
+			fprintf(stderr, "read: %s: no such coprocess\n", p->argv[2]);
+			return 1;
+		}
+		i = 3;
+	}
+	if((n = get_line(c, line, sizeof(line))) == -2)
+		return 128 + SIGINT;
+	if(n == -1) {
+		if(c) /* all of its output has been read */
+			drop_coproc(c);
+		return 1;
+	}
+	if(i == p->argc) {
+		var_set("REPLY", line);
+		return 0;
+	}
+	for(s = line; i < p->argc; i++) {
+		s += strspn(s, " \t");
+		size_t w = strcspn(s, " \t");
+		if(i == p->argc - 1) /* the rest, less trailing blanks */
+			for(w = strlen(s); w && strchr(" \t", s[w - 1]); w--)
+				;
+		char save = s[w];
+		s[w] = '\0';
+		var_set(p->argv[i], s);
+		s[w] = save;
+		s += w;
+	}
+	return 0;
+}
@@ -0,0 +1,25 @@
+#ifndef __COPROC_H__         /* check if this header file is already defined elsewhere */
+#define __COPROC_H__
+
+#include "dsh.h"
+
+#define COPROC_BUF 4096     /* bytes of coprocess output read ahead by read */
+
+/* A named coprocess: a background job whose stdin and stdout are pipes
+ * held by the shell */
+typedef struct coproc {
+        struct coproc *next;
+        char *name;
+        pid_t pgid;                 /* of its job */
+        int in;                     /* write end of its stdin; -1 once it is gone */
+        int out;                    /* read end of its stdout */
+        char buf[COPROC_BUF];       /* output read but not yet consumed */
+        size_t start, len;
+} coproc_t;
+
+int start_coproc(job_t *j);
+int coproc_fd(const char *name, bool output);
+void coproc_released(pid_t pgid);
+int read_builtin(process_t *p);
+
+#endif /* __COPROC_H__ */
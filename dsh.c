@@ -5,72 +5,113 @@
 #include <stdlib.h> /* for exit() */
 #include <errno.h> /* for errno */
 #include <sys/wait.h> /* for WAIT_ANY */
+#include <sys/epoll.h>
 #include <string.h>
 #include <fcntl.h>
+#include <ctype.h>
+#include <limits.h>
 #include "dsh.h"
-
-int isspace(int c);
+#include "affinity.h"
+#include "pipes.h"
+#include "trace.h"
+#include "evlog.h"
+#include "metrics.h"
+#include "lineedit.h"
+#include "complete.h"
+#include "script.h"
+#include "vars.h"
+#include "wildcard.h"
+#include "coproc.h"
+#include "zygote.h"
+#include "cache.h"
+#include "fuse.h"
+#include "aio.h"
+#include "tty.h"
+#include "loop.h"
+#include "jobspec.h"
+#include "timeout.h"
+#include "capture.h"
 
 /* Keep track of attributes of the shell.  */
 pid_t shell_pgid;
 struct termios shell_tmodes;
 int shell_terminal;
 int shell_is_interactive;
+bool input_eof = false; /* end of input reached at the prompt */
+FILE *input = NULL; /* where command lines come from: stdin or a script */
+int last_status = 0;
 void init_shell();
 void spawn_job(job_t *j, bool fg);
 job_t * find_job(pid_t pgid);
 int job_is_stopped(job_t *j);
 int job_is_completed(job_t *j);
 bool free_job(job_t *j);
-void restore_control(job_t *j);
 void wait_for_job(job_t *j);
 void foreground (job_t *j, int cont);
 void background (job_t *j, int cont);
 int find_lowest_index();
 job_t *find_prev_job(job_t *j);
+bool init_process(process_t *p);
+bool insert_relays(job_t *j);
+void free_redirs(redir_t *r);
+void close_plan(dup_step_t *plan, int n, int infile, int outfile);
+void update_jobs();
+void print_notices();
 /* Initializing the header for the job list. The active jobs are linked into a list. */
 job_t *first_job = NULL;
+/* When the last line of a command was read; for the parse time metric */
+double line_read_at;
+/* Job status notices waiting for the next prompt */
+notice_t *notices = NULL;
+notice_t **notices_tail = &notices;
 pid_t * job_array;
+int job_slots = JOB_SLOTS;
 
 
-/*Finds open spot in job_array
-  returns -1 when array is full
+/*Finds open spot in job_array, doubling it when every slot is taken
+  returns -1 when there is no memory for more
 */
 int find_lowest_index(){
 	int i;
-	for(i=0; i<20; i++){
+	pid_t *grown;
+	for(i=0; i<job_slots; i++){
 		if(!job_array[i])
 			return i;
 	}
-	return -1;
+	if(!(grown = (pid_t *) realloc(job_array, 2 * job_slots * sizeof(pid_t))))
+		return -1;
+	memset(grown + job_slots, 0, job_slots * sizeof(pid_t));
+	job_array = grown;
+	job_slots *= 2;
+	return i;
 }
 
 void remove_and_free(job_t *j){
 	job_t * prev = find_prev_job(j);
-	if(!prev){ //must be first job
-		if(first_job != j){
-			perror("wrong pgid");
-			exit(1);
-		}
-		job_t * tmp = first_job;
-		if (first_job->next) first_job = first_job->next;
-		free_job(tmp);
-		return;
-	}
-	if (j->next) {
-		job_t * tmp;
-		tmp = j->next;
-		j->next = tmp->next;
-		free_job(tmp);
-	} else{
-		prev->next = NULL;
-		free_job(j);
+	if(prev)
+		prev->next = j->next;
+	else if(first_job == j) //must be first job
+		first_job = j->next;
+	else {
+		perror("wrong pgid");
+		exit(1);
 	}
+	free_job(j);
+}
+/* Forgets a job: frees its job_array slot and the job itself. */
+void release_job(job_t *j) {
+	if(j->slot >= 0)
+		job_array[j->slot] = 0;
+	j->slot = -1;
+	jobspec_remove(j);
+	coproc_released(j->pgid);
+	remove_and_free(j);
 }
+
 /* Find the prev job with the indicated pgid.  */
 job_t *find_prev_job(job_t *j) {
 	job_t *  tmp = first_job;
-	while(tmp->next){
+	while(tmp && tmp->next){
 		if(tmp->next == j){
 			return tmp;
 		}
@@ -80,32 +121,37 @@ job_t *find_prev_job(job_t *j) {
 }
 /* Find the job with the indicated pgid.  */
 job_t *find_job(pid_t pgid) {
-
-	job_t *j;
-	for(j = first_job; j; j = j->next)
-		if(j->pgid == pgid)
-	    		return j;
-	return NULL;
+	return jobspec_job(pgid);
 }
 
-int process_status (pid_t pid, int status) {
+/* Records a status reported by wait4(); ru is the process' resource usage */
+int process_status (pid_t pid, int status, struct rusage *ru) {
    job_t *j;
    process_t *p;
  
    if (pid > 0) {
        /* Update the record for the process.  */
-       for (j = first_job; j; j = j->next)
-         for (p = j->first_process; p; p = p->next)
-           if (p->pid == pid) {
+       if ((p = jobspec_process(pid))) {
+               j = p->job;
                p->status = status;
                if (WIFSTOPPED(status)) {
-               	 printf("Got here for WIFSTOPPED!\n");
                	 p->stopped = 1;
+               	 j->notified = false;
+               	 jobspec_touch(j);
+               	 TRACE(trace_instant("stopped", pid, status));
+               	 EVLOG(evlog_stop(j, p));
                } 
                else {
                    p->completed = 1;
+                   TRACE(trace_instant(WIFSIGNALED(status) ? "signaled" : "exited", pid, status));
+                   EVLOG(evlog_exit(j, p, ru));
+                   METRICS(metrics_reaped());
                    if (WIFSIGNALED(status))
                      fprintf (stderr, "%d: Terminated by signal %d.\n", (int) pid, WTERMSIG(p->status));
+                   if (job_is_completed(j)) {
+                     TRACE(trace_job(j, false));
+                     timeout_disarm(j);
+                   }
                }
                return 0;
             }
@@ -151,12 +197,11 @@ job_t *find_last_job() {
 }
 
 void wait_for_job(job_t *j) {
-   int status;
-   pid_t pid;
-   do
-     pid = waitpid(WAIT_ANY, &status, WUNTRACED);
-   while (!process_status(pid, status)&& !job_is_stopped(j)
-          && !job_is_completed(j));
+   if (job_is_completed(j)) return; /* nothing was started, e.g. a redirection failed */
+   reap_children(); /* what exited before the loop could hear of it */
+   /* the loop reaps as SIGCHLD comes and serves timers and output meanwhile */
+   while (!job_is_stopped(j) && !job_is_completed(j))
+     loop_once(-1);
  }
 /* Find the last process in the pipeline (job).  */
 process_t *find_last_process(job_t *j) {
@@ -167,22 +212,55 @@ process_t *find_last_process(job_t *j) {
 	return p;
 }
 
+void free_redirs(redir_t *r) {
+	while(r) {
+		redir_t *next = r->next;
+		free(r->file);
+		free(r);
+		r = next;
+	}
+}
+
 bool free_job(job_t *j) {
 	if(!j)
 		return true;
 	free(j->commandinfo);
-	free(j->ifile);
-	free(j->ofile);
-	process_t *p;
-	for(p = j->first_process; p; p = p->next) {
-		int i;
-		for(i = 0; i < p->argc; i++)
-			free(p->argv[i]);
+	jobspec_unmap(j);
+	timeout_disarm(j);
+	capture_free(j);
+	release_placement(j);
+	if(j->mystdin != STDIN_FILENO) /* stored output from cache */
+		close(j->mystdin);
+	process_t *p, *next;
+	for(p = j->first_process; p; p = next) {
+		next = p->next;
+		free_process(p);
 	}
 	free(j);
 	return true;
 }
 
+void free_process(process_t *p) {
+	int i;
+	for(i = 0; i < p->argc; i++)
+		free(p->argv[i]);
+	free(p->argv);
+	for(i = 0; i < p->nassigns; i++)
+		free(p->assigns[i]);
+	free(p->assigns);
+	free_redirs(p->redirs);
+	free(p);
+}
+
+/* Frees a list of jobs that is not part of the job list, e.g. templates. */
+void free_jobs(job_t *list) {
+	while(list) {
+		job_t *next = list->next;
+		free_job(list);
+		list = next;
+	}
+}
+
 /* Make sure the shell is running interactively as the foreground job
  * before proceeding.  
  * */
@@ -192,7 +270,7 @@ void init_shell() {
   	/* See if we are running interactively.  */
 	shell_terminal = STDIN_FILENO;
 	/* isatty test whether a file descriptor referes to a terminal */
-	shell_is_interactive = isatty(shell_terminal);
+	shell_is_interactive = input == stdin && isatty(shell_terminal);
 
 	if(shell_is_interactive) {
     		/* Loop until we are in the foreground.  */
@@ -206,11 +284,16 @@ void init_shell() {
                  * this background process group.
                  */
 
+		signal(SIGINT, SIG_IGN);
+		signal(SIGQUIT, SIG_IGN);
+		signal(SIGTSTP, SIG_IGN);
+		signal(SIGTTIN, SIG_IGN);
 		signal(SIGTTOU, SIG_IGN);
 
 		/* Put ourselves in our own process group.  */
 		shell_pgid = getpid();
-		if(setpgid(shell_pgid, shell_pgid) < 0) {
+		/* a session leader already leads its group and may not call setpgid */
+		if(getpgrp() != shell_pgid && setpgid(shell_pgid, shell_pgid) < 0) {
 			perror("Couldn't put the shell in its own process group");
 			exit(1);
 		}
@@ -220,11 +303,30 @@ void init_shell() {
 
 		/* Save default terminal attributes for shell.  */
 		tcgetattr(shell_terminal, &shell_tmodes);
+		tty_init(shell_terminal, shell_pgid);
 	}
+	zygote_init(); /* while the shell is small and has no threads */
+	aio_init();
+	loop_init();
+	if(shell_is_interactive)
+		complete_init(); /* index $PATH for tab completion in the background */
+	affinity_init();
+	pipes_init();
+}
+
+/* Clears the stopped marks before a job is continued. */
+void mark_job_as_running(job_t *j) {
+	process_t *p;
+	for(p = j->first_process; p; p = p->next)
+		p->stopped = false;
+	j->notified = false;
 }
 
 /* Sends SIGCONT signal to wake up the blocked job */
 void continue_job(job_t *j) {
+	mark_job_as_running(j);
+	TRACE(trace_instant("continue", j->pgid, 0));
+	EVLOG(evlog_continue(j));
 	if (kill(-j->pgid, SIGCONT) < 0) {
 		printf("ERROR: %s\n", strerror(errno));
 		perror("kill(SIGCONT)"); 
@@ -243,28 +345,135 @@ void continue_job(job_t *j) {
  * subsequent processes in a pipeline.
  * */
 
+/* Opens a file for a redirection, keeping the descriptor out of the range
+ * users can name (see FIRST_SHELL_FD) and closed on exec. */
+int open_redir(redir_t *r) {
+	int flags = O_CLOEXEC;
+	if(r->type == REDIR_IN) flags |= O_RDONLY;
+	else if(r->type == REDIR_OUT) flags |= O_WRONLY | O_CREAT | O_TRUNC;
+	else flags |= O_WRONLY | O_CREAT | O_APPEND;
+	int fd = open(r->file, flags, 0666);
+	if(fd >= 0 && fd < FIRST_SHELL_FD) {
+		int high = fcntl(fd, F_DUPFD_CLOEXEC, FIRST_SHELL_FD);
+		close(fd);
+		fd = high;
+	}
+	if(fd < 0)
+		fprintf(stderr, "%s: %s\n", r->file, strerror(errno));
+	return fd;
+}
+
+/* Precomputes the dup2 plan for a process: its pipe ends and the stderr
+ * of a captured job first, then its redirections in command line order.
+ * Files are opened here, in the shell, so the child only has to run dup2()
+ * calls. Returns the number of steps, or -1 if a file could not be opened. */
+int build_plan(process_t *p, int infile, int outfile, int errfile, dup_step_t *plan) {
+	int n = 0;
+	redir_t *r;
+	if(infile != STDIN_FILENO)
+		plan[n++] = (dup_step_t) { infile, STDIN_FILENO, true };
+	if(outfile != STDOUT_FILENO)
+		plan[n++] = (dup_step_t) { outfile, STDOUT_FILENO, true };
+	if(errfile != STDERR_FILENO) { /* a copy for each process, closed with the plan */
+		if((plan[n].src = fcntl(errfile, F_DUPFD_CLOEXEC, FIRST_SHELL_FD)) < 0) {
+			perror("dup");
+			close_plan(plan, n, infile, outfile);
+			return -1;
+		}
+		plan[n].dst = STDERR_FILENO;
+		plan[n++].owned = true;
+	}
+	for(r = p->redirs; r; r = r->next) {
+		if(n == MAX_PLAN) {
+			fprintf(stderr, "%s: too many redirections\n", p->argv[0]);
+			close_plan(plan, n, infile, outfile);
+			return -1;
+		}
+		switch(r->type) {
+		   case REDIR_DUP:
+			plan[n++] = (dup_step_t) { r->target, r->fd, false };
+			break;
+		   case REDIR_CLOSE:
+			plan[n++] = (dup_step_t) { -1, r->fd, false };
+			break;
+		   case REDIR_COPROC: /* < reads its stdout, > writes its stdin */
+			if((plan[n].src = coproc_fd(r->file, r->target == STDIN_FILENO)) < 0) {
+				fprintf(stderr, "%s: no such coprocess\n", r->file);
+				close_plan(plan, n, infile, outfile);
+				return -1;
+			}
+			plan[n].dst = r->fd;
+			plan[n++].owned = false;
+			break;
+		   default:
+			if((plan[n].src = open_redir(r)) < 0) {
+				close_plan(plan, n, infile, outfile);
+				return -1;
+			}
+			plan[n].dst = r->fd;
+			plan[n++].owned = true;
+		}
+	}
+	return n;
+}
+
+/* Closes the files build_plan() opened; the pipe ends belong to spawn_job(). */
+void close_plan(dup_step_t *plan, int n, int infile, int outfile) {
+	int i;
+	for(i = 0; i < n; i++)
+		if(plan[i].owned && plan[i].src != infile && plan[i].src != outfile)
+			close(plan[i].src);
+}
+
+/* Runs a dup2 plan in the child. A step may overwrite a descriptor that a
+ * later step still reads from (3>&1 followed by a pipe end numbered 3), so
+ * such shell-owned sources are first moved out of the way. Everything the
+ * shell opened is close-on-exec, so no cleanup is needed afterwards. */
+void apply_plan(dup_step_t *plan, int n) {
+	int i, k;
+	for(i = 0; i < n; i++)
+		for(k = 0; plan[i].owned && k < i; k++)
+			if(plan[k].dst == plan[i].src) {
+				plan[i].src = fcntl(plan[i].src, F_DUPFD_CLOEXEC, FIRST_SHELL_FD);
+				break;
+			}
+	for(i = 0; i < n; i++) {
+		if(plan[i].src < 0)
+			close(plan[i].dst);
+		else if(plan[i].src == plan[i].dst)
+			fcntl(plan[i].dst, F_SETFD, 0);
+		else if(dup2(plan[i].src, plan[i].dst) < 0) {
+			fprintf(stderr, "%d: %s\n", plan[i].src, strerror(errno));
+			_exit(1);
+		}
+	}
+}
+
 void spawn_job(job_t *j, bool fg) {
 
 	pid_t pid;
 	process_t *p;
-	int mypipe[2], infile, outfile;
-	int original_input = dup(0);	
-	int original_output = dup(1);
-	infile = j->mystdin;
-	outfile = j->mystdout;
-	if(infile!= STDIN_FILENO) infile = open(j->ifile, O_RDONLY);
-	if(outfile!= STDOUT_FILENO) outfile =open(j->ofile, O_TRUNC | O_CREAT | O_WRONLY, 0666);
-	dup2 (infile, 0);
-	dup2 (outfile, 1);
-	int errfile;
+	int mypipe[2] = { -1, -1 }, infile, outfile;
+	dup_step_t plan[MAX_PLAN];
+	int nplan;
+	int stage = 0;
+	double t_fork = 0;
+	char **envp = var_envp();
+	bool tty = fg && shell_is_interactive; /* the children take the terminal */
 
-	for(p = j->first_process; p; p = p->next) {
+	infile = j->mystdin;
+	if(j->relay && !insert_relays(j)) {
+		fprintf(stderr, "relay: malloc failed\n");
+		return;
+	}
+	place_job(j);
+	for(p = j->first_process; p; p = p->next, stage++) {
 
 		if(p->completed)
 			continue;
 
         if (p->next) {
-           if (pipe (mypipe) < 0) {
+           if (make_pipe (mypipe, j->pipesz) < 0) {
                perror("pipe");
                exit (1);
            }
@@ -273,16 +482,19 @@ void spawn_job(job_t *j, bool fg) {
 
         else outfile = j->mystdout;
 
-		switch (pid = fork()) {
+		TRACE(t_fork = trace_now());
+		/* A redirection that cannot be opened fails only this process */
+		if((nplan = build_plan(p, infile, outfile, j->mystderr, plan)) < 0) {
+			p->completed = true;
+			p->status = 1 << 8; /* exit status 1 */
+		}
+		else switch (pid = zygote_fork(j, p, stage, tty, plan, nplan, envp)) {
 
 		   case -1: /* fork failure */
 			perror("fork");
 			exit(EXIT_FAILURE);
 
 		   case 0: /* child */
-			//printf("Here is the j->pgid %d\n", j->pgid);
-			errfile = open("dsh.log", O_APPEND | O_CREAT | O_WRONLY, 0666);
-			dup2(errfile,2);
 			if ((int) j->pgid < 0){
 				// printf("Updating the job_array!\n");
 				 j->pgid = getpid();
@@ -290,79 +502,136 @@ void spawn_job(job_t *j, bool fg) {
 				 job_array[low] = j->pgid;
 			}
 			p->pid = 0;
-			if (!setpgid(0,j->pgid)) if(fg) tcsetpgrp(shell_terminal, j->pgid); // assign the terminal
+			if (!setpgid(0,j->pgid)) if(tty) tcsetpgrp(shell_terminal, j->pgid); // assign the terminal
 
 			/* Set the handling for job control signals back to the default. */
+			signal(SIGINT, SIG_DFL);
+			signal(SIGQUIT, SIG_DFL);
+			signal(SIGTSTP, SIG_DFL);
+			signal(SIGTTIN, SIG_DFL);
 			signal(SIGTTOU, SIG_DFL);
-
-			if(infile != STDIN_FILENO) {
-				dup2(infile, STDIN_FILENO);
-				close(infile);
+			apply_placement(j, stage);
+
+			/* stdin, stdout and the redirections; stderr stays on dsh.log
+			 * unless redirected */
+			apply_plan(plan, nplan);
+			if(p->relay) {
+				run_relay(STDIN_FILENO, STDOUT_FILENO);
+				_exit(0); /* do not flush the shell's stdio buffers into the pipe */
 			}
-       		if (outfile != STDOUT_FILENO) {
-           		dup2 (outfile, STDOUT_FILENO);
-           		close (outfile);
-	        }
-	        if (j->mystderr != STDERR_FILENO) {
-	           dup2 (j->mystderr, STDERR_FILENO);
-	           close (j->mystderr);
-	        }
 
+			/* execvp searches the PATH of the new environment */
+			environ = p->nassigns ? env_overlay(envp, p->assigns, p->nassigns) : envp;
+			TRACE(trace_exec(p));
      		execvp (p->argv[0], p->argv);
        		perror ("execvp");
-       		exit (1);
+       		_exit (1);
 			/* execute the command through exec_ call */
 
 		   default: /* parent */
 			/* establish child process group here to avoid race
 			* conditions. */
 			p->pid = pid;
+			clock_gettime(CLOCK_MONOTONIC, &p->started);
+			jobspec_map_process(j, p);
 			if (j->pgid < 0) {
 				j->pgid = pid;
-				int low = find_lowest_index();
-				job_array[low] = j->pgid;			
+				j->slot = find_lowest_index();
+				job_array[j->slot] = j->pgid;
+				jobspec_map_job(j);
+				jobspec_add(j);
+				if(!fg)
+					jobspec_touch(j); /* the latest background job is current */
 			}	
 			setpgid(pid, j->pgid);
+			EVLOG(evlog_spawn(j, p));
+			METRICS(metrics_spawned());
+			TRACE(trace_span("fork", t_fork, pid, stage));
 		}
 
 		/* Reset file IOs if necessary */
-
+		if (nplan > 0) close_plan(plan, nplan, infile, outfile);
+		if (infile != j->mystdin) close (infile);
+		if (outfile != j->mystdout) close (outfile);
+		infile = mypipe[0];
 	}
 
-   	if (infile != j->mystdin) close (infile);
-   	if (outfile != j->mystdout) close (outfile);
-	infile = mypipe[0];
-
+	TRACE(trace_job(j, true));
+	METRICS(metrics_jobs(first_job));
+	if(j->pgid > 0)
+		timeout_arm(j);
 	if(fg) foreground (j, 0);
 	else background (j, 0);
-	
-
-	dup2(original_input, 0);
-	dup2(original_output, 1);
-	restore_control(j);
-
-}
-
-void restore_control(job_t *j) {
-    tcsetpgrp (shell_terminal, j->pgid);       
-	tcsetpgrp(shell_terminal, shell_pgid);
-	tcgetattr (shell_terminal, &j->tmodes);
-	tcsetattr (shell_terminal, TCSADRAIN, &shell_tmodes);
 }
 
 bool init_job(job_t *j) {
 	j->next = NULL;
-	if(!(j->commandinfo = (char *)malloc(sizeof(char)*MAX_LEN_CMDLINE)))
+	if(!(j->commandinfo = (char *)calloc(MAX_LEN_CMDLINE, sizeof(char)))) /* strncpy does not terminate it */
 		return false;
 	j->first_process = NULL;
 	j->pgid = -1; 	/* -1 indicates new spawn new job*/
 	j->notified = false;
+	j->kept = false;
+	j->disowned = false;
+	j->touched = 0;
+	j->slot = -1;
+	j->pgid_next = NULL;
 	j->mystdin = STDIN_FILENO; 	/* 0 */
 	j->mystdout = STDOUT_FILENO;	/* 1 */ 
 	j->mystderr = STDERR_FILENO;	/* 2 */
+	j->tmodes = shell_tmodes;	/* until it stops in the foreground */
 	j->bg = false;
-	j->ifile = NULL;
-	j->ofile = NULL;
+	j->pinned = false;
+	j->llc = -1;
+	j->pipesz = default_pipe_size();
+	j->relay = false;
+	j->timeout = 0;
+	j->timeout_sig = SIGTERM;
+	j->grace = TIMEOUT_GRACE_DEFAULT;
+	j->timer = -1;
+	j->timed_out = false;
+	j->capture = NULL;
+	return true;
+}
+
+/* Applies a job attribute given as @name=value on the command line.
+ * Supported: @cpu=LIST pins every process of the job to LIST (e.g. 0-3,6),
+ * @pipesz=SIZE sets the capacity of the job's pipes (e.g. 1M), @relay
+ * puts a splice relay between every two stages, and @timeout=DURATION,
+ * @killsig=SIG and @grace=DURATION limit its wall-clock time (see
+ * timeout.c). */
+bool set_job_attr(job_t *j, char *attr) {
+	if(strncmp(attr, "cpu=", 4) == 0) {
+		if(!parse_cpulist(attr + 4, &j->cpus))
+			return false;
+		j->pinned = true;
+		return true;
+	}
+	if(strncmp(attr, "pipesz=", 7) == 0)
+		return (j->pipesz = parse_size(attr + 7)) >= 0;
+	if(strcmp(attr, "relay") == 0)
+		return (j->relay = true);
+	if(strncmp(attr, "timeout=", 8) == 0)
+		return (j->timeout = parse_duration(attr + 8)) > 0;
+	if(strncmp(attr, "killsig=", 8) == 0)
+		return (j->timeout_sig = signal_number(attr + 8)) > 0;
+	if(strncmp(attr, "grace=", 6) == 0)
+		return (j->grace = parse_duration(attr + 6)) >= 0;
+	return false;
+}
+
+/* Puts a relay process between every two stages of the job. */
+bool insert_relays(job_t *j) {
+	process_t *p, *r;
+	for(p = j->first_process; p && p->next; p = r->next) {
+		if(!(r = (process_t *)malloc(sizeof(process_t))) || !init_process(r)
+		   || !(r->argv[0] = strdup("[relay]")))
+			return false;
+		r->argc = 1;
+		r->relay = true;
+		r->next = p->next;
+		p->next = r;
+	}
 	return true;
 }
 
@@ -372,7 +641,13 @@ bool init_process(process_t *p) {
 	p->stopped = false;
 	p->status = -1; /* set by waitpid */
 	p->argc = 0;
+	p->relay = false;
+	p->redirs = NULL;
+	p->assigns = NULL;
+	p->nassigns = 0;
 	p->next = NULL;
+	p->pid_next = NULL;
+	p->job = NULL;
     if(!(p->argv = (char **)calloc(MAX_ARGS,sizeof(char *)))) return false;
 	return true;
 }
@@ -383,25 +658,113 @@ bool readprocessinfo(process_t *p, char *cmd) {
 	int args_pos = 0; /* iterator for arguments*/
 	int argc = 0;
 	
-	while (isspace(cmd[cmd_pos])){++cmd_pos;} /* ignore any spaces */
+	while (isspace((unsigned char) cmd[cmd_pos])){++cmd_pos;} /* ignore any spaces */
 	if(cmd[cmd_pos] == '\0') return true;
 	
 	while(cmd[cmd_pos] != '\0'){
-		if(!(p->argv[argc] = (char *)calloc(MAX_LEN_CMDLINE, sizeof(char)))) return false;
-		while(cmd[cmd_pos] != '\0' && !isspace(cmd[cmd_pos])) p->argv[argc][args_pos++] = cmd[cmd_pos++];
-		p->argv[argc][args_pos] = '\0';
+		if(argc == MAX_ARGS - 1) return false; /* argv needs a NULL at the end */
+		while(cmd[cmd_pos + args_pos] != '\0' && !isspace((unsigned char) cmd[cmd_pos + args_pos])) ++args_pos;
+		if(!(p->argv[argc] = strndup(cmd + cmd_pos, args_pos))) return false;
+		cmd_pos += args_pos;
 		args_pos = 0;
 		++argc;
-		while (isspace(cmd[cmd_pos])) ++cmd_pos; /* ignore any spaces */
+		while (isspace((unsigned char) cmd[cmd_pos])) ++cmd_pos; /* ignore any spaces */
 	}
 	p->argv[argc] = NULL; /* required for exec_() calls */
 	p->argc = argc;
 	return true;
 }
 
-bool invokefree(job_t *j, char *msg){
+/* Reads the redirection operator at cmdline[pos] (<, >, >>, >&, <&, &> or
+ * &>>) with its file name or descriptor and appends it to the list ending at
+ * *tail. fd is the descriptor named before the operator, or -1 for the
+ * default. Returns the position after the redirection, or -1 on error. */
+int parse_redir(char *cmdline, int pos, int fd, redir_t ***tail) {
+	bool both = false;
+	redir_type_t type;
+	int start, len, target = -1;
+
+	if(cmdline[pos] == '&') { /* &>file: stdout and stderr */
+		both = true;
+		++pos;
+	}
+	if(cmdline[pos++] == '<') {
+		type = REDIR_IN;
+		if(fd < 0) fd = STDIN_FILENO;
+	} else {
+		type = REDIR_OUT;
+		if(fd < 0) fd = STDOUT_FILENO;
+		if(cmdline[pos] == '>') {
+			type = REDIR_APPEND;
+			++pos;
+		}
+	}
+	if(!both && type != REDIR_APPEND && cmdline[pos] == '&') { /* n>&m, n<&m, n>&- */
+		++pos;
+		if(cmdline[pos] == '-')
+			type = REDIR_CLOSE;
+		else if(isdigit((unsigned char) cmdline[pos])) {
+			char *end;
+			long n = strtol(cmdline + pos, &end, 10);
+			/* the whole word, and a descriptor a user may name */
+			if(n >= FIRST_SHELL_FD || (*end && !isspace((unsigned char) *end) && !strchr("|;&<>", *end)))
+				return -1;
+			target = (int) n, type = REDIR_DUP;
+			pos = end - cmdline;
+		}
+		else if(isalpha((unsigned char) cmdline[pos]) || cmdline[pos] == '_') /* >&name, <&name */
+			target = type == REDIR_IN ? STDIN_FILENO : STDOUT_FILENO, type = REDIR_COPROC;
+		else
+			return -1;
+		if(type == REDIR_CLOSE)
+			++pos;
+	}
+	while(cmdline[pos] != '\n' && isspace((unsigned char) cmdline[pos])) ++pos; /* ignore any spaces */
+	start = pos;
+	if(type != REDIR_DUP && type != REDIR_CLOSE)
+		while(cmdline[pos] != '\0' && !isspace((unsigned char) cmdline[pos]) && !strchr("|;&<>", cmdline[pos]))
+			++pos;
+	if(type == REDIR_COPROC && !valid_name(cmdline + start, pos - start))
+		return -1;
+	if((len = pos - start) >= MAX_LEN_FILENAME)
+		return -1;
+	if(type != REDIR_DUP && type != REDIR_CLOSE && len == 0)
+		return -1;
+
+	redir_t *r = (redir_t *)calloc(1, sizeof(redir_t));
+	if(!r || (len && !(r->file = strndup(cmdline + start, len)))) {
+		free(r);
+		return -1;
+	}
+	r->type = type;
+	r->fd = fd;
+	r->target = target;
+	**tail = r;
+	*tail = &r->next;
+	if(both) { /* followed by 2>&1 */
+		if(!(r = (redir_t *)calloc(1, sizeof(redir_t))))
+			return -1;
+		r->type = REDIR_DUP;
+		r->fd = STDERR_FILENO;
+		r->target = STDOUT_FILENO;
+		**tail = r;
+		*tail = &r->next;
+	}
+	return pos;
+}
+
+/* Reports a parse error and drops the job being parsed from list. */
+bool invokefree(job_t **list, job_t *j, char *msg){
+	job_t **link;
 	fprintf(stderr, "%s\n",msg);
-	return free_job(j);
+	if(!j)
+		return *list != NULL;
+	for(link = list; *link && *link != j; link = &(*link)->next)
+		;
+	if(*link)
+		*link = j->next; /* unlink it so nobody runs a freed job */
+	free_job(j);
+	return *list != NULL;
 }
 
 /* Prints the active jobs in the list.  */
@@ -416,13 +779,23 @@ void print_job() {
 			for(i = 1; i < p->argc; i++) 
 				fprintf(stdout, "%s ", p->argv[i]);
 			fprintf(stdout, "\n");
+			redir_t *r;
+			for(r = p->redirs; r; r = r->next) {
+				if(r->type == REDIR_DUP)
+					fprintf(stdout, "redirect: %d>&%d\n", r->fd, r->target);
+				else if(r->type == REDIR_CLOSE)
+					fprintf(stdout, "redirect: %d>&-\n", r->fd);
+				else if(r->type == REDIR_COPROC)
+					fprintf(stdout, "redirect: %d%s&%s\n", r->fd, r->target ? ">" : "<", r->file);
+				else
+					fprintf(stdout, "redirect: %d%s %s\n", r->fd, r->type == REDIR_IN ? "<"
+						: r->type == REDIR_OUT ? ">" : ">>", r->file);
+			}
 		}
 		if(j->bg) fprintf(stdout, "Background job\n");	
 		else fprintf(stdout, "Foreground job\n");	
-		if(j->mystdin == INPUT_FD)
-			fprintf(stdout, "Input file name: %s\n", j->ifile);
-		if(j->mystdout == OUTPUT_FD)
-			fprintf(stdout, "Outpt file name: %s\n", j->ofile);
+		if(j->pinned)
+			fprintf(stdout, "Pinned to %d cpus\n", CPU_COUNT(&j->cpus));
 	}
 }
 
@@ -430,20 +803,19 @@ void print_job() {
  * dsh.h. We tried to make the parser flexible but it is not tested
  * with arbitrary inputs. Be prepared to hack it for the features
  * you may require. The more complicated cases such as parenthesis
- * and grouping are not supported. If the parser found some error, it
- * will always return NULL. 
+ * and grouping are not supported. The jobs read from cmdline are appended
+ * to list; returns false if there were none. Control flow (if, while, for,
+ * case) is handled a level up, by the script compiler in script.c.
  *
  * The parser supports these symbols: <, >, |, &, ;
+ * and the redirections n<file, n>file, n>>file, n>&m, n<&m, n>&-, &>file and
+ * &>>file, which apply to the command of the pipeline they appear in.
+ * A word starting with @ is a job attribute (@name=value), see set_job_attr().
  */
 
-bool readcmdline(char *msg) {
-
-	fprintf(stdout, "%s", msg);
+bool parse_jobs(char *cmdline, job_t **list) {
 
-	char *cmdline = (char *)calloc(MAX_LEN_CMDLINE, sizeof(char));
-	if(!cmdline)
-		return invokefree(NULL, "malloc: no space");
-	fgets(cmdline, MAX_LEN_CMDLINE, stdin);
+	char cmd[MAX_LEN_CMDLINE]; /* the command being read, without redirections and attributes */
 
 	/* sequence is true only when the command line contains ; */
 	bool sequence = false;
@@ -453,35 +825,36 @@ bool readcmdline(char *msg) {
 	int cmdline_pos = 0; /*iterator for command line; */
 
 	while(1) {
-		job_t *current_job = find_last_job();
+		job_t *current_job = *list;
+		while(current_job && current_job->next)
+			current_job = current_job->next;
 
 		int cmd_pos = 0; /* iterator for a command */
-		int iofile_seek = 0; /*iofile_seek for file */
-		bool valid_input = true; /* check for valid input */
+		int attr_start; /* start of a job attribute in cmdline */
+		char attr_end; /* character overwritten while reading an attribute */
+		int redir_fd; /* fd named before a redirection operator; -1 if none */
+		redir_t *redirs = NULL; /* redirections of the command being read */
+		redir_t **redirs_tail = &redirs;
 		bool end_of_input = false; /* check for end of input */
 
 		/* cmdline is NOOP, i.e., just return with spaces */
-		while (isspace(cmdline[cmdline_pos])){++cmdline_pos;} /* ignore any spaces */
-		if(cmdline[cmdline_pos] == '\n' || cmdline[cmdline_pos] == '\0' || feof(stdin))
-			return false;
-
-		char *cmd = (char *)calloc(MAX_LEN_CMDLINE, sizeof(char));
-		if(!cmd)
-			return invokefree(NULL,"malloc: no space");
+		while (isspace((unsigned char) cmdline[cmdline_pos])){++cmdline_pos;} /* ignore any spaces */
+		if(cmdline[cmdline_pos] == '\n' || cmdline[cmdline_pos] == '\0')
+			return *list != NULL;
 
 		job_t *newjob = (job_t *)malloc(sizeof(job_t));
 		if(!newjob)
-			return invokefree(NULL,"malloc: no space");
+			return invokefree(list, NULL,"malloc: no space");
 
-		if(!first_job)
-			first_job = current_job = newjob;
+		if(!*list)
+			*list = current_job = newjob;
 		else {
 			current_job->next = newjob;
 			current_job = current_job->next;
 		}
 
 		if(!init_job(current_job))
-			return invokefree(current_job,"init_job: malloc failed");
+			return invokefree(list, current_job,"init_job: malloc failed");
 
 		process_t *current_process = find_last_process(current_job);
 
@@ -490,56 +863,27 @@ bool readcmdline(char *msg) {
 			switch (cmdline[cmdline_pos]) {
 
 			    case '<': /* input redirection */
-				current_job->ifile = (char *) calloc(MAX_LEN_FILENAME, sizeof(char));
-				if(!current_job->ifile)
-					return invokefree(current_job,"malloc: no space");
-				++cmdline_pos;
-				while (isspace(cmdline[cmdline_pos])){++cmdline_pos;} /* ignore any spaces */
-				iofile_seek = 0;
-				while(cmdline[cmdline_pos] != '\0' && !isspace(cmdline[cmdline_pos])){
-					if(MAX_LEN_FILENAME == iofile_seek)
-						return invokefree(current_job,"input redirection: file length exceeded");
-					current_job->ifile[iofile_seek++] = cmdline[cmdline_pos++];
-				}
-				current_job->ifile[iofile_seek] = '\0';
-				current_job->mystdin = INPUT_FD;
-				while(isspace(cmdline[cmdline_pos])) {
-					if(cmdline[cmdline_pos] == '\n')
-						break;
-					++cmdline_pos;
-				}
-				valid_input = false;
-				break;
-			
 			    case '>': /* output redirection */
-				current_job->ofile = (char *) calloc(MAX_LEN_FILENAME, sizeof(char));
-				if(!current_job->ofile)
-					return invokefree(current_job,"malloc: no space");
-				++cmdline_pos;
-				while (isspace(cmdline[cmdline_pos])){++cmdline_pos;} /* ignore any spaces */
-				iofile_seek = 0;
-				while(cmdline[cmdline_pos] != '\0' && !isspace(cmdline[cmdline_pos])){
-					if(MAX_LEN_FILENAME == iofile_seek) 
-						return invokefree(current_job,"input redirection: file length exceeded");
-					current_job->ofile[iofile_seek++] = cmdline[cmdline_pos++];
-				}
-				current_job->ofile[iofile_seek] = '\0';
-				current_job->mystdout = OUTPUT_FD;
-				while(isspace(cmdline[cmdline_pos])) {
+				/* a single digit word right before the operator names the fd */
+				redir_fd = -1;
+				if(cmd_pos > 0 && isdigit((unsigned char) cmd[cmd_pos-1]) && (cmd_pos == 1 || isspace((unsigned char) cmd[cmd_pos-2])))
+					redir_fd = cmd[--cmd_pos] - '0';
+				if((cmdline_pos = parse_redir(cmdline, cmdline_pos, redir_fd, &redirs_tail)) < 0)
+					return invokefree(list, current_job,"redirection: could not fathom input");
+				while(isspace((unsigned char) cmdline[cmdline_pos])) {
 					if(cmdline[cmdline_pos] == '\n')
 						break;
 					++cmdline_pos;
 				}
-				valid_input = false;
 				break;
 
 			   case '|': /* pipeline */
 				cmd[cmd_pos] = '\0';
 				process_t *newprocess = (process_t *)malloc(sizeof(process_t));
 				if(!newprocess)
-					return invokefree(current_job,"malloc: no space");
+					return invokefree(list, current_job,"malloc: no space");
 				if(!init_process(newprocess))
-					return invokefree(current_job,"init_process: failed");
+					return invokefree(list, current_job,"init_process: failed");
 				if(!current_job->first_process)
 					current_process = current_job->first_process = newprocess;
 				else {
@@ -547,15 +891,24 @@ bool readcmdline(char *msg) {
 					current_process = current_process->next;
 				}
 				if(!readprocessinfo(current_process, cmd))
-					return invokefree(current_job,"parse cmd: error");
+					return invokefree(list, current_job,"parse cmd: error");
+				current_process->redirs = redirs;
+				redirs = NULL;
+				redirs_tail = &redirs;
 				++cmdline_pos;
 				cmd_pos = 0; /*Reinitialze for new cmd */
-				valid_input = true;	
 				break;
 
 			   case '&': /* background job */
+				if(cmdline[cmdline_pos+1] == '>') { /* &>file */
+					if((cmdline_pos = parse_redir(cmdline, cmdline_pos, -1, &redirs_tail)) < 0)
+						return invokefree(list, current_job,"redirection: could not fathom input");
+					while(cmdline[cmdline_pos] != '\n' && isspace((unsigned char) cmdline[cmdline_pos]))
+						++cmdline_pos;
+					break;
+				}
 				current_job->bg = true;
-				while (isspace(cmdline[cmdline_pos])){++cmdline_pos;} /* ignore any spaces */
+				while (isspace((unsigned char) cmdline[cmdline_pos])){++cmdline_pos;} /* ignore any spaces */
 				if(cmdline[cmdline_pos+1] != '\n' && cmdline[cmdline_pos+1] != '\0')
 					fprintf(stderr, "reading bg: extra input ignored");
 				end_of_input = true;
@@ -567,15 +920,33 @@ bool readcmdline(char *msg) {
 				seq_pos = cmdline_pos + 1;
 				break;	
 
+			   case '@': /* job attribute */
+				if(cmd_pos > 0 && !isspace((unsigned char) cmd[cmd_pos-1])) { /* '@' inside a word */
+					if(cmd_pos == MAX_LEN_CMDLINE-1)
+						return invokefree(list, current_job,"reading cmdline: length exceeds the max limit");
+					cmd[cmd_pos++] = cmdline[cmdline_pos++];
+					break;
+				}
+				attr_start = ++cmdline_pos;
+				while(cmdline[cmdline_pos] != '\0' && !isspace((unsigned char) cmdline[cmdline_pos])
+				      && !strchr("|;&<>#", cmdline[cmdline_pos]))
+					++cmdline_pos;
+				attr_end = cmdline[cmdline_pos];
+				cmdline[cmdline_pos] = '\0';
+				if(!set_job_attr(current_job, cmdline + attr_start))
+					return invokefree(list, current_job,"job attribute: could not fathom input");
+				cmdline[cmdline_pos] = attr_end;
+				while(cmdline[cmdline_pos] != '\n' && isspace((unsigned char) cmdline[cmdline_pos]))
+					++cmdline_pos;
+				break;
+
 			   case '#': /* comment */
 				end_of_input = true;
 				break;
 
 			   default:
-				if(!valid_input)
-					return invokefree(current_job,"reading cmdline: could not fathom input");
 				if(cmd_pos == MAX_LEN_CMDLINE-1)
-					return invokefree(current_job,"reading cmdline: length exceeds the max limit");
+					return invokefree(list, current_job,"reading cmdline: length exceeds the max limit");
 				cmd[cmd_pos++] = cmdline[cmdline_pos++];
 				break;
 			}
@@ -585,9 +956,9 @@ bool readcmdline(char *msg) {
 		cmd[cmd_pos] = '\0';
 		process_t *newprocess = (process_t *)malloc(sizeof(process_t));
 		if(!newprocess)
-			return invokefree(current_job,"malloc: no space");
+			return invokefree(list, current_job,"malloc: no space");
 		if(!init_process(newprocess))
-			return invokefree(current_job,"init_process: failed");
+			return invokefree(list, current_job,"init_process: failed");
 
 		if(!current_job->first_process)
 			current_process = current_job->first_process = newprocess;
@@ -596,7 +967,8 @@ bool readcmdline(char *msg) {
 			current_process = current_process->next;
 		}
 		if(!readprocessinfo(current_process, cmd))
-			return invokefree(current_job,"read process info: error");
+			return invokefree(list, current_job,"read process info: error");
+		current_process->redirs = redirs;
 		if(!sequence) {
 			strncpy(current_job->commandinfo,cmdline+seq_pos,cmdline_pos-seq_pos);
 			break;
@@ -607,174 +979,939 @@ bool readcmdline(char *msg) {
 	return true;
 }
 
+static int line_state;       /* LE_MORE until a line or the end of input */
+static char inbuf[MAX_LEN_CMDLINE]; /* read from a script or pipe past the last line */
+static size_t inlen;
+
+/* Keys typed at the prompt go to the line editor */
+static void on_keys(int fd, unsigned events, void *arg) {
+	char in[256];
+	ssize_t n = read(fd, in, sizeof(in));
+	if(n > 0)
+		line_state = lineedit_feed(in, n);
+	else if(n == 0 || (errno != EINTR && errno != EAGAIN))
+		line_state = LE_EOF;
+}
+
+/* More of a script or pipe; LE_EOF at its end */
+static void on_input(int fd, unsigned events, void *arg) {
+	ssize_t n = read(fd, inbuf + inlen, sizeof(inbuf) - 1 - inlen);
+	if(n > 0)
+		inlen += n;
+	else if(n == 0 || (errno != EINTR && errno != EAGAIN))
+		line_state = LE_EOF;
+}
+
+/* Moves the next line of inbuf to buf, the way fgets() would have read it.
+ * Returns false if there is no whole line yet. */
+static bool take_line(char *buf) {
+	char *nl = memchr(inbuf, '\n', inlen);
+	size_t n = nl ? (size_t)(nl - inbuf) + 1 : inlen;
+	if(n == 0 || (!nl && line_state != LE_EOF && inlen < sizeof(inbuf) - 1))
+		return false;
+	memcpy(buf, inbuf, n);
+	buf[n] = '\0';
+	memmove(inbuf, inbuf + n, inlen - n);
+	inlen -= n;
+	return true;
+}
+
+/* Prints the notices of background jobs that finished or stopped while
+ * the prompt was up, above a fresh copy of it */
+static void report_jobs() {
+	update_jobs();
+	if(!notices)
+		return;
+	lineedit_hide();
+	print_notices();
+	fflush(stdout);
+	lineedit_show();
+}
+
+/* Reads one line into buf (MAX_LEN_CMDLINE bytes, newline kept). The
+ * prompt is shown at the terminal and on stdin, but not for a script.
+ * Input is read as the event loop finds it ready, so children are reaped
+ * and at the terminal their notices printed while the shell waits. */
+bool read_line(char *msg, char *buf) {
+	if(shell_is_interactive) {
+		line_state = lineedit_start(msg);
+		if(line_state == LE_MORE && !loop_watch(STDIN_FILENO, EPOLLIN, on_keys, NULL)) {
+			perror("stdin: epoll_ctl");
+			line_state = LE_EOF;
+		}
+		while(line_state == LE_MORE)
+			if(loop_once(-1) && line_state == LE_MORE)
+				report_jobs();
+		loop_unwatch(STDIN_FILENO);
+		lineedit_stop();
+		if(line_state == LE_EOF)
+			return false;
+		snprintf(buf, MAX_LEN_CMDLINE, "%s\n", lineedit_line());
+		history_add(buf);
+		return true;
+	}
+	if(input == stdin) {
+		fprintf(stdout, "%s", msg);
+		fflush(stdout); /* stdout is fully buffered when it is not a terminal */
+	}
+	int fd = fileno(input);
+	bool tried = false, watched = false, got;
+	while(!(got = take_line(buf)) && line_state != LE_EOF) {
+		if(!tried) {
+			tried = true;
+			watched = loop_watch(fd, EPOLLIN, on_input, NULL);
+		}
+		if(watched)
+			loop_once(-1);
+		else
+			on_input(fd, EPOLLIN, NULL); /* a regular file is always ready */
+	}
+	if(watched)
+		loop_unwatch(fd);
+	return got;
+}
+
+/* Reads a command line, plus more lines while an if, while, for or case is
+ * left open, and compiles it. Returns NULL after a syntax error and at the
+ * end of input, which also sets input_eof. */
+program_t *readcmdline(char *msg) {
+	char line[MAX_LEN_CMDLINE], *text = NULL;
+	size_t len = 0;
+	program_t *prog = NULL;
+	int r = COMPILE_MORE;
+
+	while(r == COMPILE_MORE) {
+		if(!read_line(text ? "> " : msg, line)) {
+			input_eof = true;
+			if(text)
+				fprintf(stderr, "syntax error: unexpected end of file\n");
+			break;
+		}
+		if(!text)
+			TRACE(trace_instant("line read", getpid(), 0));
+		/* the clock starts after the last line, not while > lines are typed */
+		METRICS(line_read_at = trace_now());
+		size_t n = strlen(line);
+		char *grown = realloc(text, len + n + 1);
+		if(!grown) {
+			fprintf(stderr, "malloc: no space\n");
+			break;
+		}
+		text = grown;
+		memcpy(text + len, line, n + 1);
+		len += n;
+		r = compile(text, &prog);
+	}
+	free(text);
+	return prog;
+}
+
 /* Build prompt messaage; Change this to include process ID (pid)*/
 char* promptmsg() {
-        int shell_id = (int) shell_pgid;
-   		const char buf[] = "dsh-";
-   		char str [10];
-   		sprintf(str, "%s%d", buf, shell_id);
-        char* first = str;
-        char* second = "$ ";
-        char* both = malloc(strlen(first) + strlen(second) + 2);
-		strcpy(both, first);
-		strcat(both, "");
-		strcat(both, second);
-        return both;
+        static char prompt[32]; /* "dsh-" + any pid + "$ " */
+        snprintf(prompt, sizeof(prompt), "dsh-%d$ ", (int) shell_pgid);
+        return prompt;
 }
 
 
 void foreground (job_t *j, int cont) {
        if (cont) {
-           tcsetattr (shell_terminal, TCSADRAIN, &j->tmodes);
+           tty_give(j);
            continue_job(j);
        }
-     
+       else if (j->pgid > 0)
+           tty_given(j->pgid); /* its processes took the terminal before exec */
+
        wait_for_job (j);
-       restore_control(j);
+       tty_take(j, !job_is_completed(j));
 }
 
 
 void background (job_t *j, int cont) {
        /* Send the job a continue signal, if necessary.  */
-       if (cont)
+       if (cont) {
+         mark_job_as_running(j);
+         TRACE(trace_instant("continue", j->pgid, 0));
+         EVLOG(evlog_continue(j));
          if (kill (-j->pgid, SIGCONT) < 0){
            perror ("kill (SIGCONT)");
            	exit(1);
           }
+       }
 }
 
-void change_directory (job_t *j, int cont) {
-     if(chdir(j->first_process->argv[1])<0){
+int change_directory (job_t *j, int cont) {
+     char *dir = j->first_process->argv[1] ? j->first_process->argv[1] : (char *) var_get("HOME");
+     if(!dir || chdir(dir)<0){
      	perror("chdir error");
-     	exit(1);
+     	return 1;
      }
+     zygote_chdir();
+     return 0;
  }
 
 
-pid_t non_block_update () {
+/* The job named by a job number argument of fg or bg; NULL if there is none. */
+job_t *job_from_arg(char *arg) {
+	char *end;
+	long i;
+	if(!arg)
+		return NULL;
+	i = strtol(arg, &end, 10);
+	if(*end || end == arg || i < 0 || i >= job_slots || !job_array[i])
+		return NULL;
+	return find_job(job_array[i]);
+}
+
+/* The job a wait or kill operand names: a job spec (see jobspec.c), or
+ * the pid of one of its processes; NULL if there is none. */
+job_t *job_from_spec(char *spec) {
+	char *end;
+	long pid;
+	job_t *j;
+	process_t *p;
+	if(spec[0] == '%')
+		return isdigit((unsigned char) spec[1]) ? job_from_arg(spec + 1) : jobspec_find(spec + 1, NULL);
+	pid = strtol(spec, &end, 10);
+	if(*end || end == spec || pid <= 0 || pid > INT_MAX || !(p = jobspec_process(pid)))
+		return NULL;
+	j = p->job;
+	return j->disowned ? NULL : j;
+}
+
+/* Collects the status of every child that changed state, without blocking. */
+void reap_children() {
 	int status;
 	pid_t pid;
-	pid = waitpid(WAIT_ANY, &status, WNOHANG | WUNTRACED);
-	return pid;
+	struct rusage ru;
+	while((pid = wait4(WAIT_ANY, &status, WNOHANG | WUNTRACED, &ru)) > 0)
+		process_status(pid, status, &ru);
+}
 
+/* Slot of the job in job_array, which is also its job number; -1 if none. */
+int job_index(job_t *j) {
+	return j->slot;
 }
 
-void list_jobs (job_t *j, int cont) {
-	pid_t bg_pid;
-	do {
-		bg_pid = non_block_update();
-		if(bg_pid > 0){
-			job_t * job = find_job(bg_pid);
-			job->first_process->completed = 1;
+/* Describes the whole job as jobs and the notifications show it. */
+const char *job_state(job_t *j, char *buf, size_t len) {
+	if(!job_is_completed(j))
+		return job_is_stopped(j) ? "Stopped" : "Running";
+	if(j->timed_out)
+		return "Timed out";
+	int status = find_last_process(j)->status;
+	if(WIFSIGNALED(status))
+		snprintf(buf, len, "%s", strsignal(WTERMSIG(status)));
+	else if(WEXITSTATUS(status))
+		snprintf(buf, len, "Exit %d", WEXITSTATUS(status));
+	else
+		return "Done";
+	return buf;
+}
+
+/* Queues "[n]  State  cmd" to be printed once before the next prompt. */
+void notify_job(job_t *j) {
+	char buf[64], line[MAX_LEN_CMDLINE + 64];
+	notice_t *n = (notice_t *)malloc(sizeof(notice_t));
+	snprintf(line, sizeof(line), "[%d]   %-20s  %s\n", job_index(j), job_state(j, buf, sizeof(buf)), j->commandinfo);
+	if(!n || !(n->msg = strdup(line))) {
+		free(n);
+		return;
+	}
+	n->next = NULL;
+	*notices_tail = n;
+	notices_tail = &n->next;
+}
+
+/* The reaper: picks up finished and stopped children and queues one notice
+ * per job that finished in the background or stopped since the last prompt.
+ * At the terminal finished jobs are freed right away so the job list only
+ * holds live jobs; a script keeps the last JOBS_KEPT of them for wait. */
+void update_jobs() {
+	job_t *j, *next;
+	int kept = 0;
+	reap_children();
+	for(j = first_job; j; j = next) {
+		next = j->next;
+		if(j->pgid < 0)
+			continue; /* not started yet */
+		if(j->disowned) {
+			if(job_is_completed(j))
+				release_job(j); /* reaped, nothing to report */
+		}
+		else if(j->kept) {
+			if(shell_is_interactive && !capture_pending(j))
+				release_job(j); /* its captured output was shown */
+			else
+				kept++;
+		}
+		else if(job_is_completed(j)) {
+			notify_job(j);
+			if(shell_is_interactive && !capture_pending(j))
+				release_job(j);
+			else {
+				j->kept = true;
+				kept++;
+			}
 		}
+		else if(job_is_stopped(j) && !j->notified) {
+			notify_job(j);
+			j->notified = true;
+		}
+	}
+	for(j = first_job; j && kept > JOBS_KEPT; j = next) {
+		next = j->next;
+		if(j->kept) {
+			release_job(j); /* the oldest go first */
+			kept--;
+		}
+	}
+	METRICS(metrics_jobs(first_job));
+}
+
+void print_notices() {
+	while(notices) {
+		notice_t *n = notices;
+		fputs(n->msg, stdout);
+		notices = n->next;
+		free(n->msg);
+		free(n);
 	}
-	while (bg_pid > 0);
+	notices_tail = &notices;
+}
+
+void list_jobs (job_t *j, int cont) {
 	int i;
-	for (i = 0; i < 20; i++) {
+	char buf[64];
+	reap_children();
+	for (i = 0; i < job_slots; i++) {
 		if (job_array[i] != 0) {
 			job_t * temp = find_job(job_array[i]);
-			char* status;
-			if (temp->first_process->stopped) status = "Stopped";
-			else if (temp->first_process->completed) status = "Completed";
-			else status = "Running";
+			if(!temp || (temp->kept && !capture_pending(temp)))
+				continue;
 			char* position = " ";
-			printf("[%d]%s  %s           %s\n", i, position, status, temp->commandinfo);
-			if(temp->first_process->completed){
-				remove_and_free(temp);
-				job_array[i] = 0;
+			printf("[%d]%s  %-20s  %s\n", i, position, job_state(temp, buf, sizeof(buf)), temp->commandinfo);
+			if(job_is_completed(temp) && !capture_pending(temp))
+				release_job(temp); /* reported here, so no notice later */
+			else if(job_is_stopped(temp))
+				temp->notified = true;
+		}
+	}
+}
+
+/* Exit status of a job as $? shows it: 128+n for signal n or a stop, 124
+ * when its @timeout= ran out */
+int job_exit_status(job_t *j) {
+	process_t *p = find_last_process(j);
+	if(!job_is_completed(j))
+		return 128 + SIGTSTP;
+	if(j->timed_out)
+		return TIMEOUT_STATUS;
+	if(WIFSIGNALED(p->status))
+		return 128 + WTERMSIG(p->status);
+	return WEXITSTATUS(p->status);
+}
+
+/* Appends w to p->argv, or the paths it matches if it is a glob pattern
+ * that matches any. Frees w. argv grows past MAX_ARGS as needed. */
+bool add_word(process_t *p, int *cap, char *w) {
+	char **matches = NULL;
+	int n = has_glob(w) ? glob_word(w, &matches) : 0, i;
+
+	if(n < 0 || p->argc + (n ? n : 1) >= *cap) {
+		int want = p->argc + (n > 0 ? n : 1) + 1;
+		char **grown = n < 0 ? NULL : realloc(p->argv, (*cap = want * 2) * sizeof(char *));
+		if(!grown) {
+			for(i = 0; i < n; i++)
+				free(matches[i]);
+			free(matches);
+			free(w);
+			return false;
+		}
+		p->argv = grown;
+	}
+	if(n == 0) /* no match: the word stays as it is */
+		p->argv[p->argc++] = w;
+	else {
+		memcpy(p->argv + p->argc, matches, n * sizeof(char *));
+		p->argc += n;
+		free(matches);
+		free(w);
+	}
+	p->argv[p->argc] = NULL;
+	return true;
+}
+
+/* Instantiates a job template: a new job with the variables in argv and
+ * in file names expanded and the globs in argv replaced by the paths they
+ * match. Words that expand to nothing are dropped, and
+ * NAME=value words before the command move to the process's assigns. */
+job_t *clone_job(job_t *t) {
+	job_t *j = (job_t *)malloc(sizeof(job_t));
+	process_t *tp, **tail;
+	redir_t *r, **rtail;
+	int i;
+
+	if(!j || !init_job(j)) {
+		free(j);
+		return NULL;
+	}
+	strcpy(j->commandinfo, t->commandinfo);
+	j->bg = t->bg;
+	j->cpus = t->cpus;
+	j->pinned = t->pinned;
+	j->pipesz = t->pipesz;
+	j->relay = t->relay;
+	j->timeout = t->timeout;
+	j->timeout_sig = t->timeout_sig;
+	j->grace = t->grace;
+	tail = &j->first_process;
+	for(tp = t->first_process; tp; tp = tp->next) {
+		int cap = MAX_ARGS;
+		process_t *p = (process_t *)malloc(sizeof(process_t));
+		if(!p || !init_process(p)) {
+			free(p);
+			free_job(j);
+			return NULL;
+		}
+		*tail = p;
+		tail = &p->next;
+		for(i = 0; i < tp->argc; i++) {
+			char *w = expand_word(tp->argv[i]);
+			if(!w) {
+				free_job(j);
+				return NULL;
+			}
+			if(p->argc == 0 && assignment(tp->argv[i])) { /* FOO=1 cmd */
+				char **grown = realloc(p->assigns, (p->nassigns + 1) * sizeof(char *));
+				if(!grown) {
+					free(w);
+					free_job(j);
+					return NULL;
+				}
+				p->assigns = grown;
+				p->assigns[p->nassigns++] = w;
+				continue;
+			}
+			if(!*w && *tp->argv[i]) {
+				free(w);
+				continue;
 			}
+			if(!add_word(p, &cap, w)) {
+				free_job(j);
+				return NULL;
+			}
+		}
+		rtail = &p->redirs;
+		for(r = tp->redirs; r; r = r->next) {
+			redir_t *c = (redir_t *)malloc(sizeof(redir_t));
+			if(!c) {
+				free_job(j);
+				return NULL;
+			}
+			*c = *r;
+			c->next = NULL;
+			*rtail = c;
+			rtail = &c->next;
+			if(r->file && !(c->file = expand_word(r->file))) {
+				free_job(j);
+				return NULL;
+			}
+		}
+	}
+	return j;
+}
+
+/* export NAME[=value]...; with no names, lists the environment */
+int export_vars(process_t *p) {
+	int i, status = 0;
+	char **e;
+	if(p->argc == 1)
+		for(e = var_envp(); *e; e++)
+			printf("export %s\n", *e);
+	for(i = 1; i < p->argc; i++) {
+		size_t n = assignment(p->argv[i]);
+		if(n) {
+			p->argv[i][n] = '\0';
+			var_set(p->argv[i], p->argv[i] + n + 1);
 		}
+		else if(!valid_name(p->argv[i], strlen(p->argv[i]))) {
+			fprintf(stderr, "export: %s: not a valid name\n", p->argv[i]);
+			status = 1;
+			continue;
+		}
+		var_export(p->argv[i]);
+	}
+	return status;
+}
+
+static volatile sig_atomic_t wait_interrupted;
+
+static void on_wait_interrupt(int sig) {
+	wait_interrupted = 1;
+}
+
+static void on_wait_expired(int fd, unsigned events, void *arg) {
+	*(bool *) arg = true;
+}
+
+/* Forgets a job wait is done with, unless its captured output has not
+ * been shown yet: then it stays for output, though not for wait */
+static void forget_job(job_t *j) {
+	if(!capture_pending(j))
+		release_job(j);
+	else {
+		j->kept = true;
+		j->capture->waited = true;
+	}
+}
+
+static bool waited(job_t *j) {
+	return j->capture && j->capture->waited;
+}
+
+/* Whether j has finished; if not, notes whether it is still running */
+static bool finished(job_t *j, bool *live) {
+	if(job_is_completed(j))
+		return true;
+	*live = *live || !job_is_stopped(j);
+	return false;
+}
+
+/* For wait -n: a finished job among the operands from argv[from] on, or
+ * among all jobs without operands; NULL if none has finished */
+static job_t *first_finished(process_t *p, int from, bool *live) {
+	job_t *j;
+	int k;
+	*live = false;
+	if(from == p->argc) {
+		for(j = first_job; j; j = j->next)
+			if(j->pgid > 0 && !j->disowned && !waited(j) && finished(j, live))
+				return j;
 	}
+	else
+		for(k = from; k < p->argc; k++)
+			if((j = job_from_spec(p->argv[k])) && j->pgid > 0 && finished(j, live))
+				return j;
+	return NULL;
 }
 
-int main() {
+/* wait [-n] [-t seconds] [%n|pid...]: waits until the jobs named, or all
+ * background jobs, have finished; with -n until the first of them has.
+ * A stopped job counts as done waiting for. The status is that of the last
+ * job waited for (0 for all of them), 127 if there is no such job, 124 when
+ * the -t limit runs out and 128+SIGINT when interrupted. The jobs waited for
+ * are forgotten, without a notice. The shell sleeps in the event loop
+ * meanwhile, woken by children and by the timer. */
+int wait_builtin(process_t *p) {
+	struct sigaction sa, old;
+	int i, status = 0, timer = -1;
+	bool any = false, expired = false, live;
+	job_t *j, *next;
+
+	for(i = 1; i < p->argc && p->argv[i][0] == '-'; i++) {
+		char *end;
+		double secs;
+		if(strcmp(p->argv[i], "--") == 0) {
+			i++;
+			break;
+		}
+		if(strcmp(p->argv[i], "-n") == 0) {
+			any = true;
+			continue;
+		}
+		if(strcmp(p->argv[i], "-t") != 0 || i + 1 == p->argc) {
+			fprintf(stderr, "usage: wait [-n] [-t seconds] [%%n|pid...]\n");
+			return 2;
+		}
+		secs = strtod(p->argv[++i], &end);
+		if(*end || end == p->argv[i] || secs < 0) {
+			fprintf(stderr, "wait: %s: invalid timeout\n", p->argv[i]);
+			return 2;
+		}
+		if(secs * 1000 < 1)
+			expired = true;
+		else if(timer < 0 && (timer = loop_timer(on_wait_expired, &expired)) < 0)
+			perror("wait: timerfd");
+		else
+			loop_arm(timer, (long)(secs * 1000));
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_wait_interrupt; /* no SA_RESTART, so the loop wakes up */
+	sigemptyset(&sa.sa_mask);
+	wait_interrupted = 0;
+	sigaction(SIGINT, &sa, &old);
+
+	if(any) {
+		while(!(j = first_finished(p, i, &live)) && live && !expired && !wait_interrupted)
+			loop_once(-1);
+		status = j ? job_exit_status(j) : live ? 124 : 127;
+		if(j)
+			forget_job(j);
+	}
+	else if(i < p->argc) {
+		for(; i < p->argc; i++) {
+			if(!(j = job_from_spec(p->argv[i]))) {
+				fprintf(stderr, "wait: %s: no such job\n", p->argv[i]);
+				status = 127;
+				continue;
+			}
+			while(!job_is_stopped(j) && !expired && !wait_interrupted)
+				loop_once(-1);
+			if(!job_is_stopped(j)) {
+				status = 124;
+				break;
+			}
+			status = job_exit_status(j);
+			if(job_is_completed(j))
+				forget_job(j);
+		}
+	}
+	else {
+		for(j = first_job; j; j = next) {
+			next = j->next;
+			if(j->pgid <= 0 || j->disowned || waited(j))
+				continue; /* the wait itself, or not a job any more */
+			if(!job_is_stopped(j)) {
+				if(expired || wait_interrupted) {
+					status = 124;
+					break;
+				}
+				loop_once(-1);
+				next = j; /* look again */
+			}
+			else if(job_is_completed(j))
+				forget_job(j);
+		}
+	}
+
+	sigaction(SIGINT, &old, NULL);
+	if(timer >= 0)
+		loop_unwatch(timer);
+	return wait_interrupted ? 128 + SIGINT : status;
+}
+
+/* The job an operand of fg, bg, kill, disown or output names: a job spec, a bare
+ * job number, or without an operand the current job. Reports why there is
+ * none. */
+job_t *job_operand(const char *cmd, char *arg) {
+	bool ambiguous = false;
+	job_t *j;
+	if(!arg)
+		j = jobspec_current(false);
+	else if(arg[0] == '%' && !isdigit((unsigned char) arg[1]))
+		j = jobspec_find(arg + 1, &ambiguous);
+	else
+		j = job_from_arg(arg[0] == '%' ? arg + 1 : arg);
+	if(!j)
+		fprintf(stderr, "%s: %s: %s\n", cmd, arg ? arg : "%+", ambiguous ? "ambiguous job spec" : "no such job");
+	return j;
+}
+
+/* The signal a kill option names: a number, or a name with or without
+ * SIG in any case; -1 if none */
+int signal_number(const char *name) {
+	char *end;
+	long n = strtol(name, &end, 10);
+	int i;
+	if(end != name)
+		return *end || n < 0 || n >= NSIG ? -1 : (int) n;
+	if(strncasecmp(name, "SIG", 3) == 0)
+		name += 3;
+	for(i = 1; i < NSIG; i++)
+		if(sigabbrev_np(i) && strcasecmp(name, sigabbrev_np(i)) == 0)
+			return i;
+	return -1;
+}
+
+/* kill [-SIG | -s SIG] %job|pid..., kill -l: sends SIG, TERM by default,
+ * to the process group of each job or to each pid. A stopped job is
+ * continued after a TERM or HUP so that it gets the signal. */
+int kill_builtin(process_t *p) {
+	int i = 1, sig = SIGTERM, status = 0;
+	char *name = NULL;
+	if(p->argc == 2 && strcmp(p->argv[1], "-l") == 0) {
+		for(sig = 1; sig < NSIG; sig++)
+			if(sigabbrev_np(sig))
+				printf("%s%s", sig > 1 ? " " : "", sigabbrev_np(sig));
+		printf("\n");
+		return 0;
+	}
+	if(i + 1 < p->argc && strcmp(p->argv[i], "-s") == 0)
+		sig = signal_number(name = p->argv[i + 1]), i += 2;
+	else if(i < p->argc && p->argv[i][0] == '-' && strcmp(p->argv[i], "--") != 0)
+		sig = signal_number(name = p->argv[i++] + 1);
+	if(i < p->argc && strcmp(p->argv[i], "--") == 0)
+		i++;
+	if(sig < 0) {
+		fprintf(stderr, "kill: %s: invalid signal\n", name);
+		return 1;
+	}
+	if(i == p->argc) {
+		fprintf(stderr, "usage: kill [-SIG | -s SIG] %%job|pid..., kill -l\n");
+		return 2;
+	}
+	for(; i < p->argc; i++) {
+		char *arg = p->argv[i], *end;
+		job_t *t = NULL;
+		pid_t target;
+		if(arg[0] == '%') {
+			if(!(t = job_operand("kill", arg))) {
+				status = 1;
+				continue;
+			}
+			target = -t->pgid;
+		}
+		else if((target = strtol(arg, &end, 10)) <= 0 || *end) {
+			fprintf(stderr, "kill: %s: not a pid or job spec\n", arg);
+			status = 1;
+			continue;
+		}
+		if(kill(target, sig) < 0) {
+			fprintf(stderr, "kill: %s: %s\n", arg, strerror(errno));
+			status = 1;
+		}
+		else if(t && (sig == SIGTERM || sig == SIGHUP) && !job_is_completed(t) && job_is_stopped(t))
+			continue_job(t);
+	}
+	return status;
+}
+
+/* Stops treating t as a job of the shell */
+static void disown_job(job_t *t) {
+	if(t->slot >= 0)
+		job_array[t->slot] = 0;
+	t->slot = -1;
+	jobspec_remove(t);
+	t->disowned = true;
+	if(!job_is_completed(t) && job_is_stopped(t))
+		continue_job(t); /* nothing could continue it afterwards */
+}
+
+/* disown [-a] [%job...]: the jobs named, the current one without operands
+ * and all of them with -a lose their job number and are no longer
+ * reported, listed or waited for. Their processes are still reaped,
+ * quietly, so none is left a zombie. */
+int disown_builtin(process_t *p) {
+	int i, status = 0;
+	job_t *t;
+	if(p->argc == 2 && strcmp(p->argv[1], "-a") == 0) {
+		for(t = first_job; t; t = t->next)
+			if(t->pgid > 0 && !t->disowned)
+				disown_job(t);
+		return 0;
+	}
+	if(p->argc == 1) {
+		if(!(t = job_operand("disown", NULL)))
+			return 1;
+		disown_job(t);
+	}
+	for(i = 1; i < p->argc; i++) {
+		if((t = job_operand("disown", p->argv[i])))
+			disown_job(t);
+		else
+			status = 1;
+	}
+	return status;
+}
+
+/* :, true and false: builtins when they are the whole job */
+static bool is_status_cmd(const char *cmd) {
+	return strcmp(cmd, ":") == 0 || strcmp(cmd, "true") == 0 || strcmp(cmd, "false") == 0;
+}
+
+/* Runs a job that was just added to the job list: a builtin, or the
+ * processes through spawn_job(). Returns the status for $?. */
+int run_job(job_t *j) {
+	process_t *p = j->first_process;
+	char *cmd = p && p->argc ? p->argv[0] : NULL;
+	int status = 0;
+
+	if(cmd && strcmp(cmd, "cache") == 0) {
+		if(cache_builtin(j, &status)) {
+			remove_and_free(j);
+			return status;
+		}
+		p = j->first_process; /* the rest of a pipeline, reading the output */
+		cmd = p->argc ? p->argv[0] : NULL;
+	}
+	if(!cmd) { /* FOO=1 alone sets a shell variable */
+		int i;
+		for(i = 0; p && i < p->nassigns; i++) {
+			p->assigns[i][assignment(p->assigns[i])] = '\0';
+			var_set(p->assigns[i], p->assigns[i] + strlen(p->assigns[i]) + 1);
+		}
+	}
+	else if(strcmp(cmd, "export") == 0)
+		status = export_vars(p);
+	else if(strcmp(cmd, "coproc") == 0) {
+		if((status = start_coproc(j)) == 0)
+			return 0; /* now a background job */
+	}
+	else if(strcmp(cmd, "read") == 0)
+		status = read_builtin(p);
+	else if(strcmp(cmd, "unset") == 0) {
+		int i;
+		for(i = 1; i < p->argc; i++)
+			var_unset(p->argv[i]);
+	}
+	else if(strcmp(cmd, "cd") == 0)
+		status = change_directory(j, 0);
+	else if(strcmp(cmd, "jobs") == 0 && p->argc > 1 && strcmp(p->argv[1], "-o") == 0)
+		status = output_builtin(p, 2);
+	else if(strcmp(cmd, "jobs") == 0)
+		list_jobs(j, 0);
+	else if(strcmp(cmd, "output") == 0)
+		status = output_builtin(p, 1);
+	else if(strcmp(cmd, "wait") == 0)
+		status = wait_builtin(p);
+	else if(strcmp(cmd, "kill") == 0)
+		status = kill_builtin(p);
+	else if(strcmp(cmd, "disown") == 0)
+		status = disown_builtin(p);
+	else if(is_status_cmd(cmd) && !p->next && !p->redirs) /* alone; otherwise exec'd */
+		status = strcmp(cmd, "false") == 0;
+	else if(strcmp(cmd, "fg") == 0) {
+		job_t *f = job_operand("fg", p->argv[1]);
+		remove_and_free(j); /* the builtin itself is not a job */
+		if(!f)
+			return 1;
+		if(job_is_completed(f)) {
+			fprintf(stderr, "fg: job has terminated\n");
+			return 1;
+		}
+		foreground(f, 1);
+		status = job_exit_status(f);
+		if(job_is_completed(f))
+			release_job(f);
+		return status;
+	}
+	else if(strcmp(cmd, "bg") == 0) {
+		job_t *f = job_operand("bg", p->argv[1]);
+		remove_and_free(j);
+		if(!f)
+			return 1;
+		if(!job_is_stopped(f) || job_is_completed(f)) {
+			fprintf(stderr, "bg: job not suspended\n");
+			return 1;
+		}
+		background(f, 1);
+		jobspec_touch(f);
+		return 0;
+	}
+	else if(find_lowest_index() < 0) {
+		fprintf(stderr, "dsh: too many jobs\n");
+		status = 1;
+	}
+	else if(!timeout_prepare(j)) {
+		perror("timeout: timerfd");
+		status = 1; /* not started without its limit */
+	}
+	else { /* not a builtin */
+		bool bg = j->bg;
+		int wfd;
+		for(p = j->first_process; p; p = p->next)
+			if(p->argc && strcmp(p->argv[0], ":") == 0 && (cmd = strdup("true"))) {
+				free(p->argv[0]); /* : has no program of its own */
+				p->argv[0] = cmd;
+			}
+		wfd = bg ? capture_start(j) : -1;
+		spawn_job(j, !bg);
+		if(wfd >= 0)
+			capture_started(j, wfd);
+		if(bg)
+			return 0;
+		status = job_exit_status(j);
+		/* a finished foreground job must not hold a job_array slot */
+		if(job_is_completed(j))
+			release_job(j);
+		return status;
+	}
+	remove_and_free(j);
+	return status;
+}
+
+/* Adds a new job to the end of the job list and runs it */
+int start_job(job_t *j) {
+	job_t *last = find_last_job();
+	if(last)
+		last->next = j;
+	else
+		first_job = j;
+	return run_job(j);
+}
+
+/* Runs a copy of each job template in turn; returns the last status. */
+int run_jobs(job_t *templates) {
+	job_t *t, *j;
+	for(t = templates; t; t = t->next) {
+		if(!(j = clone_job(t))) {
+			fprintf(stderr, "malloc: no space\n");
+			last_status = 1;
+			continue;
+		}
+		fuse_pipeline(j);
+		last_status = start_job(j);
+	}
+	return last_status;
+}
+
+/* Options: -t file writes a job lifecycle trace to file (see trace.h).
+ * With a script argument, commands are read from the script instead of
+ * stdin. */
+int main(int argc, char **argv) {
+	int opt;
+	char *tracefile = NULL;
+	while((opt = getopt(argc, argv, "t:")) != -1) {
+		switch(opt) {
+		   case 't':
+			tracefile = optarg;
+			break;
+		   default:
+			fprintf(stderr, "usage: %s [-t tracefile] [script]\n", argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	input = stdin;
+	if(optind < argc && !(input = fopen(argv[optind], "re"))) {
+		perror(argv[optind]);
+		exit(EXIT_FAILURE);
+	}
 	int errfile =open(ERRFILE, O_APPEND | O_CREAT | O_WRONLY, 0666);
 	dup2(errfile, 2);
+	vars_init();
 	init_shell();
-	job_array = (pid_t *) malloc(20*sizeof(pid_t));
+	trace_init(tracefile);
+	evlog_init();
+	metrics_init();
+	job_array = (pid_t *) calloc(job_slots, sizeof(pid_t));
 	while(1) {
-		if(!readcmdline(promptmsg())) {
-			if (feof(stdin)) { /* End of file (ctrl-d) */
+		program_t *prog;
+		update_jobs();
+		print_notices();
+		TRACE(trace_flush()); /* write out the last command's events while idle */
+		EVLOG(evlog_flush());
+		TRACE(trace_begin("readcmdline"));
+		prog = readcmdline(promptmsg());
+		TRACE(trace_end("readcmdline"));
+		if(!prog) {
+			if (input_eof) { /* End of file (ctrl-d) */
+				trace_close();
+				evlog_close();
+				metrics_close();
 				fflush(stdout);
 				close(errfile);
-				printf("\n");
-				exit(EXIT_SUCCESS);
+				if(input == stdin)
+					printf("\n");
+				exit(last_status);
              	}
-			continue; /* NOOP; user entered return or spaces with return */
-		}
-
-		job_t * next_job = first_job;
-		while(next_job){
-			if(next_job->pgid ==-1){
-				int lowest = find_lowest_index();
-				//printf("%s %d\n","Lowest index: ", lowest);
-				if(lowest != -1){
-					bool bg = next_job->bg;
-					process_t * p = next_job->first_process;
-					char* cmd = p->argv[0];
-
-					if(strcmp (cmd,"cd") == 0){
-						change_directory(next_job,0);
-						job_t * tmp = next_job;
-						next_job=next_job->next;
-						remove_and_free(tmp); //why are we remove and freeing a built in command 
-						//break;
-						
-					} 
-					else if (strcmp (cmd, "jobs") == 0) {
-						list_jobs(next_job, 0);
-						job_t *tmp = next_job;
-						if (next_job->next) next_job=next_job->next;
-						remove_and_free(tmp); //why are we remove and freeing a built in command 
-						break;
-
-					} 
-
-					else if (strcmp(cmd, "fg") == 0) { 
-						//int num0 = (int) next_job->first_process->argv[0];
-						job_t* j = find_job(job_array[atoi(next_job->first_process->argv[1])]);
-						if(!j){
-							perror("wrong job number");
-							exit(0);
-						}
-						if(!j->first_process->stopped){
-							perror("job not suspended");
-							exit(0);
-						} 
-						foreground(j, 1);
-						job_t *tmp = next_job;
-						if (next_job->next) next_job=next_job->next;
-						remove_and_free(tmp);
-						break;
-
-					}
-
-					else if (strcmp(cmd, "bg") == 0) {
-
-						job_t* j = find_job(job_array[atoi(next_job->first_process->argv[1])]);
-						if(!j){
-							perror("wrong job number");
-							exit(0);
-						}
-						if(!j->first_process->stopped){
-							perror("job not suspended");
-							exit(0);
-						} 
-						background(j, 1);
-						job_t *tmp = next_job;
-						if (next_job->next) next_job=next_job->next;
-						remove_and_free(tmp); //why are we remove and freeing a built in command 
-						break;
-					}
-
-					else {					/*If not built-in*/
-						spawn_job(next_job, !bg);
-						next_job = next_job->next;
-					}
-				}
-			}
-			else next_job = next_job->next;
+			last_status = 2; /* syntax error, already reported */
+			continue;
 		}
+		if(prog->n > 0) /* not a blank line */
+			METRICS(metrics_parsed((trace_now() - line_read_at) / 1e6));
+		run_program(prog);
+		free_program(prog);
 	}
 }
-
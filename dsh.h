@@ -2,25 +2,61 @@
 #define __DSH_H__
 
 #include <stdio.h>
+#include <sys/types.h>
+#include <termios.h>
+#include <sched.h>
+#include <time.h>
 
 /* Max length of input/output file name specified during I/O redirection */
 #define MAX_LEN_FILENAME 80
 
 /*Max length of the command line */
-#define MAX_LEN_CMDLINE 120
+#define MAX_LEN_CMDLINE 4096
 
 #define MAX_ARGS 20 /* Maximum number of arguments to any command */
+#define JOB_SLOTS 20 /* job numbers to start with; job_array doubles when they run out */
+#define JOBS_KEPT 1024 /* finished background jobs a script keeps for wait */
 
 #define ERRFILE "dsh.log"
-/*file descriptors for input and output; the range of fds are from 0 to 1023;
- * 0, 1, 2 are reserved for stdin, stdout, stderr */
-#define INPUT_FD  1000
-#define OUTPUT_FD 1001
+
+#define MAX_REDIRS 10 /* Maximum number of redirections on one command */
+#define MAX_PLAN (MAX_REDIRS + 3) /* descriptor steps for one process: stdin, stdout, stderr, redirections */
+/* Descriptors the shell opens for a child are kept at or above this number,
+ * above the single-digit descriptors a user can name in a redirection */
+#define FIRST_SHELL_FD 10
 
 /* using bool as built-in; char is better in terms of space utilization, but
  * code is not succint */
 typedef enum { false, true } bool;
 
+/* Kinds of redirection. n defaults to 0 for < and to 1 for > */
+typedef enum {
+        REDIR_IN,                   /* n<file */
+        REDIR_OUT,                  /* n>file */
+        REDIR_APPEND,               /* n>>file */
+        REDIR_DUP,                  /* n>&m or n<&m */
+        REDIR_CLOSE,                /* n>&- or n<&- */
+        REDIR_COPROC                /* n>&name or n<&name: a coprocess's stdin or stdout */
+} redir_type_t;
+
+/* One redirection of a process, applied in command line order.
+ * &>file is stored as 1>file followed by 2>&1. */
+typedef struct redir {
+        struct redir *next;
+        redir_type_t type;
+        int fd;                     /* descriptor being redirected */
+        int target;                 /* source descriptor for REDIR_DUP */
+        char *file;                 /* file name for REDIR_IN, REDIR_OUT and REDIR_APPEND;
+                                       coprocess name for REDIR_COPROC */
+} redir_t;
+
+/* One step of the dup2 plan run in a child before exec: dup2(src, dst),
+ * or close(dst) when src is -1. */
+typedef struct dup_step {
+        int src, dst;
+        bool owned;                 /* src was opened by the shell (pipe or file) */
+} dup_step_t;
+
 /* A process is a single process.  */
 typedef struct process {
         struct process *next;       /* next process in pipeline */
@@ -30,6 +66,13 @@ typedef struct process {
         bool completed;             /* true if process has completed */
         bool stopped;               /* true if process has stopped */
         int status;                 /* reported status value from job control; 0 on success and nonzero otherwise */
+        bool relay;                 /* true for a shell-side splice relay between two stages */
+        redir_t *redirs;            /* redirections, in command line order */
+        char **assigns;             /* NAME=value words before the command, for its environment only */
+        int nassigns;
+        struct timespec started;    /* CLOCK_MONOTONIC time of the fork */
+        struct process *pid_next;   /* chain in the pid map (see jobspec.c) */
+        struct job *job;            /* its job, while in the pid map */
 } process_t;
 
 /* A job is a process itself or a pipeline of processes.
@@ -42,13 +85,69 @@ typedef struct job {
         process_t *first_process;   /* list of processes in this job */
         pid_t pgid;                 /* process group ID */
         bool notified;              /* true if user was informed about stopped job */
+        bool kept;                  /* finished in the background and reported; kept for wait */
+        bool disowned;              /* no longer a job of the shell; reaped quietly */
+        unsigned long touched;      /* when it last became the current job (see jobspec.c) */
+        int slot;                   /* job number, its index in job_array; -1 if none */
+        struct job *pgid_next;      /* chain in the pgid map (see jobspec.c) */
         struct termios tmodes;      /* saved terminal modes */
         int mystdin, mystdout, mystderr;  /* standard i/o channels */
         bool bg;                    /* true when & is issued on the command line */
-        char *ifile;                /* stores input file name when < is issued */
-        char *ofile;                /* stores output file name when > is issued */
+        cpu_set_t cpus;             /* cpus given with @cpu=; used when pinned is true */
+        bool pinned;                /* true when @cpu= is issued on the command line */
+        int llc;                    /* cache domain chosen by the placement policy; -1 if none */
+        long pipesz;                /* capacity of pipes between stages (@pipesz=); 0 for the kernel default */
+        bool relay;                 /* true when @relay is issued: splice relays between stages */
+        long timeout;               /* wall-clock limit in ms (@timeout=); 0 for none */
+        int timeout_sig;            /* sent when it runs out (@killsig=); SIGKILL follows */
+        long grace;                 /* ms from timeout_sig to SIGKILL (@grace=) */
+        int timer;                  /* timerfd of the limit; -1 if not armed */
+        bool timed_out;             /* the limit ran out */
+        struct capture *capture;    /* its output when DSH_CAPTURE is set (see capture.c); NULL if not captured */
 } job_t;
 
+/* A job status line waiting to be printed before the next prompt */
+typedef struct notice {
+        struct notice *next;
+        char *msg;
+} notice_t;
+
+/* Terminal modes saved by init_shell(); the line editor runs from these */
+extern struct termios shell_tmodes;
+/* Exit status of the last command, as $? shows it */
+extern int last_status;
+
+/* Parsing and running jobs, used by the script interpreter */
+bool parse_jobs(char *cmdline, job_t **list);
+int run_jobs(job_t *templates);
+void free_jobs(job_t *list);
+
+/* Starting jobs, used by the coprocess builtins and the zygote */
+void spawn_job(job_t *j, bool fg);
+int find_lowest_index();
+void apply_plan(dup_step_t *plan, int n);
+
+/* Rewriting pipelines, used by the pipeline optimizer */
+void free_process(process_t *p);
+
+/* Used by the job limits */
+int signal_number(const char *name);
+
+/* Used by the output builtin */
+job_t *job_operand(const char *cmd, char *arg);
+
+/* Used by the job specs */
+int job_is_stopped(job_t *j);
+int job_is_completed(job_t *j);
+
+/* Used by the I/O layer while it waits */
+void reap_children();
+
+/* Used by the cache builtin */
+bool init_job(job_t *j);
+int start_job(job_t *j);
+int open_redir(redir_t *r);
+
 #ifdef NDEBUG
         #define DEBUG(M, ...)
 #else
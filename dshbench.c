@@ -0,0 +1,349 @@
+/* Spawn-latency benchmark for dsh.
+ *
+ * Drives a dsh instance through pipes with synthetic workloads and measures,
+ * from the outside, how long the shell takes from reading a command line to
+ * printing the next prompt:
+ *
+ *   sequential  N lines of /bin/true
+ *   pipeline    N/10 lines of an M-stage /bin/true pipeline
+ *   background  K lines of /bin/true &, i.e. K jobs alive at once
+ *   reap        N lines of /bin/date +%s%N; the gap between the time date
+ *               printed and the prompt arriving is the reap latency (child
+ *               exit to shell ready), including one pipe hop each way
+ *   loop        N/10 lines of three nested for loops around the : builtin,
+ *               1000 iterations per line; latency is per iteration, i.e.
+ *               the interpreter's cost without any fork
+ *   stream      G GiB in 256M cache hits, the stored output written by the
+ *               shell itself into its stdout pipe (see aio.c); reported as
+ *               MB/s. Run dsh with DSH_AIO=epoll or 0 to compare backends.
+ *
+ * Results go to a JSON file so runs on different commits can be compared.
+ *
+ * usage: dshbench [-n N] [-m M] [-k K] [-g G] [-c commit] [-o results.json] [dsh]
+ */
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <limits.h>
+#include <dirent.h>
+
+#define READ_TIMEOUT_MS 10000 /* give up if dsh does not answer */
+#define STREAM_HIT (256 << 20)  /* bytes per cache hit in the stream workload */
+
+typedef struct stats {
+	const char *name;
+	int count;          /* command lines sent */
+	int spawns;         /* processes started by those lines */
+	double *lat;        /* per line latency, microseconds */
+	double total;       /* wall time for the whole workload, seconds */
+	double bytes;       /* output streamed by the workload */
+} stats_t;
+
+static int to_dsh, from_dsh;
+static pid_t dsh_pid;
+static char out[1 << 16];   /* dsh output since the last prompt */
+static size_t outlen;
+
+static double now(clockid_t clock) {
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Reads dsh output until it ends with a prompt ("...$ "). */
+static void wait_prompt() {
+	outlen = 0;
+	for(;;) {
+		struct pollfd pfd = { from_dsh, POLLIN, 0 };
+		int r = poll(&pfd, 1, READ_TIMEOUT_MS);
+		if(r == 0) {
+			fprintf(stderr, "dshbench: timed out waiting for the prompt\n");
+			kill(dsh_pid, SIGKILL);
+			exit(1);
+		}
+		if(r < 0) {
+			if(errno == EINTR)
+				continue;
+			perror("poll");
+			exit(1);
+		}
+		if(outlen == sizeof(out) - 1)
+			outlen = 0; /* only the tail matters */
+		ssize_t n = read(from_dsh, out + outlen, sizeof(out) - 1 - outlen);
+		if(n <= 0) {
+			fprintf(stderr, "dshbench: dsh exited unexpectedly\n");
+			exit(1);
+		}
+		outlen += n;
+		out[outlen] = '\0';
+		if(outlen >= 2 && out[outlen-2] == '$' && out[outlen-1] == ' ')
+			return;
+	}
+}
+
+static void send_line(const char *line) {
+	size_t len = strlen(line), off = 0;
+	while(off < len) {
+		ssize_t n = write(to_dsh, line + off, len - off);
+		if(n < 0) {
+			perror("write");
+			exit(1);
+		}
+		off += n;
+	}
+}
+
+/* Sends one line and returns the time until the next prompt, in us. */
+static double round_trip(const char *line) {
+	double t0 = now(CLOCK_MONOTONIC);
+	send_line(line);
+	wait_prompt();
+	return (now(CLOCK_MONOTONIC) - t0) * 1e6;
+}
+
+static void start_dsh(const char *dsh, const char *dir) {
+	int in[2], outp[2];
+	if(pipe(in) < 0 || pipe(outp) < 0) {
+		perror("pipe");
+		exit(1);
+	}
+	switch(dsh_pid = fork()) {
+	   case -1:
+		perror("fork");
+		exit(1);
+	   case 0:
+		/* run in a scratch directory so dsh.log does not grow in the tree */
+		if(chdir(dir) < 0)
+			_exit(1);
+		dup2(in[0], STDIN_FILENO);
+		dup2(outp[1], STDOUT_FILENO);
+		close(in[0]); close(in[1]); close(outp[0]); close(outp[1]);
+		execl(dsh, dsh, (char *)NULL);
+		perror("exec dsh");
+		_exit(1);
+	}
+	close(in[0]);
+	close(outp[1]);
+	to_dsh = in[1];
+	from_dsh = outp[0];
+	wait_prompt();
+}
+
+static void stop_dsh() {
+	int status;
+	close(to_dsh); /* EOF makes dsh exit */
+	while(read(from_dsh, out, sizeof(out)) > 0)
+		;
+	close(from_dsh);
+	waitpid(dsh_pid, &status, 0);
+}
+
+/* Removes the cache store of the stream workload */
+static void remove_store(const char *dir) {
+	char path[PATH_MAX];
+	struct dirent *e;
+	DIR *d;
+	snprintf(path, sizeof(path), "%s/cache", dir);
+	if(!(d = opendir(path)))
+		return;
+	while((e = readdir(d)))
+		if(e->d_name[0] != '.')
+			unlinkat(dirfd(d), e->d_name, 0);
+	closedir(d);
+	rmdir(path);
+}
+
+static int cmp_double(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+static double percentile(double *v, int n, double p) {
+	int i = (int)(p * (n - 1) + 0.5);
+	return n ? v[i] : 0;
+}
+
+static stats_t *new_stats(const char *name, int count) {
+	stats_t *s = calloc(1, sizeof(stats_t));
+	if(!s || !(s->lat = calloc(count ? count : 1, sizeof(double)))) {
+		perror("calloc");
+		exit(1);
+	}
+	s->name = name;
+	return s;
+}
+
+static stats_t *run_sequential(int n) {
+	stats_t *s = new_stats("sequential", n);
+	double t0 = now(CLOCK_MONOTONIC);
+	for(s->count = 0; s->count < n; s->count++)
+		s->lat[s->count] = round_trip("/bin/true\n");
+	s->total = now(CLOCK_MONOTONIC) - t0;
+	s->spawns = n;
+	return s;
+}
+
+static stats_t *run_pipeline(int n, int m) {
+	char line[4096] = "";
+	int i;
+	stats_t *s = new_stats("pipeline", n);
+	for(i = 0; i < m; i++)
+		strcat(line, i ? " | /bin/true" : "/bin/true");
+	strcat(line, "\n");
+	double t0 = now(CLOCK_MONOTONIC);
+	for(s->count = 0; s->count < n; s->count++)
+		s->lat[s->count] = round_trip(line);
+	s->total = now(CLOCK_MONOTONIC) - t0;
+	s->spawns = n * m;
+	return s;
+}
+
+static stats_t *run_background(int k) {
+	stats_t *s = new_stats("background", k);
+	double t0 = now(CLOCK_MONOTONIC);
+	for(s->count = 0; s->count < k; s->count++)
+		s->lat[s->count] = round_trip("/bin/true &\n");
+	s->total = now(CLOCK_MONOTONIC) - t0;
+	s->spawns = k;
+	return s;
+}
+
+static stats_t *run_reap(int n) {
+	stats_t *s = new_stats("reap", n);
+	double t0 = now(CLOCK_MONOTONIC);
+	for(s->count = 0; s->count < n; s->count++) {
+		send_line("/bin/date +%s%N\n");
+		wait_prompt();
+		double prompt = now(CLOCK_REALTIME);
+		long long printed = atoll(out);
+		s->lat[s->count] = printed ? (prompt - printed / 1e9) * 1e6 : 0;
+	}
+	s->total = now(CLOCK_MONOTONIC) - t0;
+	s->spawns = n;
+	return s;
+}
+
+static stats_t *run_loop(int n) {
+	const char *line = "for a in 0 1 2 3 4 5 6 7 8 9; do for b in 0 1 2 3 4 5 6 7 8 9; do "
+		"for c in 0 1 2 3 4 5 6 7 8 9; do :; done; done; done\n";
+	stats_t *s = new_stats("loop", n);
+	double t0 = now(CLOCK_MONOTONIC);
+	for(s->count = 0; s->count < n; s->count++)
+		s->lat[s->count] = round_trip(line) / 1000;
+	s->total = now(CLOCK_MONOTONIC) - t0;
+	s->spawns = 0;
+	return s;
+}
+
+static stats_t *run_stream(int g, const char *dir) {
+	char line[PATH_MAX + 64];
+	int n = g * ((1 << 30) / STREAM_HIT);
+	stats_t *s = new_stats("stream", n);
+	snprintf(line, sizeof(line), "export DSH_CACHE_DIR=%s/cache DSH_CACHE_MAX=%d\n", dir, 2 * STREAM_HIT);
+	round_trip(line);
+	snprintf(line, sizeof(line), "cache /usr/bin/head -c %d /dev/zero\n", STREAM_HIT);
+	round_trip(line); /* the miss that stores it */
+	double t0 = now(CLOCK_MONOTONIC);
+	for(s->count = 0; s->count < n; s->count++)
+		s->lat[s->count] = round_trip(line);
+	s->total = now(CLOCK_MONOTONIC) - t0;
+	s->bytes = (double) n * STREAM_HIT;
+	round_trip("unset DSH_CACHE_DIR DSH_CACHE_MAX\n");
+	return s;
+}
+
+static void write_stats(FILE *f, stats_t *s, int last) {
+	double mean = 0;
+	int i;
+	for(i = 0; i < s->count; i++)
+		mean += s->lat[i];
+	mean = s->count ? mean / s->count : 0;
+	qsort(s->lat, s->count, sizeof(double), cmp_double);
+	fprintf(f, "    \"%s\": {\"lines\": %d, \"spawns\": %d, \"seconds\": %.6f, "
+		"\"spawns_per_sec\": %.1f, \"p50_us\": %.1f, \"p99_us\": %.1f, "
+		"\"mean_us\": %.1f, \"max_us\": %.1f",
+		s->name, s->count, s->spawns, s->total,
+		s->total > 0 ? s->spawns / s->total : 0,
+		percentile(s->lat, s->count, 0.50), percentile(s->lat, s->count, 0.99),
+		mean, s->count ? s->lat[s->count - 1] : 0);
+	if(s->bytes > 0)
+		fprintf(f, ", \"mb_per_sec\": %.1f", s->total > 0 ? s->bytes / 1e6 / s->total : 0);
+	fprintf(f, "}%s\n", last ? "" : ",");
+	if(s->bytes > 0)
+		fprintf(stderr, "%-11s %6d lines  p50 %8.1f us  p99 %8.1f us  %9.1f MB/s\n",
+			s->name, s->count, percentile(s->lat, s->count, 0.50),
+			percentile(s->lat, s->count, 0.99), s->total > 0 ? s->bytes / 1e6 / s->total : 0);
+	else
+		fprintf(stderr, "%-11s %6d lines  p50 %8.1f us  p99 %8.1f us  %9.1f spawns/s\n",
+			s->name, s->count, percentile(s->lat, s->count, 0.50),
+			percentile(s->lat, s->count, 0.99), s->total > 0 ? s->spawns / s->total : 0);
+}
+
+int main(int argc, char **argv) {
+	int n = 1000, m = 4, k = 16, g = 1, opt;
+	const char *outfile = "bench_results.json", *commit = "unknown";
+	char dsh[PATH_MAX], dir[] = "/tmp/dshbench.XXXXXX";
+
+	while((opt = getopt(argc, argv, "n:m:k:g:c:o:")) != -1) {
+		switch(opt) {
+		   case 'n': n = atoi(optarg); break;
+		   case 'm': m = atoi(optarg); break;
+		   case 'k': k = atoi(optarg); break;
+		   case 'g': g = atoi(optarg); break;
+		   case 'c': commit = optarg; break;
+		   case 'o': outfile = optarg; break;
+		   default:
+			fprintf(stderr, "usage: %s [-n N] [-m M] [-k K] [-g G] [-c commit] [-o results.json] [dsh]\n", argv[0]);
+			return 1;
+		}
+	}
+	if(!realpath(optind < argc ? argv[optind] : "./dsh", dsh)) {
+		perror("dsh");
+		return 1;
+	}
+	if(!mkdtemp(dir)) {
+		perror("mkdtemp");
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	start_dsh(dsh, dir);
+	stats_t *results[] = {
+		run_sequential(n),
+		run_pipeline(n / 10 ? n / 10 : 1, m),
+		run_background(k),
+		run_reap(n),
+		run_loop(n / 10 ? n / 10 : 1),
+		run_stream(g, dir),
+	};
+	stop_dsh();
+
+	char logfile[sizeof(dir) + 16];
+	snprintf(logfile, sizeof(logfile), "%s/dsh.log", dir);
+	unlink(logfile);
+	remove_store(dir);
+	rmdir(dir);
+
+	FILE *f = fopen(outfile, "w");
+	if(!f) {
+		perror(outfile);
+		return 1;
+	}
+	fprintf(f, "{\n  \"dsh\": \"%s\",\n  \"commit\": \"%s\",\n  \"timestamp\": %ld,\n"
+		"  \"params\": {\"n\": %d, \"m\": %d, \"k\": %d, \"g\": %d},\n  \"workloads\": {\n",
+		dsh, commit, (long) time(NULL), n, m, k, g);
+	size_t i, nres = sizeof(results) / sizeof(results[0]);
+	for(i = 0; i < nres; i++)
+		write_stats(f, results[i], i == nres - 1);
+	fprintf(f, "  }\n}\n");
+	fclose(f);
+	fprintf(stderr, "results written to %s\n", outfile);
+	return 0;
+}
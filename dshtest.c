@@ -0,0 +1,699 @@
+/* Job-control regression and latency tests for dsh.
+ *
+ * Runs dsh on a pseudo-terminal (forkpty), types command lines and control
+ * characters into it the way a user would, and checks what comes back:
+ * the prompt, jobs output and notices, line editing, completion, control flow,
+ * variables, globbing, pipeline fusion, coprocesses, the cache builtin,
+ * output capture, and which process group owns the terminal, in which modes.
+ * The scenarios follow the job-control bugs recorded in Bugs.txt. Also
+ * measures keystroke-to-prompt latency for a trivial command.
+ *
+ * Prints one "ok"/"not ok" line per check; exits nonzero if any failed.
+ *
+ * usage: dshtest [dsh]
+ */
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pty.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <limits.h>
+#include <dirent.h>
+
+#define TIMEOUT_MS 5000     /* longest wait for any expected output */
+#define LATENCY_RUNS 100
+
+static int master = -1;
+static pid_t dsh_pid;
+static char prompt[32];
+static char out[1 << 16];   /* terminal output not yet matched */
+static size_t outlen;
+static int checks, failures;
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void check(int ok, const char *what) {
+	checks++;
+	if(!ok)
+		failures++;
+	printf("%s %d - %s\n", ok ? "ok" : "not ok", checks, what);
+	fflush(stdout);
+}
+
+/* Waits until text appears in the output and drops everything up to and
+ * including it. Returns 0 on timeout or if dsh went away. */
+static int expect(const char *text, int timeout_ms) {
+	double deadline = now() + timeout_ms / 1e3;
+	for(;;) {
+		char *hit = strstr(out, text);
+		if(hit) {
+			size_t used = hit - out + strlen(text);
+			memmove(out, out + used, outlen - used + 1);
+			outlen -= used;
+			return 1;
+		}
+		int left = (int)((deadline - now()) * 1e3);
+		if(left <= 0)
+			return 0;
+		struct pollfd pfd = { master, POLLIN, 0 };
+		if(poll(&pfd, 1, left) <= 0)
+			continue;
+		if(outlen == sizeof(out) - 1) { /* keep the tail */
+			memmove(out, out + outlen / 2, outlen / 2 + 1);
+			outlen -= outlen / 2;
+		}
+		ssize_t n = read(master, out + outlen, sizeof(out) - 1 - outlen);
+		if(n <= 0)
+			return 0;
+		outlen += n;
+		out[outlen] = '\0';
+	}
+}
+
+/* Like expect() but for output that must not show up. */
+static int absent(const char *text, int wait_ms) {
+	if(!expect(text, wait_ms))
+		return 1;
+	return 0;
+}
+
+static void type(const char *keys) {
+	size_t len = strlen(keys);
+	if(write(master, keys, len) != (ssize_t) len) {
+		perror("write");
+		exit(1);
+	}
+}
+
+/* Types a command line and waits for the next prompt. */
+static int run(const char *line) {
+	type(line);
+	type("\n");
+	return expect(prompt, TIMEOUT_MS);
+}
+
+static pid_t terminal_owner() {
+	return tcgetpgrp(master);
+}
+
+/* Name of the program leading a process group, from /proc. */
+static int group_is(pid_t pgrp, const char *comm) {
+	char path[64], name[64] = "";
+	snprintf(path, sizeof(path), "/proc/%d/comm", (int) pgrp);
+	FILE *f = fopen(path, "r");
+	if(!f)
+		return 0;
+	if(!fgets(name, sizeof(name), f))
+		name[0] = '\0';
+	fclose(f);
+	name[strcspn(name, "\n")] = '\0';
+	return strcmp(name, comm) == 0;
+}
+
+/* Waits for the foreground process group to become pgrp-running-comm. */
+static pid_t wait_owner(const char *comm) {
+	double deadline = now() + TIMEOUT_MS / 1e3;
+	while(now() < deadline) {
+		pid_t pg = terminal_owner();
+		if(pg > 0 && pg != dsh_pid && group_is(pg, comm))
+			return pg;
+		usleep(1000);
+	}
+	return -1;
+}
+
+static void start_dsh(const char *dsh, const char *dir) {
+	struct winsize ws = { 24, 80, 0, 0 };
+	switch(dsh_pid = forkpty(&master, NULL, NULL, &ws)) {
+	   case -1:
+		perror("forkpty");
+		exit(1);
+	   case 0:
+		/* run in a scratch directory so dsh.log does not grow in the tree */
+		if(chdir(dir) < 0)
+			_exit(1);
+		char path[PATH_MAX + 4096];
+		snprintf(path, sizeof(path), "%s:%s", dir, getenv("PATH") ? getenv("PATH") : "/usr/bin:/bin");
+		setenv("PATH", path, 1);
+		execl(dsh, dsh, (char *)NULL);
+		perror("exec dsh");
+		_exit(1);
+	}
+	snprintf(prompt, sizeof(prompt), "dsh-%d$ ", (int) dsh_pid);
+}
+
+static int cmp_double(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void test_prompt() {
+	check(expect(prompt, TIMEOUT_MS), "shell prints its prompt on the terminal");
+	check(terminal_owner() == dsh_pid, "shell owns the terminal at the prompt");
+}
+
+/* Bugs.txt: "/bin/sleep 20 & /bin/ls -- you need to wait 20 seconds" */
+static void test_background_does_not_block() {
+	run("/bin/sleep 30 &");
+	double t0 = now();
+	type("/bin/echo after-bg\n");
+	int echoed = expect("\r\nafter-bg", TIMEOUT_MS) && expect(prompt, TIMEOUT_MS);
+	check(echoed && now() - t0 < 2, "foreground command runs while a background job is alive");
+	check(terminal_owner() == dsh_pid, "background job does not take the terminal");
+}
+
+/* Bugs.txt: "after jobs, every new cmd just prints jobs" */
+static void test_jobs_then_commands() {
+	type("jobs\n");
+	check(expect("Running", TIMEOUT_MS) && expect("/bin/sleep 30", TIMEOUT_MS)
+	      && expect(prompt, TIMEOUT_MS), "jobs lists the running background job");
+	type("/bin/echo still-works\n");
+	check(expect("\r\nstill-works", TIMEOUT_MS) && expect(prompt, TIMEOUT_MS),
+	      "commands after jobs run normally");
+	type("jobs\n");
+	check(expect("Running", TIMEOUT_MS) && expect(prompt, TIMEOUT_MS)
+	      && absent("still-works", 200), "jobs does not replay earlier commands");
+}
+
+static void test_ctrl_z_and_fg() {
+	type("/bin/sleep 20\n");
+	pid_t pg = wait_owner("sleep");
+	check(pg > 0, "foreground job owns the terminal");
+	type("\x1a"); /* Ctrl-Z */
+	check(expect("Stopped", TIMEOUT_MS) && expect(prompt, TIMEOUT_MS), "Ctrl-Z stops the job and reports it");
+	check(terminal_owner() == dsh_pid, "shell takes the terminal back after Ctrl-Z");
+	type("jobs\n");
+	check(expect("Stopped", TIMEOUT_MS) && expect("/bin/sleep 20", TIMEOUT_MS)
+	      && expect(prompt, TIMEOUT_MS), "jobs shows the stopped job");
+
+	/* Bugs.txt: "when you try to fg 1, you segfault" */
+	type("fg 17\n");
+	check(expect(prompt, TIMEOUT_MS) && kill(dsh_pid, 0) == 0, "fg with a bad job number leaves the shell running");
+	type("fg 1\n");
+	check(wait_owner("sleep") == pg, "fg gives the terminal back to the stopped job");
+	type("\x03"); /* Ctrl-C */
+	check(expect(prompt, TIMEOUT_MS), "Ctrl-C ends the foreground job");
+	check(terminal_owner() == dsh_pid, "shell takes the terminal back after Ctrl-C");
+	check(kill(-pg, 0) < 0, "interrupted job is gone");
+}
+
+static void test_bg_continues() {
+	type("/bin/sleep 20\n");
+	pid_t pg = wait_owner("sleep");
+	type("\x1a");
+	expect(prompt, TIMEOUT_MS);
+	run("bg 1");
+	type("jobs\n");
+	check(expect("[1]   Running", TIMEOUT_MS) && expect(prompt, TIMEOUT_MS), "bg resumes the stopped job");
+	check(terminal_owner() == dsh_pid, "bg leaves the terminal with the shell");
+	if(pg > 0)
+		kill(-pg, SIGKILL);
+}
+
+/* The notice of a background job comes while the shell waits at the
+ * prompt, above a fresh prompt that keeps what was typed so far */
+static void test_notice_at_prompt() {
+	run("/bin/sleep 0.5 &");
+	type("/bin/echo kept");
+	check(expect("Done", TIMEOUT_MS) && expect("/bin/sleep 0.5", TIMEOUT_MS),
+	      "a background job's end is reported without pressing enter");
+	check(expect(prompt, TIMEOUT_MS) && expect("/bin/echo kept", TIMEOUT_MS),
+	      "the prompt and the half-typed line are drawn again below it");
+	type("\n");
+	check(expect("\r\nkept", TIMEOUT_MS) && expect(prompt, TIMEOUT_MS), "the line still runs");
+}
+
+/* The sleep 30 of test_background_does_not_block is still running */
+static void test_wait() {
+	type("/bin/false & wait -n; /bin/echo status=$?\n");
+	check(expect("status=1", TIMEOUT_MS) && expect(prompt, TIMEOUT_MS),
+	      "wait -n returns the status of the job that finished first");
+	double t0 = now();
+	type("wait -t 0.2; /bin/echo status=$?\n");
+	check(expect("status=124", TIMEOUT_MS) && expect(prompt, TIMEOUT_MS) && now() - t0 < 2,
+	      "wait -t gives up on a running job");
+	type("wait %17; /bin/echo status=$?\n");
+	check(expect("status=127", TIMEOUT_MS) && expect(prompt, TIMEOUT_MS), "wait for no such job is 127");
+	type("wait\n");
+	usleep(200000);
+	type("\x03");
+	check(expect(prompt, TIMEOUT_MS), "Ctrl-C interrupts wait");
+	type("/bin/echo status=$?\n");
+	check(expect("status=130", TIMEOUT_MS) && expect(prompt, TIMEOUT_MS), "an interrupted wait is 128+SIGINT");
+}
+
+static void test_job_specs() {
+	run("/bin/sleep 41 &");
+	run("/bin/sleep 42 &");
+	type("kill %?41; wait %?41; /bin/echo status=$?\n");
+	check(expect("status=143", TIMEOUT_MS) && expect(prompt, TIMEOUT_MS),
+	      "kill %?text signals the job whose line contains text");
+	type("kill %/bin/sleep; /bin/echo status=$?\n");
+	check(expect("status=1", TIMEOUT_MS) && expect(prompt, TIMEOUT_MS), "an ambiguous prefix is refused");
+	type("disown %+; wait %?42; /bin/echo status=$?\n");
+	check(expect("status=127", TIMEOUT_MS) && expect(prompt, TIMEOUT_MS),
+	      "disown %+ drops the latest background job");
+	type("/bin/sleep 20\n");
+	pid_t pg = wait_owner("sleep");
+	type("\x1a");
+	expect(prompt, TIMEOUT_MS);
+	type("fg %+\n");
+	check(pg > 0 && wait_owner("sleep") == pg, "fg %+ continues the stopped job");
+	type("\x03");
+	expect(prompt, TIMEOUT_MS);
+}
+
+static void test_timeouts() {
+	double t0 = now();
+	type("@timeout=0.3 /bin/sleep 20; /bin/echo status=$?\n");
+	check(expect("status=124", TIMEOUT_MS) && expect(prompt, TIMEOUT_MS) && now() - t0 < 2,
+	      "@timeout= ends a foreground job with status 124");
+	check(terminal_owner() == dsh_pid, "the shell has the terminal back after a timeout");
+	run("@timeout=0.3 @killsig=INT /bin/sleep 20 &");
+	check(expect("Timed out", TIMEOUT_MS) && expect(prompt, TIMEOUT_MS),
+	      "a background job's timeout is reported at the prompt");
+}
+
+static void test_cd(const char *dir) {
+	char line[64];
+	run("cd /usr");
+	type("/bin/pwd\n");
+	check(expect("/usr\r\n", TIMEOUT_MS) && expect(prompt, TIMEOUT_MS), "a command runs in the directory cd chose");
+	type("cd bin; ./env true; /bin/echo status=$?\n");
+	check(expect("status=0", TIMEOUT_MS) && expect(prompt, TIMEOUT_MS), "a relative command path follows cd");
+	snprintf(line, sizeof(line), "cd %s", dir);
+	run(line);
+}
+
+static void test_capture() {
+	run("DSH_CAPTURE=1");
+	run("/bin/ls /nonexistent-capture &");
+	check(!expect("No such file", 1000), "a captured job's stderr stays off the terminal");
+	type("output %+\n");
+	check(expect("No such file", TIMEOUT_MS) && expect(prompt, TIMEOUT_MS),
+	      "output replays a finished job's stderr");
+	run("/bin/echo captured-text &");
+	type("jobs -o %?captured\n");
+	check(expect("captured-text", TIMEOUT_MS) && expect(prompt, TIMEOUT_MS), "jobs -o replays its stdout");
+	type("output %?nonexistent; /bin/echo status=$?\n");
+	check(expect("status=1", TIMEOUT_MS) && expect(prompt, TIMEOUT_MS),
+	      "a job is forgotten once its output was shown");
+	run("DSH_CAPTURE=0");
+}
+
+/* The master side reads the modes of the terminal dsh is on; at the
+ * prompt they are the line editor's raw modes */
+static int terminal_echoes() {
+	struct termios t;
+	return tcgetattr(master, &t) == 0 && (t.c_lflag & ECHO);
+}
+
+static void test_terminal_modes(const char *dir) {
+	char path[PATH_MAX];
+	run("/bin/stty -echo");
+	type("/bin/stty -a | /usr/bin/grep -cw -- -echo\n");
+	check(expect("\r\n0\r\n", TIMEOUT_MS) && expect(prompt, TIMEOUT_MS),
+	      "modes a job changed are undone after it");
+
+	snprintf(path, sizeof(path), "%s/modes.sh", dir);
+	FILE *f = fopen(path, "w");
+	if(f) {
+		fputs("/bin/stty -echo\nexec /bin/sleep 20\n", f);
+		fclose(f);
+	}
+	type("/bin/sh modes.sh\n");
+	pid_t pg = wait_owner("sleep");
+	type("\x1a");
+	expect(prompt, TIMEOUT_MS);
+	type("fg 1\n");
+	check(wait_owner("sleep") == pg && !terminal_echoes(), "fg restores the modes the job stopped with");
+	type("\x03");
+	expect(prompt, TIMEOUT_MS);
+	type("/bin/stty -a | /usr/bin/grep -cw -- -echo\n");
+	check(expect("\r\n0\r\n", TIMEOUT_MS) && expect(prompt, TIMEOUT_MS),
+	      "the shell's modes are back after the job");
+	unlink(path);
+}
+
+static void test_ctrl_c_at_prompt() {
+	type("\x03");
+	usleep(100000);
+	type("/bin/echo survived\n");
+	check(expect("\r\nsurvived", TIMEOUT_MS) && expect(prompt, TIMEOUT_MS), "Ctrl-C at the prompt does not kill the shell");
+}
+
+static void test_line_editing() {
+	char line[160], output[160];
+	type("/bin/echo abd\x1b[Dc\n"); /* left arrow, insert */
+	check(expect("\r\nabcd\r\n", TIMEOUT_MS) && expect(prompt, TIMEOUT_MS), "edits in the middle of the line");
+	type("\x1b[A\n"); /* up arrow */
+	check(expect("\r\nabcd\r\n", TIMEOUT_MS) && expect(prompt, TIMEOUT_MS), "up arrow recalls the last line");
+	memset(line, 'x', sizeof(line));
+	memcpy(line, "/bin/echo ", 10);
+	line[sizeof(line) - 1] = '\0';
+	type(line);
+	type("\x01\x1b[3~/\n"); /* ctrl-a, delete, insert: the same line, wrapped */
+	snprintf(output, sizeof(output), "\r\n%s\r\n", line + 10);
+	check(expect(output, TIMEOUT_MS) && expect(prompt, TIMEOUT_MS), "lines wider than the terminal");
+}
+
+/* The scratch directory is first in dsh's $PATH (see start_dsh) */
+static void test_completion(const char *dir) {
+	char path[PATH_MAX], line[PATH_MAX + 32];
+	type("/bin/ech\t"); /* /bin is read by the index thread meanwhile */
+	usleep(200000);
+	type("\t completed\n");
+	check(expect("\r\ncompleted\r\n", TIMEOUT_MS) && expect(prompt, TIMEOUT_MS), "tab completes file names");
+	snprintf(path, sizeof(path), "%s/dshtest-new-command", dir);
+	FILE *f = fopen(path, "w");
+	if(f) {
+		fprintf(f, "#!/bin/sh\necho new-command-ran\n");
+		fclose(f);
+		chmod(path, 0755);
+	}
+	usleep(200000); /* let the index see it */
+	type("dshtest-new-c\t\n");
+	check(expect("\r\nnew-command-ran\r\n", TIMEOUT_MS) && expect(prompt, TIMEOUT_MS),
+	      "tab completes a command added to $PATH after startup");
+	unlink(path);
+
+	snprintf(path, sizeof(path), "%s/bin2", dir);
+	mkdir(path, 0755);
+	snprintf(line, sizeof(line), "PATH=%s:$PATH; export PATH", path);
+	run(line);
+	snprintf(path, sizeof(path), "%s/bin2/dshtest-path-command", dir);
+	if((f = fopen(path, "w"))) {
+		fprintf(f, "#!/bin/sh\necho path-command-ran\n");
+		fclose(f);
+		chmod(path, 0755);
+	}
+	type("dshtest-path-c\t"); /* the first tab asks for the new $PATH */
+	usleep(300000);
+	type("\t\n");
+	check(expect("\r\npath-command-ran\r\n", TIMEOUT_MS) && expect(prompt, TIMEOUT_MS),
+	      "tab completes from a $PATH exported after startup");
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/bin2", dir);
+	rmdir(path);
+}
+
+static void test_control_flow() {
+	type("for i in a b; do /bin/echo it-$i; done\n");
+	check(expect("\r\nit-a\r\nit-b\r\n", TIMEOUT_MS) && expect(prompt, TIMEOUT_MS), "for loop runs its body per word");
+	type("if false; then /bin/echo wrong; elif true; then /bin/echo right; fi\n");
+	check(expect("\r\nright\r\n", TIMEOUT_MS) && expect(prompt, TIMEOUT_MS), "if/elif picks the branch by status");
+	type("case x.c in\n");
+	check(expect("> ", TIMEOUT_MS), "an open case asks for more lines");
+	type("*.h) /bin/echo header;;\n*.c) /bin/echo source;;\nesac\n");
+	check(expect("\r\nsource\r\n", TIMEOUT_MS) && expect(prompt, TIMEOUT_MS), "case runs the matching arm");
+	type("true | /bin/echo piped; : > /dev/null; /bin/echo status=$?\n");
+	check(expect("\r\npiped\r\nstatus=0", TIMEOUT_MS) && expect(prompt, TIMEOUT_MS),
+	      "true and : in a pipeline or with a redirection run as commands");
+	char quiet[64];
+	snprintf(quiet, sizeof(quiet), "fi\r\r\n%s", prompt); /* nothing between the line and the prompt */
+	run("true");
+	type("if /bin/false >; then /bin/echo DANGER; fi\n");
+	check(expect(quiet, TIMEOUT_MS), "a condition that does not parse runs nothing of the if");
+	type("/bin/echo status=$?\n");
+	check(expect("\r\nstatus=2", TIMEOUT_MS) && expect(prompt, TIMEOUT_MS), "a syntax error sets $? to 2");
+	type("while true; do /bin/sleep 5; done\n");
+	usleep(200000);
+	type("\x03");
+	check(expect(prompt, 2000), "ctrl-c ends a loop at the prompt");
+}
+
+static void test_variables() {
+	type("V=abc; export V; /usr/bin/printenv V\n");
+	check(expect("\r\nabc\r\n", TIMEOUT_MS) && expect(prompt, TIMEOUT_MS), "exported variables reach commands");
+	type("P=one /usr/bin/printenv P; /bin/echo [$P]\n");
+	check(expect("\r\none\r\n[]\r\n", TIMEOUT_MS) && expect(prompt, TIMEOUT_MS),
+	      "an assignment prefix sets the variable for that command only");
+}
+
+static void touch(const char *dir, const char *name) {
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	FILE *f = fopen(path, "w");
+	if(f)
+		fclose(f);
+}
+
+static void test_globbing(const char *dir) {
+	char path[PATH_MAX];
+	const char *names[] = { "glob-1.txt", "glob-2.txt", "glob-3.txt" };
+	int i;
+	touch(dir, names[0]);
+	touch(dir, names[1]);
+	type("/bin/echo glob-?.txt [!x]lob-*.none\n");
+	check(expect("\r\nglob-1.txt glob-2.txt [!x]lob-*.none\r\n", TIMEOUT_MS) && expect(prompt, TIMEOUT_MS),
+	      "globs expand to sorted matches and are kept when nothing matches");
+	touch(dir, names[2]);
+	type("/bin/echo glob-*\n");
+	check(expect("\r\nglob-1.txt glob-2.txt glob-3.txt\r\n", TIMEOUT_MS) && expect(prompt, TIMEOUT_MS),
+	      "a file created since the last glob is seen");
+	for(i = 0; i < 3; i++) {
+		snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+		unlink(path);
+	}
+}
+
+/* Whether the file name in dir holds exactly text; removes it. */
+static int holds(const char *dir, const char *name, const char *text) {
+	char path[PATH_MAX], got[512];
+	size_t n = 0;
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	FILE *f = fopen(path, "r");
+	if(f) {
+		n = fread(got, 1, sizeof(got) - 1, f);
+		fclose(f);
+	}
+	got[n] = '\0';
+	unlink(path);
+	return f && strcmp(got, text) == 0;
+}
+
+static void test_redirections(const char *dir) {
+	const char *err = "/bin/ls: cannot access '/none': No such file or directory\n";
+	char both[256], quiet[64];
+	snprintf(both, sizeof(both), "%s/\n", err);
+	run("/bin/echo one > redir-a; /bin/echo two >> redir-a");
+	check(holds(dir, "redir-a", "one\ntwo\n"), ">> appends to what > wrote");
+	run("/bin/ls -d / /none > redir-b 2>&1");
+	check(holds(dir, "redir-b", both), ">f 2>&1 sends both streams to f");
+	type("/bin/ls -d / /none 2>&1 > redir-c\n");
+	check(expect("cannot access", TIMEOUT_MS) && expect(prompt, TIMEOUT_MS) && holds(dir, "redir-c", "/\n"),
+	      "2>&1 >f sends stderr where stdout was before f");
+	run("/bin/ls -d / /none &> redir-d");
+	check(holds(dir, "redir-d", both), "&> sends both streams to the file");
+	run("/bin/ls -d / 3> redir-e 1>&3");
+	check(holds(dir, "redir-e", "/\n"), "n>&m duplicates a descriptor opened before it");
+	run("/bin/ls /proc/self/fd/3 3> redir-f 3>&- 2> redir-g");
+	check(holds(dir, "redir-g", "/bin/ls: cannot access '/proc/self/fd/3': No such file or directory\n")
+	      && holds(dir, "redir-f", ""), "n>&- closes the descriptor");
+	/* >&12 is not >&1 followed by a word 2 */
+	snprintf(quiet, sizeof(quiet), "12\r\r\n%s", prompt);
+	type("/bin/echo leak >&12\n");
+	check(expect(quiet, TIMEOUT_MS), "a dup target is read whole, and a shell descriptor is refused");
+}
+
+static void test_fusion(const char *dir) {
+	char path[PATH_MAX];
+	touch(dir, "fuse-in");
+	type("cat fuse-in | /bin/ls -l /proc/self/fd/0\n");
+	check(expect("fuse-in\r\n", TIMEOUT_MS) && expect(prompt, TIMEOUT_MS),
+	      "cat FILE | cmd runs cmd < FILE");
+	type("/bin/false | cat > fuse-out; /bin/echo status=$?\n");
+	check(expect("status=0", TIMEOUT_MS) && expect(prompt, TIMEOUT_MS),
+	      "a final cat is kept, and with it the job's status");
+	type("DSH_FUSE=0 cat fuse-in | /bin/ls -l /proc/self/fd/0\n");
+	check(expect("pipe:", TIMEOUT_MS) && expect(prompt, TIMEOUT_MS),
+	      "a cat with a prefix is kept");
+	run("DSH_FUSE=0");
+	type("cat fuse-in | /bin/ls -l /proc/self/fd/0\n");
+	check(expect("pipe:", TIMEOUT_MS) && expect(prompt, TIMEOUT_MS), "DSH_FUSE=0 turns fusion off");
+	run("unset DSH_FUSE");
+	snprintf(path, sizeof(path), "%s/fuse-in", dir);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/fuse-out", dir);
+	unlink(path);
+}
+
+static void test_coprocess() {
+	run("coproc echoer /bin/cat");
+	type("for w in one two; do /bin/echo $w >&echoer; read -u echoer r; /bin/echo got-$r; done\n");
+	check(expect("\r\ngot-one\r\ngot-two\r\n", TIMEOUT_MS) && expect(prompt, TIMEOUT_MS),
+	      "read takes lines back from a coprocess");
+	type("read -u echoer r\n");
+	usleep(200000);
+	type("\x03");
+	check(expect(prompt, 2000), "ctrl-c interrupts a read that has nothing to read");
+}
+
+static void test_cache(const char *dir) {
+	char line[PATH_MAX + 64];
+	snprintf(line, sizeof(line), "export DSH_CACHE_DIR=%s/cache", dir);
+	run(line);
+	/* a second mkdir would fail; the stored status 0 comes back instead */
+	snprintf(line, sizeof(line), "cache /bin/mkdir %s/cache-ran; /bin/echo status=$?\n", dir);
+	type(line);
+	int first = expect("status=0", TIMEOUT_MS) && expect(prompt, TIMEOUT_MS);
+	type(line);
+	check(first && expect("status=0", TIMEOUT_MS) && expect(prompt, TIMEOUT_MS),
+	      "cache answers a repeated command from the store");
+	run("cache /bin/echo replayed | /usr/bin/wc -c");
+	type("cache /bin/echo replayed | /usr/bin/wc -c\n");
+	check(expect("\r\n9\r\n", TIMEOUT_MS) && expect(prompt, TIMEOUT_MS),
+	      "cache feeds the stored output to the rest of a pipeline");
+	/* several chunks of stored output, written back by the shell */
+	run("cache /usr/bin/seq 100000 > cache-1");
+	run("cache /usr/bin/seq 100000 > cache-2");
+	type("/usr/bin/seq 100000 | /usr/bin/cmp - cache-2; /bin/echo cmp=$?\n");
+	check(expect("cmp=0", TIMEOUT_MS) && expect(prompt, TIMEOUT_MS),
+	      "a large stored output is replayed whole");
+	snprintf(line, sizeof(line), "%s/cache-ran", dir);
+	rmdir(line);
+	snprintf(line, sizeof(line), "%s/cache-1", dir);
+	unlink(line);
+	snprintf(line, sizeof(line), "%s/cache-2", dir);
+	unlink(line);
+
+	/* empty the store so the scratch directory can be removed */
+	snprintf(line, sizeof(line), "%s/cache", dir);
+	DIR *d = opendir(line);
+	struct dirent *e;
+	while(d && (e = readdir(d)))
+		if(e->d_name[0] != '.')
+			unlinkat(dirfd(d), e->d_name, 0);
+	if(d)
+		closedir(d);
+	rmdir(line);
+}
+
+static void test_latency() {
+	double lat[LATENCY_RUNS];
+	int i, ok = 1;
+	for(i = 0; i < LATENCY_RUNS && ok; i++) {
+		type("/bin/true");
+		double t0 = now();
+		type("\n");
+		ok = expect(prompt, TIMEOUT_MS);
+		lat[i] = (now() - t0) * 1e6;
+	}
+	check(ok, "keystroke-to-prompt latency runs complete");
+	if(!ok)
+		return;
+	qsort(lat, LATENCY_RUNS, sizeof(double), cmp_double);
+	printf("# keystroke-to-prompt latency over %d runs: p50 %.1f us  p99 %.1f us  max %.1f us\n",
+		LATENCY_RUNS, lat[LATENCY_RUNS / 2], lat[LATENCY_RUNS * 99 / 100], lat[LATENCY_RUNS - 1]);
+}
+
+static void test_exit() {
+	int status;
+	type("\x04"); /* Ctrl-D */
+	double deadline = now() + TIMEOUT_MS / 1e3;
+	pid_t r;
+	while((r = waitpid(dsh_pid, &status, WNOHANG)) == 0 && now() < deadline) {
+		char drain[4096];
+		struct pollfd pfd = { master, POLLIN, 0 };
+		if(poll(&pfd, 1, 10) > 0 && read(master, drain, sizeof(drain)) <= 0)
+			usleep(1000);
+	}
+	check(r == dsh_pid && WIFEXITED(status) && WEXITSTATUS(status) == 0, "Ctrl-D exits the shell cleanly");
+	if(r != dsh_pid)
+		kill(dsh_pid, SIGKILL);
+}
+
+/* Background jobs outlive the shell; kill whatever is left in its session
+ * (forkpty made dsh a session leader). */
+static void kill_session() {
+	DIR *d = opendir("/proc");
+	struct dirent *e;
+	if(!d)
+		return;
+	while((e = readdir(d))) {
+		char path[300], stat[512];
+		int pid = atoi(e->d_name), sid = 0;
+		if(pid <= 0)
+			continue;
+		snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+		FILE *f = fopen(path, "r");
+		if(!f)
+			continue;
+		if(fgets(stat, sizeof(stat), f)) {
+			char *p = strrchr(stat, ')'); /* comm may contain spaces */
+			if(p)
+				sscanf(p + 2, "%*c %*d %*d %d", &sid);
+		}
+		fclose(f);
+		if(sid == dsh_pid)
+			kill(pid, SIGKILL);
+	}
+	closedir(d);
+}
+
+int main(int argc, char **argv) {
+	char dsh[PATH_MAX], dir[] = "/tmp/dshtest.XXXXXX", log[sizeof(dir) + 16];
+
+	if(!realpath(argc > 1 ? argv[1] : "./dsh", dsh)) {
+		perror("dsh");
+		return 1;
+	}
+	if(!mkdtemp(dir)) {
+		perror("mkdtemp");
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	start_dsh(dsh, dir);
+
+	test_prompt();
+	test_background_does_not_block();
+	test_jobs_then_commands();
+	test_ctrl_z_and_fg();
+	test_bg_continues();
+	test_notice_at_prompt();
+	test_wait();
+	test_job_specs();
+	test_timeouts();
+	test_capture();
+	test_cd(dir);
+	test_terminal_modes(dir);
+	test_ctrl_c_at_prompt();
+	test_line_editing();
+	test_completion(dir);
+	test_control_flow();
+	test_variables();
+	test_globbing(dir);
+	test_fusion(dir);
+	test_redirections(dir);
+	test_coprocess();
+	test_cache(dir);
+	test_latency();
+	test_exit();
+
+	kill_session();
+	snprintf(log, sizeof(log), "%s/dsh.log", dir);
+	if(failures) {
+		char cmd[sizeof(log) + 16];
+		printf("# dsh.log:\n");
+		fflush(stdout);
+		snprintf(cmd, sizeof(cmd), "sed 's/^/#   /' %s", log);
+		if(system(cmd) < 0)
+			perror("system");
+	}
+	unlink(log);
+	rmdir(dir);
+	printf("%d of %d checks passed\n", checks - failures, checks);
+	return failures != 0;
+}
@@ -0,0 +1,109 @@
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "evlog.h"
+#include "logbuf.h"
+#include "pipes.h"
+
+bool evlog_on = false;
+static logbuf_t evlog_buf;
+
+void evlog_init() {
+	char *path = getenv("DSH_EVLOG"), *env;
+	long max = EVLOG_MAX_DEFAULT;
+	int keep = EVLOG_KEEP_DEFAULT;
+	if(!path || !logbuf_open(&evlog_buf, path, EVLOG_BUFSZ))
+		return;
+	if((env = getenv("DSH_EVLOG_MAX")) && (max = parse_size(env)) < 0) {
+		fprintf(stderr, "DSH_EVLOG_MAX: could not fathom %s\n", env);
+		max = EVLOG_MAX_DEFAULT;
+	}
+	if((env = getenv("DSH_EVLOG_KEEP")))
+		keep = atoi(env);
+	logbuf_rotate_at(&evlog_buf, max, keep);
+	evlog_on = true;
+}
+
+void evlog_flush() {
+	logbuf_flush(&evlog_buf);
+}
+
+void evlog_close() {
+	logbuf_close(&evlog_buf);
+	evlog_on = false;
+}
+
+/* Starts a record with the fields every event has. Records are built in a
+ * local buffer and appended whole, so a batch never holds half a line. */
+static int event_head(char *line, size_t cap, const char *event, job_t *j) {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return snprintf(line, cap, "{\"time\":%lld.%06ld,\"event\":\"%s\",\"pgid\":%d",
+		(long long) ts.tv_sec, ts.tv_nsec / 1000, event, (int) j->pgid);
+}
+
+static int append_argv(char *line, int n, size_t cap, process_t *p) {
+	char arg[2 * MAX_LEN_CMDLINE];
+	int i;
+	n += snprintf(line + n, cap - n, ",\"argv\":[");
+	for(i = 0; i < p->argc && n + sizeof(arg) + 8 < cap; i++) { /* drop what does not fit */
+		json_escape(arg, sizeof(arg), p->argv[i]);
+		n += snprintf(line + n, cap - n, "%s\"%s\"", i ? "," : "", arg);
+	}
+	return n + snprintf(line + n, cap - n, "]");
+}
+
+static void event_end(char *line, int n, size_t cap) {
+	n += snprintf(line + n, cap - n, "}\n");
+	logbuf_append(&evlog_buf, line, n);
+}
+
+void evlog_spawn(job_t *j, process_t *p) {
+	char line[4096], cmd[2 * MAX_LEN_CMDLINE];
+	int n = event_head(line, sizeof(line), "spawn", j);
+	json_escape(cmd, sizeof(cmd), j->commandinfo);
+	n += snprintf(line + n, sizeof(line) - n, ",\"pid\":%d,\"bg\":%s,\"cmd\":\"%s\"",
+		(int) p->pid, j->bg ? "true" : "false", cmd);
+	n = append_argv(line, n, sizeof(line), p);
+	event_end(line, n, sizeof(line));
+}
+
+/* Exit status is reported as in the shell: the exit code, or 128 plus the
+ * signal number, with the signal also given separately. */
+void evlog_exit(job_t *j, process_t *p, struct rusage *ru) {
+	char line[4096];
+	struct timespec now;
+	int status = p->status;
+	int n = event_head(line, sizeof(line), "exit", j);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	n += snprintf(line + n, sizeof(line) - n, ",\"pid\":%d,\"status\":%d,\"signal\":%d,\"elapsed\":%.6f",
+		(int) p->pid, WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status),
+		WIFSIGNALED(status) ? WTERMSIG(status) : 0,
+		(now.tv_sec - p->started.tv_sec) + (now.tv_nsec - p->started.tv_nsec) / 1e9);
+	if(ru)
+		n += snprintf(line + n, sizeof(line) - n,
+			",\"utime\":%ld.%06ld,\"stime\":%ld.%06ld,\"maxrss_kb\":%ld,\"minflt\":%ld,\"majflt\":%ld,\"nvcsw\":%ld,\"nivcsw\":%ld",
+			(long) ru->ru_utime.tv_sec, (long) ru->ru_utime.tv_usec,
+			(long) ru->ru_stime.tv_sec, (long) ru->ru_stime.tv_usec,
+			ru->ru_maxrss, ru->ru_minflt, ru->ru_majflt, ru->ru_nvcsw, ru->ru_nivcsw);
+	n = append_argv(line, n, sizeof(line), p);
+	event_end(line, n, sizeof(line));
+}
+
+void evlog_stop(job_t *j, process_t *p) {
+	char line[512];
+	int n = event_head(line, sizeof(line), "stop", j);
+	n += snprintf(line + n, sizeof(line) - n, ",\"pid\":%d,\"signal\":%d",
+		(int) p->pid, WSTOPSIG(p->status));
+	event_end(line, n, sizeof(line));
+}
+
+void evlog_continue(job_t *j) {
+	char line[512];
+	int n = event_head(line, sizeof(line), "continue", j);
+	event_end(line, n, sizeof(line));
+}
@@ -0,0 +1,27 @@
+#ifndef __EVLOG_H__          /* check if this header file is already defined elsewhere */
+#define __EVLOG_H__
+
+#include <sys/resource.h>
+#include "dsh.h"
+
+/* Structured job event log: one JSON object per line for every spawn, stop,
+ * continue and exit. Enabled with DSH_EVLOG=file; DSH_EVLOG_MAX (default
+ * 10M) and DSH_EVLOG_KEEP (default 3) control rotation by size. */
+
+#define EVLOG_BUFSZ (32 * 1024)          /* bounded batch of pending events */
+#define EVLOG_MAX_DEFAULT (10L << 20)
+#define EVLOG_KEEP_DEFAULT 3
+
+extern bool evlog_on;
+
+#define EVLOG(call) do { if(__builtin_expect(evlog_on, 0)) call; } while(0)
+
+void evlog_init();
+void evlog_flush();
+void evlog_close();
+void evlog_spawn(job_t *j, process_t *p);
+void evlog_exit(job_t *j, process_t *p, struct rusage *ru);
+void evlog_stop(job_t *j, process_t *p);
+void evlog_continue(job_t *j);
+
+#endif /* __EVLOG_H__ */
@@ -0,0 +1,146 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <termios.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fuse.h"
+#include "vars.h"
+
+/* Pipeline fusion: run_jobs() passes every job through here after its
+ * words are expanded and before it is spawned. cat stages that only move
+ * bytes are folded into redirections of their neighbours, saving a
+ * process and a copy through a pipe each:
+ *
+ *   cat FILE | cmd, cat < FILE | cmd    become  cmd < FILE
+ *   a | cat | b                         becomes a | b
+ *
+ * Only a plain cat (no options, FOO=1 prefixes or other redirections) is
+ * removed, and only where nothing can tell the difference: FILE must be a
+ * readable regular file, so cat would not have failed on it, cmd must not
+ * redirect that descriptor itself, and cmd must not be a builtin, which
+ * would then run in the shell instead of being exec'ed. A leading cat
+ * reading the terminal is kept, since cmd would see a terminal where it
+ * saw a pipe. A final cat is always kept: the job's status is its status,
+ * and a file it cannot open must not keep cmd from running.
+ *
+ * DSH_FUSE=0 turns fusion off; DSH_FUSE=debug prints each rewritten
+ * pipeline to stderr as the line and what it became. */
+
+/* Commands run_job() handles in the shell */
+static const char *shell_cmds[] = { "cd", "jobs", "fg", "bg", "export", "unset", "coproc",
+                                    "read", "cache", "wait", "kill", "disown", "output", ":", "true", "false" };
+
+static bool is_cat(process_t *p) {
+	return p->argc > 0 && p->nassigns == 0 && !p->relay
+	       && (strcmp(p->argv[0], "cat") == 0 || strcmp(p->argv[0], "/bin/cat") == 0
+	           || strcmp(p->argv[0], "/usr/bin/cat") == 0);
+}
+
+static bool is_shell_cmd(process_t *p) {
+	size_t i;
+	for(i = 0; i < sizeof(shell_cmds) / sizeof(shell_cmds[0]); i++)
+		if(strcmp(p->argv[0], shell_cmds[i]) == 0)
+			return true;
+	return false;
+}
+
+static bool redirects(process_t *p, int fd) {
+	redir_t *r;
+	for(r = p->redirs; r; r = r->next)
+		if(r->fd == fd)
+			return true;
+	return false;
+}
+
+static bool readable_file(const char *path) {
+	struct stat st;
+	return stat(path, &st) == 0 && S_ISREG(st.st_mode) && access(path, R_OK) == 0;
+}
+
+/* The redirection standing for the input of a leading cat, or NULL */
+static redir_t *cat_input(process_t *c) {
+	redir_t *r = c->redirs;
+	if(c->argc == 2 && !r && c->argv[1][0] != '-' && readable_file(c->argv[1])) {
+		if(!(r = (redir_t *)calloc(1, sizeof(redir_t))) || !(r->file = strdup(c->argv[1]))) {
+			free(r);
+			return NULL;
+		}
+		r->type = REDIR_IN;
+		r->fd = STDIN_FILENO;
+		return r;
+	}
+	if(c->argc == 1 && r && !r->next && r->type == REDIR_IN && r->fd == STDIN_FILENO
+	   && readable_file(r->file)) {
+		c->redirs = NULL;
+		return r;
+	}
+	return NULL;
+}
+
+/* Prints the command line and what it became */
+static void print_pipeline(job_t *j) {
+	process_t *p;
+	redir_t *r;
+	int i;
+	fprintf(stderr, "fuse: %s =>", j->commandinfo);
+	for(p = j->first_process; p; p = p->next) {
+		for(i = 0; i < p->nassigns; i++)
+			fprintf(stderr, " %s", p->assigns[i]);
+		for(i = 0; i < p->argc; i++)
+			fprintf(stderr, " %s", p->argv[i]);
+		for(r = p->redirs; r; r = r->next) {
+			if(r->type == REDIR_DUP)
+				fprintf(stderr, " %d>&%d", r->fd, r->target);
+			else if(r->type == REDIR_CLOSE)
+				fprintf(stderr, " %d>&-", r->fd);
+			else if(r->type == REDIR_COPROC)
+				fprintf(stderr, " %d%s&%s", r->fd, r->target ? ">" : "<", r->file);
+			else
+				fprintf(stderr, " %d%s%s", r->fd, r->type == REDIR_IN ? "<"
+					: r->type == REDIR_OUT ? ">" : ">>", r->file);
+		}
+		if(p->next)
+			fprintf(stderr, " |");
+	}
+	fprintf(stderr, "\n");
+}
+
+/* Rewrites the cat stages of j as above. Returns the number removed. */
+int fuse_pipeline(job_t *j) {
+	const char *mode = var_get("DSH_FUSE");
+	bool debug = mode && strcmp(mode, "debug") == 0;
+	process_t *p, *c, **pp;
+	redir_t *r;
+	int fused = 0;
+
+	if(!j->first_process || !j->first_process->next || (mode && strcmp(mode, "0") == 0))
+		return 0;
+
+	/* cat FILE | cmd */
+	c = j->first_process;
+	p = c->next;
+	if(is_cat(c) && p->argc > 0 && !is_shell_cmd(p) && !redirects(p, STDIN_FILENO)
+	   && (r = cat_input(c))) {
+		r->next = p->redirs; /* first, as the pipe end it replaces */
+		p->redirs = r;
+		j->first_process = p;
+		free_process(c);
+		fused++;
+	}
+
+	/* a | cat | b */
+	for(pp = &j->first_process; *pp && (c = (*pp)->next); ) {
+		p = *pp;
+		if(is_cat(c) && c->argc == 1 && !c->redirs && c->next && p->argc > 0) {
+			p->next = c->next;
+			free_process(c);
+			fused++;
+		}
+		else
+			pp = &p->next;
+	}
+	if(debug && fused)
+		print_pipeline(j);
+	return fused;
+}
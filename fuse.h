@@ -0,0 +1,8 @@
+#ifndef __FUSE_H__           /* check if this header file is already defined elsewhere */
+#define __FUSE_H__
+
+#include "dsh.h"
+
+int fuse_pipeline(job_t *j);
+
+#endif /* __FUSE_H__ */
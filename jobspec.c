@@ -0,0 +1,268 @@
+#include <sys/types.h>
+#include <termios.h>
+#include <stdlib.h>
+#include <string.h>
+#include "jobspec.h"
+
+/* Job specs: the text after % in fg %vi, kill %?make or wait %+. Every job
+ * with a job number is in an index sorted by its command line, so %prefix
+ * is a binary search however many jobs there are:
+ *
+ *   %n        job n (looked up in job_array by the callers)
+ *   %+, %%, % the current job
+ *   %-        the previous job
+ *   %prefix   the job whose command line starts with prefix
+ *   %?text    the job whose command line contains text
+ *
+ * A prefix or text that more than one job matches is ambiguous. The
+ * current job is the one most recently stopped, or if none is stopped the
+ * one most recently put in the background; the previous job is the one
+ * before it in the same order.
+ *
+ * Next to the index are two maps, pgid -> job and pid -> process, chained
+ * hash tables like the variables' (vars.c) that double when they fill up.
+ * A reap, a notice or a pid operand then costs the same with thousands of
+ * jobs as with one. */
+
+static job_t **index_ = NULL;   /* numbered jobs by command line, then pgid */
+static size_t nindex, capindex;
+static unsigned long touches;   /* order of jobspec_touch() calls */
+
+static const char *key(job_t *j) {
+	return j->commandinfo + strspn(j->commandinfo, " \t");
+}
+
+static int compare(job_t *a, job_t *b) {
+	int c = strcmp(key(a), key(b));
+	return c ? c : (a->pgid > b->pgid) - (a->pgid < b->pgid);
+}
+
+/* First entry not before j */
+static size_t lower_bound(job_t *j) {
+	size_t lo = 0, hi = nindex;
+	while(lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if(compare(index_[mid], j) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Adds a job that was just given a job number */
+void jobspec_add(job_t *j) {
+	size_t at;
+	if(nindex == capindex) {
+		size_t cap = capindex ? 2 * capindex : JOBSPEC_MIN;
+		job_t **grown = (job_t **)realloc(index_, cap * sizeof(job_t *));
+		if(!grown) {
+			fprintf(stderr, "malloc: no space\n");
+			return; /* %n and %+ still find it */
+		}
+		index_ = grown;
+		capindex = cap;
+	}
+	at = lower_bound(j);
+	memmove(index_ + at + 1, index_ + at, (nindex - at) * sizeof(job_t *));
+	index_[at] = j;
+	nindex++;
+}
+
+/* Removes a job that gives up its job number */
+void jobspec_remove(job_t *j) {
+	size_t at = lower_bound(j);
+	if(at < nindex && index_[at] == j) {
+		memmove(index_ + at, index_ + at + 1, (nindex - at - 1) * sizeof(job_t *));
+		nindex--;
+	}
+}
+
+/* Makes j the current job: it was stopped or put in the background */
+void jobspec_touch(job_t *j) {
+	j->touched = ++touches;
+}
+
+static bool is_stopped(job_t *j) {
+	return !job_is_completed(j) && job_is_stopped(j);
+}
+
+/* Whether a comes before b as the current job: stopped jobs first, then
+ * the one touched last */
+static bool before(job_t *a, job_t *b) {
+	if(!b)
+		return true;
+	if(is_stopped(a) != is_stopped(b))
+		return is_stopped(a);
+	return a->touched > b->touched;
+}
+
+/* The current job, or the previous one; NULL if there is none. A scan,
+ * done only when %+ or %- is asked for. */
+job_t *jobspec_current(bool previous) {
+	job_t *first = NULL, *second = NULL;
+	size_t i;
+	for(i = 0; i < nindex; i++) {
+		job_t *j = index_[i];
+		if(before(j, first)) {
+			second = first;
+			first = j;
+		}
+		else if(before(j, second))
+			second = j;
+	}
+	return previous ? second : first;
+}
+
+/* The job spec (without the %) names; NULL if none does, with *ambiguous
+ * set if that is because several do */
+job_t *jobspec_find(const char *spec, bool *ambiguous) {
+	job_t *found = NULL;
+	size_t i, lo = 0, hi = nindex, n = strlen(spec);
+	if(ambiguous)
+		*ambiguous = false;
+	if(!*spec || strcmp(spec, "+") == 0 || strcmp(spec, "%") == 0)
+		return jobspec_current(false);
+	if(strcmp(spec, "-") == 0)
+		return jobspec_current(true);
+	if(spec[0] == '?') { /* a scan of the index */
+		for(i = 0; i < nindex; i++)
+			if(strstr(index_[i]->commandinfo, spec + 1)) {
+				if(found) {
+					if(ambiguous)
+						*ambiguous = true;
+					return NULL;
+				}
+				found = index_[i];
+			}
+		return found;
+	}
+	/* the first entry with the prefix; a second one makes it ambiguous */
+	while(lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if(strncmp(key(index_[mid]), spec, n) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if(lo == nindex || strncmp(key(index_[lo]), spec, n) != 0)
+		return NULL;
+	if(lo + 1 < nindex && strncmp(key(index_[lo + 1]), spec, n) == 0) {
+		if(ambiguous)
+			*ambiguous = true;
+		return NULL;
+	}
+	return index_[lo];
+}
+
+static job_t *pgid_first[JOBMAP_MIN];
+static job_t **by_pgid = pgid_first;    /* chained through pgid_next */
+static size_t pgid_buckets = JOBMAP_MIN, npgid;
+static process_t *pid_first[JOBMAP_MIN];
+static process_t **by_pid = pid_first;  /* chained through pid_next, newest first */
+static size_t pid_buckets = JOBMAP_MIN, npid;
+
+static size_t bucket(pid_t id, size_t n) {
+	return ((unsigned) id * 2654435761u) & (n - 1);
+}
+
+/* Doubles the pgid map; it stays as it is without memory */
+static void grow_pgids() {
+	size_t n = 2 * pgid_buckets, i;
+	job_t **grown = (job_t **)calloc(n, sizeof(job_t *)), *j, *next;
+	if(!grown)
+		return;
+	for(i = 0; i < pgid_buckets; i++)
+		for(j = by_pgid[i]; j; j = next) {
+			next = j->pgid_next;
+			j->pgid_next = grown[bucket(j->pgid, n)];
+			grown[bucket(j->pgid, n)] = j;
+		}
+	if(by_pgid != pgid_first)
+		free(by_pgid);
+	by_pgid = grown;
+	pgid_buckets = n;
+}
+
+static void grow_pids() {
+	size_t n = 2 * pid_buckets, i;
+	process_t **grown = (process_t **)calloc(n, sizeof(process_t *)), *p, *next, **tail;
+	if(!grown)
+		return;
+	for(i = 0; i < pid_buckets; i++)
+		for(p = by_pid[i]; p; p = next) { /* appended, so newest stays first */
+			next = p->pid_next;
+			for(tail = &grown[bucket(p->pid, n)]; *tail; tail = &(*tail)->pid_next)
+				;
+			p->pid_next = NULL;
+			*tail = p;
+		}
+	if(by_pid != pid_first)
+		free(by_pid);
+	by_pid = grown;
+	pid_buckets = n;
+}
+
+/* Adds a job that was just given its pgid */
+void jobspec_map_job(job_t *j) {
+	size_t b;
+	if(npgid >= pgid_buckets)
+		grow_pgids();
+	b = bucket(j->pgid, pgid_buckets);
+	j->pgid_next = by_pgid[b];
+	by_pgid[b] = j;
+	npgid++;
+}
+
+/* Adds a process of j that was just spawned. A pid the kernel reused
+ * finds the new process first. */
+void jobspec_map_process(job_t *j, process_t *p) {
+	size_t b;
+	if(npid >= pid_buckets)
+		grow_pids();
+	b = bucket(p->pid, pid_buckets);
+	p->job = j;
+	p->pid_next = by_pid[b];
+	by_pid[b] = p;
+	npid++;
+}
+
+/* Removes a job that is being freed, and its processes */
+void jobspec_unmap(job_t *j) {
+	job_t **jl;
+	process_t *p, **pl;
+	for(p = j->first_process; p; p = p->next)
+		if(p->job == j) {
+			for(pl = &by_pid[bucket(p->pid, pid_buckets)]; *pl && *pl != p; pl = &(*pl)->pid_next)
+				;
+			if(*pl) {
+				*pl = p->pid_next;
+				npid--;
+			}
+			p->job = NULL;
+		}
+	if(j->pgid <= 0)
+		return;
+	for(jl = &by_pgid[bucket(j->pgid, pgid_buckets)]; *jl && *jl != j; jl = &(*jl)->pgid_next)
+		;
+	if(*jl) {
+		*jl = j->pgid_next;
+		npgid--;
+	}
+}
+
+/* The job whose process group is pgid; NULL if none */
+job_t *jobspec_job(pid_t pgid) {
+	job_t *j;
+	for(j = by_pgid[bucket(pgid, pgid_buckets)]; j && j->pgid != pgid; j = j->pgid_next)
+		;
+	return j;
+}
+
+/* The latest process spawned with pid, its job in ->job; NULL if none */
+process_t *jobspec_process(pid_t pid) {
+	process_t *p;
+	for(p = by_pid[bucket(pid, pid_buckets)]; p && p->pid != pid; p = p->pid_next)
+		;
+	return p;
+}
@@ -0,0 +1,20 @@
+#ifndef __JOBSPEC_H__        /* check if this header file is already defined elsewhere */
+#define __JOBSPEC_H__
+
+#include "dsh.h"
+
+#define JOBSPEC_MIN 64      /* index entries allocated at first */
+#define JOBMAP_MIN 64       /* buckets of the pgid and pid maps at first; a power of two */
+
+void jobspec_add(job_t *j);
+void jobspec_remove(job_t *j);
+void jobspec_touch(job_t *j);
+job_t *jobspec_current(bool previous);
+job_t *jobspec_find(const char *spec, bool *ambiguous);
+void jobspec_map_job(job_t *j);
+void jobspec_map_process(job_t *j, process_t *p);
+void jobspec_unmap(job_t *j);
+job_t *jobspec_job(pid_t pgid);
+process_t *jobspec_process(pid_t pid);
+
+#endif /* __JOBSPEC_H__ */
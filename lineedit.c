@@ -0,0 +1,517 @@
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include "lineedit.h"
+#include "complete.h"
+#include "tty.h"
+
+/* A line editor for the interactive prompt, run with the terminal in raw
+ * mode. The screen is never repainted as a whole: every edit emits only the
+ * escape sequences needed to bring the terminal in line with the buffer
+ * (insert/delete character where the rest of the line fits on the cursor's
+ * row, a rewrite of the tail otherwise), and everything a keystroke produces
+ * goes out in a single write(). Cursor arithmetic is done on offsets counted
+ * in columns from the start of the prompt, so lines longer than the terminal
+ * is wide wrap without any full redraw. A UTF-8 sequence counts as one
+ * column. */
+
+#define OUTBUF 16384
+
+typedef struct editor {
+	char buf[MAX_LEN_CMDLINE];
+	size_t len, pos;        /* bytes in the line, and before the cursor */
+	size_t clen, cpos;      /* the same counted in columns */
+	size_t plen;            /* columns taken by the prompt */
+	size_t cols;            /* terminal width */
+	int esc;                /* escape sequence state, see feed_byte() */
+	char seq[16];           /* parameters of a CSI sequence */
+	size_t seqlen;
+	char uc[4];             /* UTF-8 sequence being collected */
+	size_t uclen, ucneed;
+	int hist;               /* history entry shown; nhist for the new line */
+	char saved[MAX_LEN_CMDLINE]; /* the new line while browsing history */
+} editor_t;
+
+static editor_t le;
+
+static char out[OUTBUF];    /* output of the current keystroke */
+static size_t outlen;
+static char pending[MAX_LEN_CMDLINE]; /* typed ahead past the end of a line */
+static size_t npending;
+static char *history[HISTORY_MAX];
+static int nhist;
+
+static void flush_out() {
+	size_t done = 0;
+	while(done < outlen) {
+		ssize_t n = write(STDOUT_FILENO, out + done, outlen - done);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n <= 0)
+			break;
+		done += n;
+	}
+	outlen = 0;
+}
+
+static void emit(const char *s, size_t n) {
+	if(outlen + n > sizeof(out))
+		flush_out();
+	if(n > sizeof(out)) {
+		memcpy(out, s, sizeof(out));
+		outlen = sizeof(out);
+		emit(s + sizeof(out), n - sizeof(out));
+		return;
+	}
+	memcpy(out + outlen, s, n);
+	outlen += n;
+}
+
+/* Emits the control sequence ESC [ n cmd, leaving out a count of 1 */
+static void csi(size_t n, char cmd) {
+	char b[32];
+	int k = n == 1 ? snprintf(b, sizeof(b), "\x1b[%c", cmd)
+	               : snprintf(b, sizeof(b), "\x1b[%zu%c", n, cmd);
+	emit(b, k);
+}
+
+static bool is_cont(char c) {
+	return ((unsigned char) c & 0xC0) == 0x80;
+}
+
+/* Columns taken by buf[from..to) */
+static size_t columns(size_t from, size_t to) {
+	size_t n = 0;
+	for(; from < to; from++)
+		if(!is_cont(le.buf[from]))
+			n++;
+	return n;
+}
+
+static size_t next_char(size_t i) {
+	if(i < le.len)
+		for(i++; i < le.len && is_cont(le.buf[i]); i++);
+	return i;
+}
+
+static size_t prev_char(size_t i) {
+	if(i > 0)
+		for(i--; i > 0 && is_cont(le.buf[i]); i--);
+	return i;
+}
+
+/* Offset of a column of the line from the start of the prompt */
+static size_t at(size_t col) {
+	return le.plen + col;
+}
+
+/* Moves the terminal cursor from one offset to another */
+static void move(size_t from, size_t to) {
+	size_t fr = from / le.cols, fc = from % le.cols;
+	size_t tr = to / le.cols, tc = to % le.cols;
+	if(tr < fr)
+		csi(fr - tr, 'A');
+	else if(tr > fr)
+		csi(tr - fr, 'B');
+	if(tc == fc)
+		return;
+	if(tc == 0)
+		emit("\r", 1);
+	else if(tc > fc)
+		csi(tc - fc, 'C');
+	else
+		csi(fc - tc, 'D');
+}
+
+/* Writes s, which starts at offset start, and returns the offset reached.
+ * A terminal that fills its last column leaves the cursor there until the
+ * next character arrives, so in that case wrap explicitly: the cursor is
+ * then always where the offset says it is. */
+static size_t draw(const char *s, size_t n, size_t start, size_t cols) {
+	size_t end = start + cols;
+	emit(s, n);
+	if(end > start && end % le.cols == 0)
+		emit("\r\n", 2);
+	return end;
+}
+
+static size_t draw_line(size_t from, size_t start) {
+	return draw(le.buf + from, le.len - from, start, columns(from, le.len));
+}
+
+static void set_cursor(size_t pos) {
+	size_t cpos = pos < le.pos ? le.cpos - columns(pos, le.pos) : le.cpos + columns(le.pos, pos);
+	move(at(le.cpos), at(cpos));
+	le.pos = pos;
+	le.cpos = cpos;
+}
+
+/* Inserts one character (n bytes of UTF-8) at the cursor */
+static void insert(const char *s, size_t n) {
+	size_t here = at(le.cpos);
+	if(le.len + n >= sizeof(le.buf)) {
+		emit("\a", 1);
+		return;
+	}
+	bool at_end = le.pos == le.len;
+	bool one_row = (at(le.clen) + 1) / le.cols == here / le.cols;
+	memmove(le.buf + le.pos + n, le.buf + le.pos, le.len - le.pos);
+	memcpy(le.buf + le.pos, s, n);
+	le.len += n;
+	le.buf[le.len] = '\0';
+	le.clen++;
+	if(at_end)
+		draw(s, n, here, 1);
+	else if(one_row) {
+		csi(1, '@');
+		emit(s, n);
+	} else
+		move(draw_line(le.pos, here), here + 1);
+	le.pos += n;
+	le.cpos++;
+}
+
+/* Deletes the character under the cursor */
+static void delete_char() {
+	size_t here = at(le.cpos), n = next_char(le.pos) - le.pos;
+	if(le.pos == le.len)
+		return;
+	bool one_row = at(le.clen) / le.cols == here / le.cols;
+	memmove(le.buf + le.pos, le.buf + le.pos + n, le.len - le.pos - n + 1);
+	le.len -= n;
+	le.clen--;
+	if(one_row)
+		csi(1, 'P');
+	else {
+		size_t end = draw_line(le.pos, here);
+		emit("\x1b[J", 3);
+		move(end, here);
+	}
+}
+
+/* Deletes from buf[from] up to the cursor */
+static void delete_back(size_t from) {
+	if(from == le.pos)
+		return;
+	size_t n = le.pos - from;
+	set_cursor(from);
+	size_t here = at(le.cpos);
+	le.clen -= columns(from, from + n);
+	memmove(le.buf + from, le.buf + from + n, le.len - from - n + 1);
+	le.len -= n;
+	size_t end = draw_line(from, here);
+	emit("\x1b[J", 3);
+	move(end, here);
+}
+
+/* Replaces the line, rewriting only what follows the common prefix */
+static void replace(const char *s) {
+	size_t keep = 0;
+	while(keep < le.len && s[keep] && s[keep] == le.buf[keep])
+		keep++;
+	while(keep > 0 && is_cont(le.buf[keep]))
+		keep--;
+	set_cursor(keep);
+	snprintf(le.buf + keep, sizeof(le.buf) - keep, "%s", s + keep);
+	le.len = strlen(le.buf);
+	le.clen = le.cpos + columns(keep, le.len);
+	draw_line(keep, at(le.cpos));
+	emit("\x1b[J", 3);
+	le.pos = le.len;
+	le.cpos = le.clen;
+}
+
+static size_t word_left() {
+	size_t i = le.pos;
+	while(i > 0 && le.buf[i - 1] == ' ')
+		i--;
+	while(i > 0 && le.buf[i - 1] != ' ')
+		i--;
+	return i;
+}
+
+static size_t word_right() {
+	size_t i = le.pos;
+	while(i < le.len && le.buf[i] == ' ')
+		i++;
+	while(i < le.len && le.buf[i] != ' ')
+		i++;
+	return i;
+}
+
+static void history_show(int h) {
+	if(h < 0 || h > nhist || h == le.hist)
+		return;
+	if(le.hist == nhist)
+		memcpy(le.saved, le.buf, le.len + 1);
+	le.hist = h;
+	replace(h == nhist ? le.saved : history[h]);
+}
+
+/* Leaves the cursor at the start of the row after the line */
+static void finish_line() {
+	move(at(le.cpos), at(le.clen));
+	if(at(le.clen) % le.cols != 0)
+		emit("\r\n", 2);
+}
+
+static const char *cur_prompt = "";
+
+/* Draws the prompt and line from the start of the cursor's row */
+static void repaint() {
+	draw(cur_prompt, le.plen, 0, le.plen);
+	move(draw_line(0, at(0)), at(le.cpos));
+}
+
+/* Inserts s at the cursor, one character at a time */
+static void insert_text(const char *s) {
+	while(*s) {
+		size_t n = 1;
+		while(s[n] && is_cont(s[n]))
+			n++;
+		insert(s, n);
+		s += n;
+	}
+}
+
+/* Lists matches below the line, as many per row as fit, and repaints */
+static void list_matches(completion_t *c) {
+	size_t col = 0, w;
+	char more[32];
+	int i;
+	finish_line();
+	for(i = 0; i < c->nlist; i++) {
+		w = strlen(c->list[i]);
+		if(col && col + w + 2 > le.cols) {
+			emit("\r\n", 2);
+			col = 0;
+		}
+		emit(c->list[i], w);
+		emit("  ", 2);
+		col += w + 2;
+	}
+	if(c->n > c->nlist)
+		emit(more, snprintf(more, sizeof(more), "(%d more)", c->n - c->nlist));
+	emit("\r\n", 2);
+	repaint();
+}
+
+/* Completes the word before the cursor as far as all matches agree, then
+ * ends it if only one matched or lists the matches if nothing was added. */
+static void complete() {
+	static completion_t c;
+	size_t start = le.pos;
+	while(start > 0 && !strchr(" <>|;&", le.buf[start - 1]))
+		start--;
+	if(!complete_word(le.buf, start, le.pos, &c) || c.n == 0) {
+		emit("\a", 1);
+		return;
+	}
+	insert_text(c.suffix);
+	if(c.n == 1)
+		insert(c.dir ? "/" : " ", 1);
+	else if(!c.suffix[0])
+		list_matches(&c);
+}
+
+/* Handles the final byte of an escape sequence: ESC [ params cmd or ESC O cmd */
+static void escape(char cmd) {
+	bool ctrl = strstr(le.seq, ";5") != NULL; /* ctrl-left/right move by words */
+	switch(cmd) {
+	   case 'A': history_show(le.hist - 1); break;
+	   case 'B': history_show(le.hist + 1); break;
+	   case 'C': set_cursor(ctrl ? word_right() : next_char(le.pos)); break;
+	   case 'D': set_cursor(ctrl ? word_left() : prev_char(le.pos)); break;
+	   case 'H': set_cursor(0); break;
+	   case 'F': set_cursor(le.len); break;
+	   case '~':
+		switch(atoi(le.seq)) {
+		   case 1: case 7: set_cursor(0); break;
+		   case 4: case 8: set_cursor(le.len); break;
+		   case 3: delete_char(); break;
+		}
+		break;
+	}
+}
+
+/* Runs one input byte through the editor; returns LE_MORE, LE_DONE or LE_EOF.
+ * esc is 0 outside escape sequences, 1 after ESC, 2 inside ESC [ and 3
+ * after ESC O. */
+static int feed_byte(char c) {
+	unsigned char u = (unsigned char) c;
+
+	if(le.esc == 1) {
+		le.esc = 0;
+		if(c == '[' || c == 'O') {
+			le.esc = c == '[' ? 2 : 3;
+			le.seqlen = 0;
+			le.seq[0] = '\0';
+		} else if(c == 'b')
+			set_cursor(word_left());
+		else if(c == 'f')
+			set_cursor(word_right());
+		return LE_MORE;
+	}
+	if(le.esc >= 2) {
+		if(u >= 0x30 && u <= 0x3f) {
+			if(le.seqlen < sizeof(le.seq) - 1) {
+				le.seq[le.seqlen++] = c;
+				le.seq[le.seqlen] = '\0';
+			}
+			return LE_MORE;
+		}
+		le.esc = 0;
+		escape(c);
+		return LE_MORE;
+	}
+	if(le.ucneed) {
+		if(!is_cont(c))
+			le.ucneed = 0; /* broken sequence: drop it */
+		else {
+			le.uc[le.uclen++] = c;
+			if(--le.ucneed == 0)
+				insert(le.uc, le.uclen);
+			return LE_MORE;
+		}
+	}
+	if(u >= 0xc0 && u < 0xf8) {
+		le.uc[0] = c;
+		le.uclen = 1;
+		le.ucneed = u >= 0xf0 ? 3 : u >= 0xe0 ? 2 : 1;
+		return LE_MORE;
+	}
+	if(u >= 0x20 && u != 0x7f) {
+		if(u < 0x80)
+			insert(&c, 1);
+		return LE_MORE;
+	}
+
+	switch(c) {
+	   case '\r': case '\n':
+		finish_line();
+		return LE_DONE;
+	   case 0x03: /* ctrl-c: drop the line */
+		move(at(le.cpos), at(le.clen));
+		emit("^C\r\n", 4);
+		le.buf[le.len = 0] = '\0';
+		return LE_DONE;
+	   case 0x04: /* ctrl-d: end of input on an empty line */
+		if(le.len == 0)
+			return LE_EOF;
+		delete_char();
+		break;
+	   case 0x7f: case 0x08: /* backspace */
+		if(le.pos == 0)
+			break;
+		set_cursor(prev_char(le.pos));
+		delete_char();
+		break;
+	   case 0x01: set_cursor(0); break;                   /* ctrl-a */
+	   case 0x05: set_cursor(le.len); break;              /* ctrl-e */
+	   case 0x02: set_cursor(prev_char(le.pos)); break;   /* ctrl-b */
+	   case 0x06: set_cursor(next_char(le.pos)); break;   /* ctrl-f */
+	   case 0x10: history_show(le.hist - 1); break;       /* ctrl-p */
+	   case 0x0e: history_show(le.hist + 1); break;       /* ctrl-n */
+	   case 0x0b: /* ctrl-k */
+		emit("\x1b[J", 3);
+		le.buf[le.len = le.pos] = '\0';
+		le.clen = le.cpos;
+		break;
+	   case 0x15: delete_back(0); break;                  /* ctrl-u */
+	   case 0x17: delete_back(word_left()); break;        /* ctrl-w */
+	   case 0x0c: /* ctrl-l: repaint on a cleared screen */
+		emit("\x1b[H\x1b[2J", 7);
+		repaint();
+		break;
+	   case '\t': complete(); break;
+	   case 0x1b: le.esc = 1; break;
+	}
+	return LE_MORE;
+}
+
+/* Feeds input bytes to the editor. Bytes following the end of the line are
+ * kept for the next one. The output for all of them is written at once. */
+int lineedit_feed(const char *bytes, size_t n) {
+	size_t i;
+	int r = LE_MORE;
+	for(i = 0; i < n && r == LE_MORE; i++)
+		r = feed_byte(bytes[i]);
+	if(r != LE_MORE && i < n) {
+		size_t keep = n - i < sizeof(pending) ? n - i : sizeof(pending);
+		memcpy(pending, bytes + i, keep);
+		npending = keep;
+	}
+	flush_out();
+	return r;
+}
+
+const char *lineedit_line() {
+	return le.buf;
+}
+
+/* Puts the terminal in raw mode, draws the prompt and replays any input
+ * typed ahead of it. */
+int lineedit_start(const char *prompt) {
+	struct termios raw = shell_tmodes;
+	struct winsize ws;
+	char ahead[sizeof(pending)];
+	size_t n = npending;
+
+	raw.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+	raw.c_iflag &= ~(ICRNL | INLCR | IXON);
+	raw.c_cc[VMIN] = 1;
+	raw.c_cc[VTIME] = 0;
+	tty_set_modes(&raw);
+
+	memset(&le, 0, offsetof(editor_t, saved));
+	le.cols = ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 ? ws.ws_col : 80;
+	le.plen = strlen(prompt);
+	le.hist = nhist;
+	cur_prompt = prompt;
+
+	fflush(stdout); /* job notices go out before the prompt */
+	draw(prompt, le.plen, 0, le.plen);
+	memcpy(ahead, pending, n);
+	npending = 0;
+	return lineedit_feed(ahead, n);
+}
+
+/* Gives the terminal its cooked modes back */
+void lineedit_stop() {
+	tty_set_modes(&shell_tmodes);
+}
+
+/* Takes the prompt and line off the screen, leaving the cursor where the
+ * prompt began, so that something can be printed in their place */
+void lineedit_hide() {
+	move(at(le.cpos), 0);
+	emit("\r\x1b[J", 4);
+	flush_out();
+}
+
+/* Draws the prompt and line again after lineedit_hide() */
+void lineedit_show() {
+	repaint();
+	flush_out();
+}
+
+/* Remembers a line for up/down, skipping blanks and repeats */
+void history_add(const char *line) {
+	size_t n = strcspn(line, "\n");
+	if(n == 0 || (nhist > 0 && strncmp(history[nhist - 1], line, n) == 0 && history[nhist - 1][n] == '\0'))
+		return;
+	char *copy = strndup(line, n);
+	if(!copy)
+		return;
+	if(nhist == HISTORY_MAX) {
+		free(history[0]);
+		memmove(history, history + 1, (HISTORY_MAX - 1) * sizeof(char *));
+		nhist--;
+	}
+	history[nhist++] = copy;
+}
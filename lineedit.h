@@ -0,0 +1,21 @@
+#ifndef __LINEEDIT_H__       /* check if this header file is already defined elsewhere */
+#define __LINEEDIT_H__
+
+#include "dsh.h"
+
+#define HISTORY_MAX 500     /* command lines remembered for up/down */
+
+/* Results of lineedit_feed() */
+#define LE_MORE 0           /* line not finished yet */
+#define LE_DONE 1           /* a line was entered, see lineedit_line() */
+#define LE_EOF  2           /* ctrl-d on an empty line */
+
+int lineedit_start(const char *prompt);
+int lineedit_feed(const char *bytes, size_t n);
+const char *lineedit_line();
+void lineedit_stop();
+void lineedit_hide();
+void lineedit_show();
+void history_add(const char *line);
+
+#endif /* __LINEEDIT_H__ */
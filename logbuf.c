@@ -0,0 +1,137 @@
+#include <sys/types.h>
+#include <termios.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "logbuf.h"
+#include "aio.h"
+
+bool logbuf_open(logbuf_t *b, const char *path, size_t cap) {
+	struct stat st;
+	b->len = 0;
+	b->cap = cap;
+	b->path = path;
+	b->size = 0;
+	b->max = 0;
+	b->keep = 0;
+	if(!(b->buf = (char *)malloc(cap))) {
+		b->fd = -1;
+		return false;
+	}
+	if((b->fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666)) < 0) {
+		perror(path);
+		free(b->buf);
+		b->buf = NULL;
+		return false;
+	}
+	if(fstat(b->fd, &st) == 0)
+		b->size = st.st_size;
+	return true;
+}
+
+/* Rotates the file once it would grow past max bytes, keeping keep old ones */
+void logbuf_rotate_at(logbuf_t *b, off_t max, int keep) {
+	b->max = max;
+	b->keep = keep;
+}
+
+/* Rotate the file by size: path becomes path.1, path.1 becomes path.2 and
+ * so on up to path.keep, which is dropped. */
+static void rotate(logbuf_t *b) {
+	char from[PATH_MAX], to[PATH_MAX];
+	int i;
+	for(i = b->keep; i > 1; i--) {
+		snprintf(from, sizeof(from), "%s.%d", b->path, i - 1);
+		snprintf(to, sizeof(to), "%s.%d", b->path, i);
+		rename(from, to);
+	}
+	snprintf(to, sizeof(to), "%s.1", b->path);
+	if(b->keep > 0)
+		rename(b->path, to);
+	else
+		unlink(b->path);
+	int fd = open(b->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+	if(fd < 0) {
+		perror(b->path);
+		return; /* keep writing to the old file */
+	}
+	aio_flush(b->fd);
+	close(b->fd);
+	b->fd = fd;
+	b->size = 0;
+}
+
+/* The write completes in the background (see aio.c); if it fails the
+ * records are lost, since logging must not stop the shell. */
+void logbuf_flush(logbuf_t *b) {
+	if(b->max > 0 && b->size > 0 && b->size + (off_t) b->len > b->max)
+		rotate(b);
+	b->size += b->len;
+	if(b->len > 0)
+		aio_write(b->fd, b->buf, b->len);
+	b->len = 0;
+}
+
+/* Records larger than the whole buffer are written straight through. */
+void logbuf_append(logbuf_t *b, const char *data, size_t len) {
+	if(b->fd < 0)
+		return;
+	if(b->len + len > b->cap)
+		logbuf_flush(b);
+	if(len > b->cap) {
+		aio_write(b->fd, data, len); /* a failed write loses the record, see logbuf_flush() */
+		b->size += len;
+		return;
+	}
+	memcpy(b->buf + b->len, data, len);
+	b->len += len;
+}
+
+void logbuf_printf(logbuf_t *b, const char *fmt, ...) {
+	char line[4096];
+	va_list ap;
+	va_start(ap, fmt);
+	int n = vsnprintf(line, sizeof(line), fmt, ap);
+	va_end(ap);
+	if(n >= (int) sizeof(line))
+		n = sizeof(line) - 1;
+	if(n > 0)
+		logbuf_append(b, line, n);
+}
+
+void logbuf_close(logbuf_t *b) {
+	if(b->fd < 0)
+		return;
+	logbuf_flush(b);
+	aio_flush(b->fd);
+	close(b->fd);
+	free(b->buf);
+	b->buf = NULL;
+	b->fd = -1;
+}
+
+/* Copies src into dst as the inside of a JSON string, truncating to fit.
+ * Returns the length written, not counting the terminating NUL. */
+size_t json_escape(char *dst, size_t cap, const char *src) {
+	size_t n = 0;
+	for(; *src && n + 7 < cap; src++) {
+		unsigned char c = *src;
+		if(c == '"' || c == '\\') {
+			dst[n++] = '\\';
+			dst[n++] = c;
+		} else if(c == '\n') {
+			dst[n++] = '\\';
+			dst[n++] = 'n';
+		} else if(c < 0x20)
+			n += snprintf(dst + n, cap - n, "\\u%04x", c);
+		else
+			dst[n++] = c;
+	}
+	if(cap)
+		dst[n] = '\0';
+	return n;
+}
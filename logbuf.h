@@ -0,0 +1,29 @@
+#ifndef __LOGBUF_H__         /* check if this header file is already defined elsewhere */
+#define __LOGBUF_H__
+
+#include "dsh.h"
+
+/* Append-only output file with a bounded in-memory buffer: records are
+ * collected in memory and handed to aio_write() in one piece when the
+ * buffer fills or on an explicit flush. The buffer is never flushed
+ * implicitly, so a forked child cannot write out the shell's pending
+ * records a second time. */
+typedef struct logbuf {
+        int fd;                     /* O_APPEND, close-on-exec; -1 when closed */
+        char *buf;
+        size_t len, cap;
+        const char *path;
+        off_t size;                 /* current size of the file */
+        off_t max;                  /* rotate when the file would grow past this; 0 never */
+        int keep;                   /* rotated files kept as path.1 .. path.keep */
+} logbuf_t;
+
+bool logbuf_open(logbuf_t *b, const char *path, size_t cap);
+void logbuf_rotate_at(logbuf_t *b, off_t max, int keep);
+void logbuf_append(logbuf_t *b, const char *data, size_t len);
+void logbuf_printf(logbuf_t *b, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void logbuf_flush(logbuf_t *b);
+void logbuf_close(logbuf_t *b);
+size_t json_escape(char *dst, size_t cap, const char *src);
+
+#endif /* __LOGBUF_H__ */
@@ -0,0 +1,161 @@
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <termios.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <errno.h>
+#include "loop.h"
+#include "aio.h"
+#include "metrics.h"
+
+/* The shell's event loop. Everything the shell waits for is a descriptor
+ * in one epoll set: the terminal or script while a line is read, a pipe
+ * written by the SIGCHLD handler, timerfds, and the completion queue of
+ * the shell's own output (see aio.c). Reading a line and waiting for a
+ * foreground job are both loops around loop_once() that stop when their
+ * state says so, so whichever of them is running, a child changing state,
+ * a timer expiring or an output write completing is served within one
+ * pass. Functions called from the loop must not block.
+ *
+ * SIGCHLD goes through a self-pipe rather than a signalfd, which would
+ * need the signal blocked in every thread and unblocked again in every
+ * child. The handler only writes a byte; the children are reaped from the
+ * loop, once per pass however many signals came. */
+
+static int epfd = -1;
+static int chld_pipe[2] = { -1, -1 };
+static loop_watch_t *watches;   /* indexed by descriptor */
+static int nwatches;
+static unsigned next_gen = 0;
+static bool children;           /* set when the current pass reaped */
+
+static void on_sigchld(int sig, siginfo_t *si, void *ctx) {
+	int saved = errno;
+	if(si->si_code != CLD_STOPPED && si->si_code != CLD_CONTINUED)
+		METRICS(metrics_sigchld());
+	ssize_t n = write(chld_pipe[1], "", 1); /* a full pipe has a wakeup pending already */
+	(void) n;
+	errno = saved;
+}
+
+static void on_children(int fd, unsigned events, void *arg) {
+	char drain[64];
+	while(read(fd, drain, sizeof(drain)) > 0)
+		;
+	reap_children();
+	children = true;
+}
+
+static void on_aio(int fd, unsigned events, void *arg) {
+	aio_poll();
+}
+
+/* Makes room for the watch of fd; false if there is no memory for it */
+static bool grow(int fd) {
+	int n = nwatches ? nwatches : LOOP_WATCHES, i;
+	loop_watch_t *grown;
+	while(n <= fd)
+		n *= 2;
+	if(n == nwatches)
+		return true;
+	if(!(grown = (loop_watch_t *)realloc(watches, n * sizeof(loop_watch_t)))) {
+		errno = ENOMEM;
+		return false;
+	}
+	for(i = nwatches; i < n; i++)
+		grown[i].fd = -1;
+	watches = grown;
+	nwatches = n;
+	return true;
+}
+
+/* Sets up the epoll set and the SIGCHLD handler; the shell cannot wait
+ * for its jobs without them */
+void loop_init() {
+	struct sigaction sa;
+	int afd;
+	if((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0 || pipe2(chld_pipe, O_CLOEXEC | O_NONBLOCK) < 0
+	   || !loop_watch(chld_pipe[0], EPOLLIN, on_children, NULL)) {
+		perror("Couldn't set up the event loop");
+		exit(1);
+	}
+	sa.sa_sigaction = on_sigchld;
+	sa.sa_flags = SA_RESTART | SA_SIGINFO;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGCHLD, &sa, NULL);
+	if((afd = aio_fd()) >= 0 && !loop_watch(afd, EPOLLIN, on_aio, NULL))
+		perror("aio: epoll_ctl");
+}
+
+/* Calls fn whenever fd is ready for events (EPOLLIN, EPOLLOUT). Returns
+ * false if fd cannot be watched, e.g. a regular file, which is always
+ * ready. */
+bool loop_watch(int fd, unsigned events, loop_fn fn, void *arg) {
+	struct epoll_event ev;
+	if(fd < 0 || !grow(fd))
+		return false;
+	ev.events = events;
+	ev.data.u64 = (uint64_t) ++next_gen << 32 | (uint32_t) fd;
+	if(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+		return false;
+	watches[fd].fd = fd;
+	watches[fd].timer = false;
+	watches[fd].gen = next_gen;
+	watches[fd].fn = fn;
+	watches[fd].arg = arg;
+	return true;
+}
+
+/* Stops watching fd; a timer is closed as well */
+void loop_unwatch(int fd) {
+	if(fd < 0 || fd >= nwatches || watches[fd].fd < 0)
+		return;
+	epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+	if(watches[fd].timer)
+		close(fd);
+	watches[fd].fd = -1;
+}
+
+/* A new timer calling fn when it expires, disarmed; -1 on failure. Free
+ * it with loop_unwatch(). */
+int loop_timer(loop_fn fn, void *arg) {
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	if(fd < 0)
+		return -1;
+	if(!loop_watch(fd, EPOLLIN, fn, arg)) {
+		close(fd);
+		return -1;
+	}
+	watches[fd].timer = true;
+	return fd;
+}
+
+/* Makes timer expire once, ms milliseconds from now; 0 disarms it */
+bool loop_arm(int timer, long ms) {
+	struct itimerspec it = { { 0, 0 }, { ms / 1000, (ms % 1000) * 1000000L } };
+	return timerfd_settime(timer, 0, &it, NULL) == 0;
+}
+
+/* Waits up to ms (-1: without a limit) for watched descriptors and calls
+ * the function of every one that is ready, in the same pass. Returns true
+ * if children were reaped, i.e. jobs may have changed state. */
+bool loop_once(int ms) {
+	struct epoll_event ev[LOOP_EVENTS];
+	int i, n;
+	children = false;
+	n = epoll_wait(epfd, ev, LOOP_EVENTS, ms); /* EINTR: a signal came, go round again */
+	for(i = 0; i < n; i++) {
+		loop_watch_t *w = &watches[(uint32_t) ev[i].data.u64]; /* not moved until fn runs */
+		uint64_t expired;
+		if(w->fd < 0 || w->gen != ev[i].data.u64 >> 32)
+			continue; /* unwatched by an earlier function of this pass */
+		if(w->timer && read(w->fd, &expired, sizeof(expired)) != sizeof(expired))
+			continue; /* disarmed again meanwhile */
+		w->fn(w->fd, ev[i].events, w->arg);
+	}
+	return children;
+}
@@ -0,0 +1,30 @@
+#ifndef __LOOP_H__           /* check if this header file is already defined elsewhere */
+#define __LOOP_H__
+
+#include "dsh.h"
+
+#define LOOP_WATCHES 64         /* watch slots at first; the table grows to the highest descriptor */
+#define LOOP_EVENTS 64          /* events taken from epoll in one pass */
+
+/* Called with the descriptor and the epoll events it is ready for */
+typedef void (*loop_fn)(int fd, unsigned events, void *arg);
+
+/* A watched descriptor, in the slot of its number. gen tells an event for
+ * a descriptor watched again since it was returned apart from one for the
+ * current watch. */
+typedef struct loop_watch {
+        int fd;                     /* -1: slot free */
+        bool timer;                 /* a timerfd of loop_timer(), closed with the watch */
+        unsigned gen;
+        loop_fn fn;
+        void *arg;
+} loop_watch_t;
+
+void loop_init();
+bool loop_watch(int fd, unsigned events, loop_fn fn, void *arg);
+void loop_unwatch(int fd);
+int loop_timer(loop_fn fn, void *arg);
+bool loop_arm(int timer, long ms);
+bool loop_once(int ms);
+
+#endif /* __LOOP_H__ */
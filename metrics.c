@@ -0,0 +1,236 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <termios.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <poll.h>
+#include <dirent.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include "metrics.h"
+
+/* Upper bounds of the reap latency histogram buckets, in seconds */
+static const double reap_bounds[] = { 1e-5, 5e-5, 1e-4, 5e-4, 1e-3, 5e-3, 1e-2, 1e-1, 1 };
+#define NBOUNDS (sizeof(reap_bounds) / sizeof(reap_bounds[0]))
+
+bool metrics_on = false;
+static char *sock_path;
+static int sock_fd = -1;
+static pthread_t metrics_tid;
+
+static atomic_ulong spawns;
+static atomic_ulong reaps;
+static atomic_ulong reap_buckets[NBOUNDS + 1];	/* last one is +Inf */
+static atomic_ullong reap_ns;			/* sum of reap latencies */
+static atomic_ullong sigchld_at;		/* first unreaped SIGCHLD, ns; 0 if none */
+static atomic_ulong parses;
+static atomic_ullong parse_ns;
+static atomic_int jobs_active, jobs_stopped, jobs_queued;
+static unsigned long last_spawns;	/* spawns at the previous scrape (helper thread) */
+static unsigned long long last_at;	/* time of the previous scrape, or of startup */
+
+static unsigned long long now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Reap latency is measured from the first SIGCHLD not yet followed by a
+ * reap. Only the first arrival is kept; clock_gettime is async-signal-safe.
+ * Called from the event loop's SIGCHLD handler for exits only. */
+void metrics_sigchld() {
+	unsigned long long expected = 0;
+	atomic_compare_exchange_strong(&sigchld_at, &expected, now_ns());
+}
+
+void metrics_spawned() {
+	atomic_fetch_add_explicit(&spawns, 1, memory_order_relaxed);
+}
+
+void metrics_reaped() {
+	unsigned long long at = atomic_exchange(&sigchld_at, 0);
+	size_t b;
+	atomic_fetch_add_explicit(&reaps, 1, memory_order_relaxed);
+	if(!at)
+		return; /* reaped before the signal arrived */
+	unsigned long long ns = now_ns() - at;
+	for(b = 0; b < NBOUNDS && ns > reap_bounds[b] * 1e9; b++)
+		;
+	atomic_fetch_add_explicit(&reap_buckets[b], 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&reap_ns, ns, memory_order_relaxed);
+}
+
+void metrics_parsed(double seconds) {
+	atomic_fetch_add_explicit(&parses, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&parse_ns, (unsigned long long)(seconds * 1e9), memory_order_relaxed);
+}
+
+/* Recounts the job gauges from the job list (main thread only). */
+void metrics_jobs(job_t *first) {
+	int active = 0, stopped = 0, queued = 0;
+	job_t *j;
+	process_t *p;
+	for(j = first; j; j = j->next) {
+		bool running = false, anystopped = false, done = true;
+		if(j->pgid < 0) {
+			queued++;
+			continue;
+		}
+		for(p = j->first_process; p; p = p->next) {
+			if(!p->completed) done = false;
+			if(p->stopped) anystopped = true;
+			else if(!p->completed) running = true;
+		}
+		if(done)
+			continue;
+		if(anystopped && !running) stopped++;
+		else active++;
+	}
+	atomic_store_explicit(&jobs_active, active, memory_order_relaxed);
+	atomic_store_explicit(&jobs_stopped, stopped, memory_order_relaxed);
+	atomic_store_explicit(&jobs_queued, queued, memory_order_relaxed);
+}
+
+static int count_fds() {
+	int n = 0;
+	DIR *d = opendir("/proc/self/fd");
+	if(!d)
+		return -1;
+	while(readdir(d))
+		n++;
+	closedir(d);
+	return n - 3; /* ., .. and the descriptor of d itself */
+}
+
+#define EMIT(...) (n += snprintf(out + n, n < cap ? cap - n : 0, __VA_ARGS__))
+
+static int render(char *out, int cap) {
+	unsigned long long t = now_ns();
+	unsigned long sp = atomic_load(&spawns), cum = 0;
+	double rate = t > last_at ? (sp - last_spawns) / ((t - last_at) / 1e9) : 0;
+	struct mallinfo2 mi = mallinfo2();
+	int n = 0;
+	size_t b;
+
+	last_spawns = sp;
+	last_at = t;
+	EMIT("# HELP dsh_spawns_total Processes forked by the shell.\n# TYPE dsh_spawns_total counter\n");
+	EMIT("dsh_spawns_total %lu\n", sp);
+	EMIT("# HELP dsh_spawns_per_second Spawn rate since the previous scrape.\n# TYPE dsh_spawns_per_second gauge\n");
+	EMIT("dsh_spawns_per_second %.3f\n", rate);
+	EMIT("# HELP dsh_jobs Jobs in the job list by state.\n# TYPE dsh_jobs gauge\n");
+	EMIT("dsh_jobs{state=\"active\"} %d\n", atomic_load(&jobs_active));
+	EMIT("dsh_jobs{state=\"stopped\"} %d\n", atomic_load(&jobs_stopped));
+	EMIT("dsh_jobs{state=\"queued\"} %d\n", atomic_load(&jobs_queued));
+	EMIT("# HELP dsh_reap_latency_seconds Time from SIGCHLD to the child being reaped.\n"
+	     "# TYPE dsh_reap_latency_seconds histogram\n");
+	for(b = 0; b <= NBOUNDS; b++) {
+		cum += atomic_load(&reap_buckets[b]);
+		if(b < NBOUNDS)
+			EMIT("dsh_reap_latency_seconds_bucket{le=\"%g\"} %lu\n", reap_bounds[b], cum);
+		else
+			EMIT("dsh_reap_latency_seconds_bucket{le=\"+Inf\"} %lu\n", cum);
+	}
+	EMIT("dsh_reap_latency_seconds_sum %.9f\n", atomic_load(&reap_ns) / 1e9);
+	EMIT("dsh_reap_latency_seconds_count %lu\n", cum);
+	EMIT("# HELP dsh_reaps_total Children reaped.\n# TYPE dsh_reaps_total counter\n");
+	EMIT("dsh_reaps_total %lu\n", atomic_load(&reaps));
+	EMIT("# HELP dsh_parse_seconds Time spent parsing command lines.\n# TYPE dsh_parse_seconds summary\n");
+	EMIT("dsh_parse_seconds_sum %.9f\n", atomic_load(&parse_ns) / 1e9);
+	EMIT("dsh_parse_seconds_count %lu\n", atomic_load(&parses));
+	EMIT("# HELP dsh_malloc_bytes Allocator statistics from mallinfo2().\n# TYPE dsh_malloc_bytes gauge\n");
+	EMIT("dsh_malloc_bytes{kind=\"arena\"} %zu\n", mi.arena);
+	EMIT("dsh_malloc_bytes{kind=\"in_use\"} %zu\n", mi.uordblks);
+	EMIT("dsh_malloc_bytes{kind=\"free\"} %zu\n", mi.fordblks);
+	EMIT("dsh_malloc_bytes{kind=\"mmap\"} %zu\n", mi.hblkhd);
+	EMIT("# HELP dsh_open_fds Open file descriptors.\n# TYPE dsh_open_fds gauge\n");
+	EMIT("dsh_open_fds %d\n", count_fds());
+	return n < cap ? n : cap - 1;
+}
+
+/* Clients may send an HTTP request (curl --unix-socket) or nothing at all
+ * (socat); wait briefly to tell which. */
+static void serve(int fd) {
+	char req[1024], body[8192], head[128];
+	struct pollfd pfd = { fd, POLLIN, 0 };
+	bool http = false;
+	if(poll(&pfd, 1, 100) > 0) {
+		ssize_t r = read(fd, req, sizeof(req) - 1);
+		http = r >= 4 && strncmp(req, "GET ", 4) == 0;
+	}
+	int len = render(body, sizeof(body));
+	if(http) {
+		int h = snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+			"Content-Length: %d\r\n\r\n", len);
+		if(write(fd, head, h) < 0)
+			return;
+	}
+	if(write(fd, body, len) < 0)
+		return;
+}
+
+static void *metrics_thread(void *arg) {
+	for(;;) {
+		int fd = accept4(sock_fd, NULL, NULL, SOCK_CLOEXEC);
+		if(fd < 0) {
+			if(errno == EINTR || errno == ECONNABORTED)
+				continue;
+			return NULL;
+		}
+		serve(fd);
+		close(fd);
+	}
+}
+
+void metrics_init() {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	sigset_t all, old;
+
+	if(!(sock_path = getenv("DSH_METRICS")))
+		return;
+	if(strlen(sock_path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "DSH_METRICS: path too long\n");
+		return;
+	}
+	strcpy(addr.sun_path, sock_path);
+	unlink(sock_path);
+	if((sock_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0
+	   || bind(sock_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+	   || listen(sock_fd, 8) < 0) {
+		perror("metrics socket");
+		if(sock_fd >= 0)
+			close(sock_fd);
+		sock_fd = -1;
+		return;
+	}
+
+	last_at = now_ns();
+	/* signals are for the shell's thread; the helper starts with all blocked */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	if(pthread_create(&metrics_tid, NULL, metrics_thread, NULL) != 0) {
+		perror("metrics thread");
+		close(sock_fd);
+		sock_fd = -1;
+	} else
+		metrics_on = true;
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+void metrics_close() {
+	if(sock_fd < 0)
+		return;
+	unlink(sock_path);
+	metrics_on = false;
+	/* wakes the thread in accept(), which then returns */
+	shutdown(sock_fd, SHUT_RDWR);
+	pthread_join(metrics_tid, NULL);
+	close(sock_fd);
+	sock_fd = -1;
+}
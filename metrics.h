@@ -0,0 +1,23 @@
+#ifndef __METRICS_H__        /* check if this header file is already defined elsewhere */
+#define __METRICS_H__
+
+#include "dsh.h"
+
+/* Shell counters served in the Prometheus text format on a Unix-domain
+ * socket, enabled with DSH_METRICS=path. A helper thread answers the
+ * socket; the shell only does relaxed atomic updates, so the hot paths
+ * never take a lock. Try: curl --unix-socket path http://dsh/metrics */
+
+extern bool metrics_on;
+
+#define METRICS(call) do { if(__builtin_expect(metrics_on, 0)) call; } while(0)
+
+void metrics_init();
+void metrics_close();
+void metrics_spawned();
+void metrics_reaped();
+void metrics_sigchld();
+void metrics_parsed(double seconds);
+void metrics_jobs(job_t *first);
+
+#endif /* __METRICS_H__ */
@@ -0,0 +1,109 @@
+#include <sys/types.h>
+#include <termios.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include "pipes.h"
+
+static long pipe_max = 0;	/* /proc/sys/fs/pipe-max-size; 0 if unknown */
+static long pipe_default = 0;	/* DSH_PIPESZ; 0 keeps the kernel default */
+
+/* Parse a byte count with an optional K, M or G suffix.
+ * Returns -1 on malformed input or a count too large for a long. */
+long parse_size(const char *s) {
+	char *end;
+	int shift = 0;
+	long n;
+	errno = 0;
+	n = strtol(s, &end, 10);
+	if(end == s || n < 0 || errno == ERANGE)
+		return -1;
+	switch(*end) {
+	   case 'k': case 'K': shift = 10; ++end; break;
+	   case 'm': case 'M': shift = 20; ++end; break;
+	   case 'g': case 'G': shift = 30; ++end; break;
+	}
+	if(*end != '\0' || n > LONG_MAX >> shift)
+		return -1;
+	return n << shift;
+}
+
+/* Read the global pipe capacity (DSH_PIPESZ) and the system limit. */
+void pipes_init() {
+	FILE *f = fopen("/proc/sys/fs/pipe-max-size", "r");
+	if(f) {
+		if(fscanf(f, "%ld", &pipe_max) != 1)
+			pipe_max = 0;
+		fclose(f);
+	}
+	char *env = getenv("DSH_PIPESZ");
+	if(env && (pipe_default = parse_size(env)) < 0) {
+		fprintf(stderr, "DSH_PIPESZ: could not fathom %s\n", env);
+		pipe_default = 0;
+	}
+}
+
+long default_pipe_size() {
+	return pipe_default;
+}
+
+/* pipe() with close-on-exec ends that also sets the capacity when size > 0,
+ * capped at pipe-max-size and at what F_SETPIPE_SZ takes. A failed resize
+ * keeps the default capacity. */
+int make_pipe(int fds[2], long size) {
+	if(pipe2(fds, O_CLOEXEC) < 0)
+		return -1;
+	if(size > 0) {
+		if(pipe_max > 0 && size > pipe_max)
+			size = pipe_max;
+		if(size > INT_MAX)
+			size = INT_MAX;
+		if(fcntl(fds[1], F_SETPIPE_SZ, (int) size) < 0)
+			perror("fcntl(F_SETPIPE_SZ)");
+	}
+	return 0;
+}
+
+/* Body of a relay stage: move everything from in to out with splice(), so
+ * the data never passes through user space, and log how much went through.
+ * Falls back to read/write if the descriptors cannot be spliced. */
+void run_relay(int in, int out) {
+	struct timespec start, end;
+	long long total = 0;
+	ssize_t n;
+	char *buf = NULL;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(;;) {
+		if(!buf) {
+			n = splice(in, NULL, out, NULL, RELAY_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+			if(n < 0 && errno == EINVAL && !(buf = malloc(RELAY_CHUNK)))
+				break;
+			if(n < 0 && errno == EINVAL)
+				continue;
+		} else if((n = read(in, buf, RELAY_CHUNK)) > 0) {
+			ssize_t off = 0, w;
+			while(off < n && (w = write(out, buf + off, n - off)) > 0)
+				off += w;
+			if(off < n)
+				break;
+		}
+		if(n == 0)
+			break;
+		if(n < 0) {
+			if(errno == EINTR)
+				continue;
+			perror("relay");
+			break;
+		}
+		total += n;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	fprintf(stderr, "relay %d: %lld bytes in %.3fs\n", (int) getpid(), total,
+		(end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+	free(buf);
+}
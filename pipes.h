@@ -0,0 +1,15 @@
+#ifndef __PIPES_H__          /* check if this header file is already defined elsewhere */
+#define __PIPES_H__
+
+#include "dsh.h"
+
+/* Bytes moved per splice() call by a relay stage */
+#define RELAY_CHUNK (1 << 20)
+
+void pipes_init();
+long parse_size(const char *s);
+long default_pipe_size();
+int make_pipe(int fds[2], long size);
+void run_relay(int in, int out);
+
+#endif /* __PIPES_H__ */
@@ -0,0 +1,508 @@
+#include <sys/types.h>
+#include <termios.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <fnmatch.h>
+#include "script.h"
+#include "vars.h"
+
+/* Control flow for dsh: if/elif/else/fi, while and until loops, for loops
+ * and case, in scripts and at the prompt.
+ *
+ * Input is first cut into segments at newlines, ';' and '&', with ';;'
+ * kept as a segment of its own and a leading keyword split off the command
+ * that follows it ("do echo $i" becomes "do" and "echo $i"). A recursive
+ * descent compiler then turns the segments into a flat array of
+ * instructions with absolute jump targets. Every plain command is parsed
+ * once, by parse_jobs(), into job templates that OP_RUN copies (expanding
+ * variables) each time it runs, so loop bodies are never tokenized again.
+ * The interpreter is a loop over the instruction array. */
+
+static const char *keywords[] = {
+	"if", "then", "elif", "else", "fi", "while", "until", "do", "done",
+	"for", "case", "esac", ";;", NULL
+};
+/* keywords that may be followed by a command in the same segment */
+static const char *leading[] = { "if", "then", "elif", "else", "while", "until", "do", NULL };
+
+typedef struct compiler {
+	char **segs;
+	int nsegs, cap;
+	int i;                      /* next segment */
+	program_t *prog;
+	bool more;                  /* input ended inside a construct */
+} compiler_t;
+
+static bool word_is(const char *s, size_t len, const char **list) {
+	for(; *list; list++)
+		if(strlen(*list) == len && strncmp(s, *list, len) == 0)
+			return true;
+	return false;
+}
+
+/* Inserts s[0..len) as segment number at, splitting off a leading keyword
+ * (or "case WORD in").
+ * Returns the number of segments added, or -1 when out of memory. */
+static int add_seg(compiler_t *c, int at, const char *s, size_t len) {
+	while(len && strchr(" \t\n", *s)) {
+		s++;
+		len--;
+	}
+	while(len && strchr(" \t\n", s[len - 1]))
+		len--;
+	if(!len)
+		return 0;
+	size_t w = strcspn(s, " \t\n");
+	bool cut = word_is(s, w, leading);
+	if(w == 4 && strncmp(s, "case", 4) == 0) { /* the first pattern may follow "case WORD in" */
+		int words = 1;
+		cut = true;
+		while(words < 3 && w < len) {
+			w += strspn(s + w, " \t\n");
+			w += strcspn(s + w, " \t\n");
+			words++;
+		}
+	}
+	if(w < len && cut) {
+		int a = add_seg(c, at, s, w), b;
+		if(a < 0 || (b = add_seg(c, at + a, s + w, len - w)) < 0)
+			return -1;
+		return a + b;
+	}
+	if(c->nsegs == c->cap) {
+		char **grown = realloc(c->segs, (c->cap = c->cap ? c->cap * 2 : 16) * sizeof(char *));
+		if(!grown)
+			return -1;
+		c->segs = grown;
+	}
+	char *seg = strndup(s, len);
+	if(!seg)
+		return -1;
+	memmove(c->segs + at + 1, c->segs + at, (c->nsegs - at) * sizeof(char *));
+	c->segs[at] = seg;
+	c->nsegs++;
+	return 1;
+}
+
+static bool split(compiler_t *c, const char *text) {
+	size_t i = 0, start = 0;
+	while(text[i]) {
+		char ch = text[i];
+		if(ch == '#') { /* comment */
+			if(add_seg(c, c->nsegs, text + start, i - start) < 0)
+				return false;
+			while(text[i] && text[i] != '\n')
+				i++;
+			start = i;
+		} else if(ch == ';' && text[i + 1] == ';') {
+			if(add_seg(c, c->nsegs, text + start, i - start) < 0 || add_seg(c, c->nsegs, ";;", 2) < 0)
+				return false;
+			start = i += 2;
+		} else if(ch == ';' || ch == '\n') {
+			if(add_seg(c, c->nsegs, text + start, i - start) < 0)
+				return false;
+			start = ++i;
+		} else if(ch == '&' && text[i + 1] != '>' && (i == 0 || !strchr("<>", text[i - 1]))) {
+			if(add_seg(c, c->nsegs, text + start, ++i - start) < 0) /* keep the & */
+				return false;
+			start = i;
+		} else
+			i++;
+	}
+	return add_seg(c, c->nsegs, text + start, i - start) >= 0;
+}
+
+/* The keyword starting the next segment; NULL if there is none */
+static const char *kw(compiler_t *c) {
+	const char **k;
+	if(c->i >= c->nsegs)
+		return NULL;
+	size_t w = strcspn(c->segs[c->i], " \t");
+	for(k = keywords; *k; k++)
+		if(strlen(*k) == w && strncmp(c->segs[c->i], *k, w) == 0)
+			return *k;
+	return NULL;
+}
+
+static bool syntax_error(compiler_t *c) {
+	fprintf(stderr, "syntax error near '%s'\n", c->i < c->nsegs ? c->segs[c->i] : "end of input");
+	return false;
+}
+
+static bool expect(compiler_t *c, const char *word) {
+	if(c->i >= c->nsegs) {
+		c->more = true;
+		return false;
+	}
+	if(strcmp(c->segs[c->i], word) != 0)
+		return syntax_error(c);
+	c->i++;
+	return true;
+}
+
+static int emit(compiler_t *c, opcode_t op) {
+	program_t *p = c->prog;
+	if(p->n == p->cap) {
+		instr_t *grown = realloc(p->code, (p->cap = p->cap ? p->cap * 2 : 16) * sizeof(instr_t));
+		if(!grown) {
+			fprintf(stderr, "malloc: no space\n");
+			return -1;
+		}
+		p->code = grown;
+	}
+	memset(&p->code[p->n], 0, sizeof(instr_t));
+	p->code[p->n].op = op;
+	p->code[p->n].target = -1;
+	return p->n++;
+}
+
+/* Jumps still to be patched are chained through their targets */
+static void patch(compiler_t *c, int chain, int target) {
+	while(chain >= 0) {
+		int next = c->prog->code[chain].target;
+		c->prog->code[chain].target = target;
+		chain = next;
+	}
+}
+
+/* Splits s at any of sep into a malloc'ed array of strdup'ed words */
+static char **words_of(char *s, const char *sep, int *n) {
+	char **v = NULL, *w, *save;
+	*n = 0;
+	for(w = strtok_r(s, sep, &save); w; w = strtok_r(NULL, sep, &save)) {
+		char **grown = realloc(v, (*n + 1) * sizeof(char *));
+		if(!grown || !(grown[*n] = strdup(w))) {
+			v = grown ? grown : v;
+			while((*n)--)
+				free(v[*n]);
+			free(v);
+			*n = -1;
+			return NULL;
+		}
+		v = grown;
+		(*n)++;
+	}
+	return v;
+}
+
+static void free_words(char **v, int n) {
+	while(n-- > 0)
+		free(v[n]);
+	free(v);
+}
+
+static bool compile_command(compiler_t *c);
+
+/* Compiles commands until a segment starts with one of the keywords in stop
+ * (space separated). Without stop, compiles to the end of the input. */
+static bool compile_list(compiler_t *c, const char *stop) {
+	while(c->i < c->nsegs) {
+		const char *k = kw(c);
+		if(k && stop) {
+			const char *hit = strstr(stop, k);
+			size_t len = strlen(k);
+			if(hit && (hit == stop || hit[-1] == ' ') && (hit[len] == ' ' || hit[len] == '\0'))
+				return true;
+		}
+		if(!compile_command(c))
+			return false;
+	}
+	if(stop)
+		c->more = true;
+	return !stop;
+}
+
+static bool compile_if(compiler_t *c) {
+	int chain = -1, jf, j;
+	c->i++;
+	for(;;) {
+		if(!compile_list(c, "then") || !expect(c, "then"))
+			return false;
+		if((jf = emit(c, OP_JUMPF)) < 0 || !compile_list(c, "elif else fi"))
+			return false;
+		const char *k = kw(c);
+		if(strcmp(k, "fi") != 0) { /* the branch skips the rest */
+			if((j = emit(c, OP_JUMP)) < 0)
+				return false;
+			c->prog->code[j].target = chain;
+			chain = j;
+		}
+		c->prog->code[jf].target = c->prog->n;
+		if(strcmp(k, "elif") == 0) {
+			c->i++;
+			continue;
+		}
+		if(strcmp(k, "else") == 0) {
+			c->i++;
+			if(!compile_list(c, "fi"))
+				return false;
+		}
+		break;
+	}
+	if(!expect(c, "fi"))
+		return false;
+	patch(c, chain, c->prog->n);
+	return true;
+}
+
+static bool compile_while(compiler_t *c, bool until) {
+	int top = c->prog->n, jf, j;
+	c->i++;
+	if(!compile_list(c, "do") || !expect(c, "do"))
+		return false;
+	if((jf = emit(c, until ? OP_JUMPT : OP_JUMPF)) < 0 || !compile_list(c, "done"))
+		return false;
+	if((j = emit(c, OP_JUMP)) < 0)
+		return false;
+	c->prog->code[j].target = top;
+	if(!expect(c, "done"))
+		return false;
+	c->prog->code[jf].target = c->prog->n;
+	return true;
+}
+
+/* for NAME [in WORD...] */
+static bool compile_for(compiler_t *c) {
+	int n, at, j;
+	char **w = words_of(c->segs[c->i], " \t", &n);
+	if(n < 0)
+		return false;
+	if(n < 2 || !valid_name(w[1], strlen(w[1])) || (n > 2 && strcmp(w[2], "in") != 0)) {
+		free_words(w, n);
+		return syntax_error(c);
+	}
+	c->i++;
+	if((at = emit(c, OP_FOR)) < 0) {
+		free_words(w, n);
+		return false;
+	}
+	instr_t *ins = &c->prog->code[at];
+	ins->var = w[1];
+	ins->nwords = n > 3 ? n - 3 : 0;
+	if(ins->nwords && (ins->words = (char **)malloc(ins->nwords * sizeof(char *))))
+		memcpy(ins->words, w + 3, ins->nwords * sizeof(char *));
+	else
+		ins->nwords = 0;
+	free(w[0]);
+	if(n > 2)
+		free(w[2]);
+	free(w);
+	if(!expect(c, "do") || !compile_list(c, "done"))
+		return false;
+	if((j = emit(c, OP_JUMP)) < 0)
+		return false;
+	c->prog->code[j].target = at;
+	if(!expect(c, "done"))
+		return false;
+	c->prog->code[at].target = c->prog->n;
+	return true;
+}
+
+/* case WORD in [(]PATTERN[|PATTERN...]) LIST ;; ... esac */
+static bool compile_case(compiler_t *c) {
+	int n, at, m, j, chain = -1;
+	char **w = words_of(c->segs[c->i], " \t", &n);
+	if(n < 0)
+		return false;
+	if(n != 3 || strcmp(w[2], "in") != 0) {
+		free_words(w, n);
+		return syntax_error(c);
+	}
+	c->i++;
+	if((at = emit(c, OP_SUBJECT)) < 0) {
+		free_words(w, n);
+		return false;
+	}
+	free(w[0]);
+	free(w[2]);
+	w[0] = w[1];
+	c->prog->code[at].words = w;
+	c->prog->code[at].nwords = 1;
+
+	for(;;) {
+		const char *k = kw(c);
+		if(c->i >= c->nsegs) {
+			c->more = true;
+			return false;
+		}
+		if(k && strcmp(k, "esac") == 0)
+			break;
+		char *seg = c->segs[c->i], *close = strchr(seg, ')'), *pat = seg;
+		if(!close)
+			return syntax_error(c);
+		*close = '\0';
+		while(*pat == ' ' || *pat == '(')
+			pat++;
+		if((m = emit(c, OP_MATCH)) < 0)
+			return false;
+		if(!(c->prog->code[m].words = words_of(pat, "| \t", &c->prog->code[m].nwords)))
+			return syntax_error(c);
+		/* the command after the pattern becomes the next segment */
+		char *rest = close + 1;
+		c->segs[c->i] = NULL;
+		if(add_seg(c, c->i + 1, rest, strlen(rest)) < 0) {
+			free(seg);
+			return false;
+		}
+		memmove(c->segs + c->i, c->segs + c->i + 1, (c->nsegs - c->i - 1) * sizeof(char *));
+		c->nsegs--;
+		free(seg);
+
+		if(!compile_list(c, "esac ;;"))
+			return false;
+		if((j = emit(c, OP_JUMP)) < 0)
+			return false;
+		c->prog->code[j].target = chain;
+		chain = j;
+		c->prog->code[m].target = c->prog->n;
+		if(strcmp(kw(c), ";;") == 0)
+			c->i++;
+	}
+	if(!expect(c, "esac"))
+		return false;
+	patch(c, chain, c->prog->n);
+	return true;
+}
+
+static bool compile_command(compiler_t *c) {
+	const char *k = kw(c);
+	job_t *jobs = NULL;
+	int at;
+
+	if(!k) {
+		/* segments are never blank, so no jobs means it did not parse;
+		 * nothing of the program runs then, not even an if around it */
+		if(!parse_jobs(c->segs[c->i], &jobs))
+			return syntax_error(c);
+		c->i++;
+		if((at = emit(c, OP_RUN)) < 0) {
+			free_jobs(jobs);
+			return false;
+		}
+		c->prog->code[at].jobs = jobs;
+		return true;
+	}
+	if(strcmp(k, "if") == 0)
+		return compile_if(c);
+	if(strcmp(k, "while") == 0 || strcmp(k, "until") == 0)
+		return compile_while(c, k[0] == 'u');
+	if(strcmp(k, "for") == 0)
+		return compile_for(c);
+	if(strcmp(k, "case") == 0)
+		return compile_case(c);
+	return syntax_error(c);
+}
+
+/* Compiles text, which may hold several lines, into *prog. */
+int compile(const char *text, program_t **prog) {
+	compiler_t c;
+	int r = COMPILE_OK, i;
+
+	memset(&c, 0, sizeof(c));
+	*prog = NULL;
+	if(!(c.prog = (program_t *)calloc(1, sizeof(program_t))))
+		return COMPILE_ERROR;
+	if(!split(&c, text))
+		r = COMPILE_ERROR;
+	else if(!compile_list(&c, NULL))
+		r = c.more ? COMPILE_MORE : COMPILE_ERROR;
+	for(i = 0; i < c.nsegs; i++)
+		free(c.segs[i]);
+	free(c.segs);
+	if(r != COMPILE_OK)
+		free_program(c.prog);
+	else
+		*prog = c.prog;
+	return r;
+}
+
+/* Expands the word list of a for loop as it starts */
+static void start_loop(instr_t *ins) {
+	int i;
+	free_words(ins->list, ins->nlist);
+	ins->nlist = 0;
+	if(!ins->nwords || !(ins->list = (char **)malloc(ins->nwords * sizeof(char *))))
+		return;
+	for(i = 0; i < ins->nwords; i++)
+		if((ins->list[ins->nlist] = expand_word(ins->words[i])) && ins->list[ins->nlist][0])
+			ins->nlist++;
+		else
+			free(ins->list[ins->nlist]);
+}
+
+static bool matches(instr_t *ins, const char *subject) {
+	int i;
+	for(i = 0; i < ins->nwords; i++) {
+		char *pat = expand_word(ins->words[i]);
+		bool hit = pat && fnmatch(pat, subject, 0) == 0;
+		free(pat);
+		if(hit)
+			return true;
+	}
+	return false;
+}
+
+/* Runs a compiled program; returns the status of the last command. A job
+ * killed by ctrl-c or stopped by ctrl-z ends the whole program, so that a
+ * loop at the prompt can be interrupted. */
+int run_program(program_t *prog) {
+	char *subject = NULL;
+	int pc = 0;
+	while(pc < prog->n) {
+		instr_t *ins = &prog->code[pc++];
+		switch(ins->op) {
+		   case OP_RUN:
+			run_jobs(ins->jobs);
+			if(last_status == 128 + SIGINT || last_status == 128 + SIGTSTP)
+				pc = prog->n;
+			break;
+		   case OP_JUMP:
+			pc = ins->target;
+			break;
+		   case OP_JUMPF:
+			if(last_status)
+				pc = ins->target;
+			break;
+		   case OP_JUMPT:
+			if(!last_status)
+				pc = ins->target;
+			break;
+		   case OP_FOR:
+			if(ins->next == 0)
+				start_loop(ins);
+			if(ins->next < ins->nlist)
+				var_set(ins->var, ins->list[ins->next++]);
+			else {
+				ins->next = 0;
+				pc = ins->target;
+			}
+			break;
+		   case OP_SUBJECT:
+			free(subject);
+			subject = expand_word(ins->words[0]);
+			break;
+		   case OP_MATCH:
+			if(!subject || !matches(ins, subject))
+				pc = ins->target;
+			break;
+		}
+	}
+	free(subject);
+	return last_status;
+}
+
+void free_program(program_t *prog) {
+	int i;
+	if(!prog)
+		return;
+	for(i = 0; i < prog->n; i++) {
+		instr_t *ins = &prog->code[i];
+		free_jobs(ins->jobs);
+		free(ins->var);
+		free_words(ins->words, ins->nwords);
+		free_words(ins->list, ins->nlist);
+	}
+	free(prog->code);
+	free(prog);
+}
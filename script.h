@@ -0,0 +1,42 @@
+#ifndef __SCRIPT_H__         /* check if this header file is already defined elsewhere */
+#define __SCRIPT_H__
+
+#include "dsh.h"
+
+/* Results of compile() */
+#define COMPILE_OK    0     /* a complete program */
+#define COMPILE_MORE  1     /* an if/while/for/case is still open: read more lines */
+#define COMPILE_ERROR 2     /* syntax error, already reported */
+
+/* Instructions of a compiled program */
+typedef enum {
+        OP_RUN,                     /* run the job templates in jobs */
+        OP_JUMP,                    /* continue at target */
+        OP_JUMPF,                   /* continue at target if the last status is nonzero */
+        OP_JUMPT,                   /* continue at target if the last status is zero */
+        OP_FOR,                     /* set var to the next word, or continue at target when done */
+        OP_SUBJECT,                 /* expand words[0] as the word case matches against */
+        OP_MATCH                    /* continue at target unless the subject matches one of words */
+} opcode_t;
+
+typedef struct instr {
+        opcode_t op;
+        int target;                 /* jump destination */
+        job_t *jobs;                /* OP_RUN: parsed jobs, copied for every run */
+        char *var;                  /* OP_FOR: loop variable */
+        char **words;               /* OP_FOR: list; OP_SUBJECT: subject; OP_MATCH: patterns */
+        int nwords;
+        char **list;                /* OP_FOR: the expanded list of the running loop */
+        int nlist, next;
+} instr_t;
+
+typedef struct program {
+        instr_t *code;
+        int n, cap;
+} program_t;
+
+int compile(const char *text, program_t **prog);
+int run_program(program_t *prog);
+void free_program(program_t *prog);
+
+#endif /* __SCRIPT_H__ */
@@ -0,0 +1,87 @@
+#include <sys/types.h>
+#include <termios.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include "timeout.h"
+#include "loop.h"
+#include "trace.h"
+
+/* Wall-clock limits on jobs: @timeout=DURATION arms a timerfd in the event
+ * loop when the job starts. When it runs out the job's whole process group
+ * gets @killsig=SIG (TERM by default; a stopped job is continued to see
+ * it), and if anything is left @grace=DURATION later (5s by default) it
+ * gets SIGKILL. The job then shows as "Timed out" and its status is 124.
+ * The timer is created before the job is spawned, so a job that cannot
+ * have one does not start, and goes away when the job finishes or is
+ * freed. A duration is a number of seconds, which may have a fraction, or
+ * a number with an ms, s, m or h suffix. */
+
+/* Milliseconds in a duration like 10, 1.5s, 500ms, 2m or 1h; -1 on
+ * malformed input, nan, inf, or a duration a long cannot hold */
+long parse_duration(const char *s) {
+	char *end;
+	double n = strtod(s, &end);
+	long scale = 1000;
+	if(end == s || !isfinite(n) || n < 0)
+		return -1;
+	if(strcmp(end, "ms") == 0)
+		scale = 1;
+	else if(strcmp(end, "m") == 0)
+		scale = 60000;
+	else if(strcmp(end, "h") == 0)
+		scale = 3600000;
+	else if(*end && strcmp(end, "s") != 0)
+		return -1;
+	n *= scale;
+	if(n >= (double) LONG_MAX) /* that is 2^63, already out of range */
+		return -1;
+	return (long) n;
+}
+
+static void on_expired(int fd, unsigned events, void *arg) {
+	job_t *j = (job_t *) arg;
+	int sig = j->timed_out ? SIGKILL : j->timeout_sig;
+	TRACE(trace_instant("timeout", j->pgid, sig));
+	kill(-j->pgid, sig);
+	if(j->timed_out)
+		return; /* nothing more to send */
+	j->timed_out = true;
+	if(sig != SIGKILL && !job_is_completed(j) && job_is_stopped(j))
+		kill(-j->pgid, SIGCONT);
+	if(sig == SIGKILL)
+		return;
+	if(j->grace == 0)
+		kill(-j->pgid, SIGKILL);
+	else
+		loop_arm(fd, j->grace);
+}
+
+/* Gets the timer of a job with @timeout= before it is spawned; false if
+ * there is none to be had, and the job must not start */
+bool timeout_prepare(job_t *j) {
+	if(j->timeout <= 0 || j->timer >= 0)
+		return true;
+	return (j->timer = loop_timer(on_expired, j)) >= 0;
+}
+
+/* Starts the clock of a job that was just spawned with @timeout=. A job
+ * the clock cannot run for is killed rather than left without a limit. */
+void timeout_arm(job_t *j) {
+	if(j->timeout <= 0)
+		return;
+	if(!timeout_prepare(j) || !loop_arm(j->timer, j->timeout)) {
+		perror("timeout: timerfd");
+		j->timed_out = true;
+		kill(-j->pgid, SIGKILL);
+	}
+}
+
+/* Stops the clock: the job finished or is going away */
+void timeout_disarm(job_t *j) {
+	if(j->timer >= 0)
+		loop_unwatch(j->timer);
+	j->timer = -1;
+}
@@ -0,0 +1,14 @@
+#ifndef __TIMEOUT_H__        /* check if this header file is already defined elsewhere */
+#define __TIMEOUT_H__
+
+#include "dsh.h"
+
+#define TIMEOUT_GRACE_DEFAULT 5000  /* ms from the first signal to SIGKILL */
+#define TIMEOUT_STATUS 124          /* $? of a job whose limit ran out, as timeout(1) */
+
+long parse_duration(const char *s);
+bool timeout_prepare(job_t *j);
+void timeout_arm(job_t *j);
+void timeout_disarm(job_t *j);
+
+#endif /* __TIMEOUT_H__ */
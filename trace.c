@@ -0,0 +1,103 @@
+#include <sys/types.h>
+#include <termios.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "trace.h"
+#include "logbuf.h"
+
+bool trace_on = false;
+static logbuf_t trace_buf;
+static pid_t trace_pid;	/* the shell; every event is on its process track */
+
+/* Microseconds on the monotonic clock, the unit of the "ts" field. */
+double trace_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* The file is in the JSON array format. Each event is written with a leading
+ * comma after an initial metadata event, so events appended by children
+ * (trace_exec) need no coordination with the shell, and a trace cut short
+ * by a crash still loads: the closing ] is optional in this format. */
+void trace_init(const char *path) {
+	if(!path && !(path = getenv("DSH_TRACE")))
+		return;
+	if(!logbuf_open(&trace_buf, path, TRACE_BUFSZ))
+		return;
+	trace_pid = getpid();
+	trace_on = true;
+	logbuf_printf(&trace_buf, "[{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+		"\"args\":{\"name\":\"dsh\"}}", (int) trace_pid);
+}
+
+void trace_flush() {
+	logbuf_flush(&trace_buf);
+}
+
+void trace_close() {
+	if(!trace_on)
+		return;
+	logbuf_append(&trace_buf, "\n]\n", 3);
+	logbuf_close(&trace_buf);
+	trace_on = false;
+}
+
+void trace_begin(const char *name) {
+	logbuf_printf(&trace_buf, ",\n{\"name\":\"%s\",\"ph\":\"B\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d}",
+		name, trace_now(), (int) trace_pid, (int) trace_pid);
+}
+
+void trace_end(const char *name) {
+	logbuf_printf(&trace_buf, ",\n{\"name\":\"%s\",\"ph\":\"E\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d}",
+		name, trace_now(), (int) trace_pid, (int) trace_pid);
+}
+
+/* A complete event from start until now on the track of tid. */
+void trace_span(const char *name, double start, pid_t tid, int arg) {
+	logbuf_printf(&trace_buf, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+		"\"pid\":%d,\"tid\":%d,\"args\":{\"arg\":%d}}",
+		name, start, trace_now() - start, (int) trace_pid, (int) tid, arg);
+}
+
+void trace_instant(const char *name, pid_t tid, int status) {
+	logbuf_printf(&trace_buf, ",\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,"
+		"\"pid\":%d,\"tid\":%d,\"args\":{\"status\":%d}}",
+		name, trace_now(), (int) trace_pid, (int) tid, status);
+}
+
+/* Jobs are async slices keyed by pgid, so a job shows as one bar from spawn
+ * to completion however its processes interleave with the shell. */
+void trace_job(job_t *j, bool begin) {
+	char cmd[2 * MAX_LEN_CMDLINE];
+	json_escape(cmd, sizeof(cmd), j->commandinfo);
+	logbuf_printf(&trace_buf, ",\n{\"name\":\"%s\",\"cat\":\"job\",\"ph\":\"%s\",\"id\":%d,"
+		"\"ts\":%.3f,\"pid\":%d,\"tid\":%d}",
+		cmd, begin ? "b" : "e", (int) j->pgid, trace_now(), (int) trace_pid, (int) trace_pid);
+}
+
+/* Called in the child right before exec. The shell's buffer is not ours to
+ * flush, so the event goes straight to the file with a single write(). */
+void trace_exec(process_t *p) {
+	char line[512], arg[256];
+	json_escape(arg, sizeof(arg), p->argv[0]);
+	int n = snprintf(line, sizeof(line), ",\n{\"name\":\"exec %s\",\"ph\":\"i\",\"s\":\"t\","
+		"\"ts\":%.3f,\"pid\":%d,\"tid\":%d}",
+		arg, trace_now(), (int) trace_pid, (int) getpid());
+	if(n > 0 && n < (int) sizeof(line)) {
+		ssize_t w = write(trace_buf.fd, line, n);
+		(void) w;
+	}
+}
+
+/* The exec event of a process the zygote started, written by the shell
+ * once it has the pid */
+void trace_spawned(process_t *p, pid_t pid) {
+	char arg[256];
+	json_escape(arg, sizeof(arg), p->argv[0]);
+	logbuf_printf(&trace_buf, ",\n{\"name\":\"exec %s\",\"ph\":\"i\",\"s\":\"t\","
+		"\"ts\":%.3f,\"pid\":%d,\"tid\":%d}",
+		arg, trace_now(), (int) trace_pid, (int) pid);
+}
@@ -0,0 +1,29 @@
+#ifndef __TRACE_H__          /* check if this header file is already defined elsewhere */
+#define __TRACE_H__
+
+#include "dsh.h"
+
+/* Job lifecycle tracing in the Chrome trace event format, viewable in
+ * Perfetto (ui.perfetto.dev) or chrome://tracing. Enabled with -t file or
+ * DSH_TRACE=file. Every tracepoint is wrapped in TRACE() so that a disabled
+ * tracer costs one predictable branch. */
+
+#define TRACE_BUFSZ (64 * 1024)
+
+extern bool trace_on;
+
+#define TRACE(call) do { if(__builtin_expect(trace_on, 0)) call; } while(0)
+
+void trace_init(const char *path);
+void trace_close();
+void trace_flush();
+double trace_now();
+void trace_begin(const char *name);
+void trace_end(const char *name);
+void trace_span(const char *name, double start, pid_t tid, int arg);
+void trace_instant(const char *name, pid_t tid, int status);
+void trace_job(job_t *j, bool begin);
+void trace_exec(process_t *p);
+void trace_spawned(process_t *p, pid_t pid);
+
+#endif /* __TRACE_H__ */
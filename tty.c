@@ -0,0 +1,84 @@
+#include <sys/types.h>
+#include <termios.h>
+#include <unistd.h>
+#include <string.h>
+#include "tty.h"
+#include "trace.h"
+
+/* The terminal as the shell last left it: which process group is in the
+ * foreground and which modes are set. Every change goes through here and
+ * is made only if it is one; a background job or a builtin leaves the
+ * terminal alone, and without a terminal (a script, or stdin not a tty)
+ * none of these functions make a system call.
+ *
+ * The children of a foreground job take the terminal themselves before
+ * exec (see spawn_job()), so the shell only records that. When the job
+ * stops or finishes the shell takes the terminal back and reads the modes
+ * once: a stopped job keeps them for fg, and the shell's own modes are set
+ * again only if the job changed them. */
+
+static int tty_fd = -1;         /* -1: no terminal */
+static pid_t shell;
+static pid_t fg_pgid;           /* foreground process group */
+static struct termios modes;    /* modes in effect */
+static bool modes_known = false;
+
+/* Starts tracking fd, of which shell_pgid is now the foreground group
+ * with shell_tmodes set */
+void tty_init(int fd, pid_t shell_pgid) {
+	tty_fd = fd;
+	shell = fg_pgid = shell_pgid;
+	modes = shell_tmodes;
+	modes_known = true;
+}
+
+/* Records that the processes of pgid took the terminal themselves */
+void tty_given(pid_t pgid) {
+	if(tty_fd >= 0)
+		fg_pgid = pgid;
+}
+
+/* Gives the terminal to a job being continued in the foreground, with
+ * the modes it had when it stopped */
+void tty_give(job_t *j) {
+	if(tty_fd < 0)
+		return;
+	if(fg_pgid != j->pgid) {
+		double t = 0;
+		TRACE(t = trace_now());
+		tcsetpgrp(tty_fd, j->pgid);
+		TRACE(trace_span("tcsetpgrp", t, getpid(), j->pgid));
+		fg_pgid = j->pgid;
+	}
+	tty_set_modes(&j->tmodes);
+}
+
+/* Takes the terminal back after a foreground job stopped or finished */
+void tty_take(job_t *j, bool stopped) {
+	struct termios now;
+	double t = 0;
+	if(tty_fd < 0 || fg_pgid == shell)
+		return; /* nothing held the terminal, e.g. no process started */
+	TRACE(t = trace_now());
+	tcsetpgrp(tty_fd, shell);
+	TRACE(trace_span("tcsetpgrp", t, getpid(), shell));
+	fg_pgid = shell;
+	memset(&now, 0, sizeof(now)); /* the padding is compared too */
+	if(tcgetattr(tty_fd, &now) < 0) {
+		modes_known = false;
+		return;
+	}
+	if(stopped)
+		j->tmodes = now;
+	modes = now;
+	modes_known = true;
+	tty_set_modes(&shell_tmodes);
+}
+
+/* Sets the terminal's modes unless they are already t */
+void tty_set_modes(const struct termios *t) {
+	if(tty_fd < 0 || (modes_known && memcmp(&modes, t, sizeof(modes)) == 0))
+		return;
+	modes_known = tcsetattr(tty_fd, TCSADRAIN, t) == 0;
+	modes = *t;
+}
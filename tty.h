@@ -0,0 +1,12 @@
+#ifndef __TTY_H__            /* check if this header file is already defined elsewhere */
+#define __TTY_H__
+
+#include "dsh.h"
+
+void tty_init(int fd, pid_t shell_pgid);
+void tty_given(pid_t pgid);
+void tty_give(job_t *j);
+void tty_take(job_t *j, bool stopped);
+void tty_set_modes(const struct termios *t);
+
+#endif /* __TTY_H__ */
@@ -0,0 +1,237 @@
+#include <sys/types.h>
+#include <termios.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "vars.h"
+
+/* Shell variables and $name expansion. Variables live in a chained hash
+ * table; expansion happens when a compiled command is instantiated, so a
+ * word without '$' costs one strchr.
+ *
+ * The environment handed to commands is built from the exported variables
+ * and cached: it is rebuilt only after an exported variable changes, so a
+ * spawn just passes the cached array. FOO=1 cmd does not touch the table;
+ * the child lays its assignments over a copy of the array (env_overlay). */
+
+static var_t *vars[VAR_BUCKETS];
+static char **envp;         /* cached environment of the exported variables */
+static bool env_stale = true;
+static unsigned long env_version = 0; /* bumped by every rebuild */
+static int nexported;
+
+static unsigned hash(const char *s, size_t len) {
+	unsigned h = 2166136261u; /* FNV-1a */
+	while(len--)
+		h = (h ^ (unsigned char) *s++) * 16777619u;
+	return h & (VAR_BUCKETS - 1);
+}
+
+/* A name is a letter or _ followed by letters, digits and _ */
+bool valid_name(const char *s, size_t len) {
+	size_t i;
+	if(len == 0 || !(isalpha((unsigned char) s[0]) || s[0] == '_'))
+		return false;
+	for(i = 1; i < len; i++)
+		if(!(isalnum((unsigned char) s[i]) || s[i] == '_'))
+			return false;
+	return true;
+}
+
+static var_t *lookup(const char *name, size_t len) {
+	var_t *v;
+	for(v = vars[hash(name, len)]; v; v = v->next)
+		if(strncmp(v->name, name, len) == 0 && v->name[len] == '\0')
+			return v;
+	return NULL;
+}
+
+/* Length of the name in a NAME=value word; 0 if word is no assignment */
+size_t assignment(const char *word) {
+	size_t n = strcspn(word, "=");
+	return word[n] == '=' && valid_name(word, n) ? n : 0;
+}
+
+void var_set(const char *name, const char *value) {
+	size_t len = strlen(name);
+	var_t *v = lookup(name, len);
+	char *pair = (char *)malloc(len + strlen(value) + 2);
+	if(!pair)
+		return;
+	sprintf(pair, "%s=%s", name, value);
+	if(!v) {
+		if(!(v = (var_t *)calloc(1, sizeof(var_t))) || !(v->name = strdup(name))) {
+			free(v);
+			free(pair);
+			return;
+		}
+		unsigned h = hash(name, len);
+		v->next = vars[h];
+		vars[h] = v;
+	} else
+		free(v->pair);
+	v->pair = pair;
+	v->value = pair + len + 1;
+	if(v->exported)
+		env_stale = true;
+}
+
+/* Marks a variable for the environment of commands, setting it to "" if
+ * it does not exist yet. */
+void var_export(const char *name) {
+	var_t *v = lookup(name, strlen(name));
+	if(!v) {
+		var_set(name, "");
+		if(!(v = lookup(name, strlen(name))))
+			return;
+	}
+	if(!v->exported) {
+		v->exported = true;
+		nexported++;
+		env_stale = true;
+	}
+}
+
+void var_unset(const char *name) {
+	size_t len = strlen(name);
+	var_t **pv, *v;
+	for(pv = &vars[hash(name, len)]; (v = *pv); pv = &v->next)
+		if(strcmp(v->name, name) == 0) {
+			*pv = v->next;
+			if(v->exported) {
+				nexported--;
+				env_stale = true;
+			}
+			free(v->name);
+			free(v->pair);
+			free(v);
+			return;
+		}
+}
+
+/* The value of a variable; NULL if it is not set */
+const char *var_get(const char *name) {
+	var_t *v = lookup(name, strlen(name));
+	return v ? v->value : NULL;
+}
+
+/* Imports the shell's environment as exported variables */
+void vars_init() {
+	char **e;
+	for(e = environ; *e; e++) {
+		size_t n = assignment(*e);
+		char *name;
+		if(!n || !(name = strndup(*e, n)))
+			continue;
+		var_set(name, *e + n + 1);
+		var_export(name);
+		free(name);
+	}
+}
+
+/* The environment for commands, rebuilt only when it is stale. The array
+ * stays valid until the next change to an exported variable. */
+char **var_envp() {
+	int i, n = 0;
+	var_t *v;
+	if(!env_stale && envp)
+		return envp;
+	char **fresh = (char **)realloc(envp, (nexported + 1) * sizeof(char *));
+	if(!fresh)
+		return envp ? envp : environ;
+	envp = fresh;
+	for(i = 0; i < VAR_BUCKETS; i++)
+		for(v = vars[i]; v; v = v->next)
+			if(v->exported)
+				envp[n++] = v->pair;
+	envp[n] = NULL;
+	env_stale = false;
+	env_version++;
+	return envp;
+}
+
+/* Changes whenever var_envp() builds a new environment */
+unsigned long var_env_version() {
+	return env_version;
+}
+
+/* A copy of envp with the NAME=value words in assigns added or replacing
+ * the entries they name. Meant for a child about to exec, whose copy of
+ * the shell's memory nobody else sees; the copy is never freed. */
+char **env_overlay(char **envp, char **assigns, int n) {
+	int len = 0, i, k;
+	char **e;
+	for(e = envp; *e; e++)
+		len++;
+	if(!(e = (char **)malloc((len + n + 1) * sizeof(char *))))
+		return envp;
+	memcpy(e, envp, (len + 1) * sizeof(char *));
+	for(k = 0; k < n; k++) {
+		size_t nl = assignment(assigns[k]) + 1; /* name and '=' */
+		for(i = 0; i < len; i++)
+			if(strncmp(e[i], assigns[k], nl) == 0)
+				break;
+		e[i] = assigns[k];
+		if(i == len)
+			e[++len] = NULL;
+	}
+	return e;
+}
+
+/* Returns a malloc'ed copy of word with $name, ${name} and $? replaced by
+ * their values. Unset variables expand to nothing; a '$' that starts no
+ * name is kept. */
+char *expand_word(const char *word) {
+	char status[16];
+	size_t len = 0, cap = strlen(word) + 1;
+	char *out;
+	const char *s;
+
+	if(!strchr(word, '$'))
+		return strdup(word);
+	if(!(out = (char *)malloc(cap)))
+		return NULL;
+	for(s = word; *s; ) {
+		const char *name = NULL, *value;
+		size_t n = 0, skip = 0;
+		if(s[0] == '$' && s[1] == '?') {
+			snprintf(status, sizeof(status), "%d", last_status);
+			value = status;
+			skip = 2;
+		} else if(s[0] == '$' && s[1] == '{' && (n = strcspn(s + 2, "}")) && s[2 + n] == '}'
+			  && valid_name(s + 2, n)) {
+			name = s + 2;
+			skip = n + 3;
+		} else if(s[0] == '$' && (isalpha((unsigned char) s[1]) || s[1] == '_')) {
+			for(n = 1; isalnum((unsigned char) s[1 + n]) || s[1 + n] == '_'; n++)
+				;
+			name = s + 1;
+			skip = n + 1;
+		}
+		if(!skip) {
+			value = s;
+			n = 1;
+			skip = 1;
+		} else {
+			if(name) {
+				var_t *v = lookup(name, n);
+				value = v ? v->value : "";
+			}
+			n = strlen(value);
+		}
+		if(len + n + 1 > cap) {
+			char *grown = realloc(out, cap = (len + n + 1) * 2);
+			if(!grown) {
+				free(out);
+				return NULL;
+			}
+			out = grown;
+		}
+		memcpy(out + len, value, n);
+		len += n;
+		s += skip;
+	}
+	out[len] = '\0';
+	return out;
+}
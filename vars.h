@@ -0,0 +1,29 @@
+#ifndef __VARS_H__           /* check if this header file is already defined elsewhere */
+#define __VARS_H__
+
+#include "dsh.h"
+
+#define VAR_BUCKETS 256     /* hash table size; a power of two */
+
+/* A shell variable */
+typedef struct var {
+        struct var *next;           /* next in the hash chain */
+        char *name;
+        char *pair;                 /* "name=value", as it goes into the environment */
+        char *value;                /* points into pair */
+        bool exported;
+} var_t;
+
+void vars_init();
+bool valid_name(const char *s, size_t len);
+size_t assignment(const char *word);
+void var_set(const char *name, const char *value);
+void var_export(const char *name);
+void var_unset(const char *name);
+const char *var_get(const char *name);
+char **var_envp();
+unsigned long var_env_version();
+char **env_overlay(char **envp, char **assigns, int n);
+char *expand_word(const char *word);
+
+#endif /* __VARS_H__ */
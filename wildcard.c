@@ -0,0 +1,326 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <termios.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <limits.h>
+#include "wildcard.h"
+
+/* Pathname expansion of *, ? and [...] in command words.
+ *
+ * Each path component with a wildcard is compiled into a token array once
+ * and matched against the names of its directory with a single backtrack
+ * point: a later * only ever resumes from the latest one, so no pattern
+ * takes more than (pattern length x name length) steps.
+ *
+ * Directories are read with raw getdents64() calls into a large buffer
+ * and the names kept in a small LRU cache. A cached listing is used again
+ * while the directory's inode and mtime are unchanged, except when the
+ * mtime was within a second of the read: a file created in that same
+ * clock tick might not have moved the mtime, so such listings are read
+ * again. */
+
+typedef struct linux_dirent64 {
+	ino64_t d_ino;
+	off64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+} dirent64_t;
+
+typedef enum { T_CHAR, T_ANY, T_STAR, T_SET } tkind_t;
+
+typedef struct gtoken {
+	tkind_t kind;
+	unsigned char c;            /* T_CHAR */
+	unsigned char set[32];      /* T_SET: bitmap of the bytes it matches */
+} gtoken_t;
+
+typedef struct results {
+	char **v;
+	int n, cap;
+} results_t;
+
+static globdir_t cache[GLOB_CACHE];
+static unsigned long clock_hand = 0;
+
+/* True if word has a *, ? or [ that glob_word() would expand */
+bool has_glob(const char *word) {
+	return strpbrk(word, "*?[") != NULL;
+}
+
+/* Compiles the component pat[0..len) into tokens (at most len of them).
+ * Returns the number of tokens. A [ without a closing ] is literal. */
+static int compile_pattern(const char *pat, size_t len, gtoken_t *t) {
+	size_t i = 0;
+	int n = 0;
+	while(i < len) {
+		unsigned char ch = pat[i];
+		memset(&t[n], 0, sizeof(gtoken_t));
+		if(ch == '*') {
+			if(n == 0 || t[n - 1].kind != T_STAR) /* ** is * */
+				t[n++].kind = T_STAR;
+			i++;
+			continue;
+		}
+		if(ch == '?') {
+			t[n++].kind = T_ANY;
+			i++;
+			continue;
+		}
+		if(ch == '[') {
+			size_t j = i + 1;
+			bool negate = j < len && (pat[j] == '!' || pat[j] == '^');
+			if(negate)
+				j++;
+			size_t first = j;
+			while(j < len && (pat[j] != ']' || j == first))
+				j++;
+			if(j < len) { /* pat[first..j) is the set */
+				size_t k;
+				for(k = first; k < j; k++) {
+					unsigned char lo = pat[k], hi = lo, c;
+					if(k + 2 < j && pat[k + 1] == '-') {
+						hi = pat[k + 2];
+						k += 2;
+					}
+					for(c = lo; c >= lo && c <= hi; c++) {
+						t[n].set[c >> 3] |= 1 << (c & 7);
+						if(c == 255)
+							break;
+					}
+				}
+				if(negate)
+					for(k = 0; k < 32; k++)
+						t[n].set[k] ^= 0xff;
+				t[n++].kind = T_SET;
+				i = j + 1;
+				continue;
+			}
+		}
+		if(ch == '\\' && i + 1 < len)
+			ch = pat[++i];
+		t[n].kind = T_CHAR;
+		t[n++].c = ch;
+		i++;
+	}
+	return n;
+}
+
+static bool token_matches(const gtoken_t *t, unsigned char c) {
+	switch(t->kind) {
+	   case T_CHAR: return t->c == c;
+	   case T_ANY:  return true;
+	   case T_SET:  return t->set[c >> 3] & (1 << (c & 7));
+	   default:     return false;
+	}
+}
+
+/* Matches name against n tokens. On a mismatch only the most recent *
+ * is retried, one byte further along the name. */
+static bool match(const gtoken_t *t, int n, const char *name) {
+	int i = 0, star = -1;
+	const char *mark = NULL;
+	if(name[0] == '.' && (n == 0 || t[0].kind != T_CHAR || t[0].c != '.'))
+		return false; /* hidden files need an explicit leading dot */
+	while(*name) {
+		if(i < n && t[i].kind == T_STAR) {
+			star = ++i;
+			mark = name;
+		}
+		else if(i < n && token_matches(&t[i], *name)) {
+			i++;
+			name++;
+		}
+		else if(star >= 0) {
+			i = star;
+			name = ++mark;
+		}
+		else
+			return false;
+	}
+	while(i < n && t[i].kind == T_STAR)
+		i++;
+	return i == n;
+}
+
+/* Reads all names in dc->path with getdents64 */
+static bool read_names(globdir_t *dc) {
+	static char buf[GETDENTS_BUF];
+	struct stat st;
+	struct timespec now;
+	size_t cap = 0;
+	long got;
+	int fd = open(dc->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	dc->len = 0;
+	if(fd < 0)
+		return false;
+	if(fstat(fd, &st) < 0) { /* before reading: a change during the read shows next time */
+		close(fd);
+		return false;
+	}
+	while((got = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0) {
+		long off;
+		for(off = 0; off < got; ) {
+			dirent64_t *d = (dirent64_t *)(buf + off);
+			size_t n = strlen(d->d_name) + 1;
+			off += d->d_reclen;
+			if(strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
+				continue;
+			if(dc->len + n > cap) {
+				char *grown = realloc(dc->names, cap = (dc->len + n) * 2);
+				if(!grown) {
+					close(fd);
+					return false;
+				}
+				dc->names = grown;
+			}
+			memcpy(dc->names + dc->len, d->d_name, n);
+			dc->len += n;
+		}
+	}
+	close(fd);
+	if(got < 0)
+		return false;
+	clock_gettime(CLOCK_REALTIME, &now);
+	dc->dev = st.st_dev;
+	dc->ino = st.st_ino;
+	dc->mtime = st.st_mtim;
+	dc->read_at = now.tv_sec;
+	return true;
+}
+
+/* The cached listing of path, read again if the directory changed */
+static globdir_t *lookup_dir(const char *path) {
+	globdir_t *dc = NULL, *victim = &cache[0];
+	struct stat st;
+	int i;
+
+	if(stat(path, &st) < 0 || !S_ISDIR(st.st_mode))
+		return NULL;
+	for(i = 0; i < GLOB_CACHE; i++) {
+		if(cache[i].path && strcmp(cache[i].path, path) == 0) {
+			dc = &cache[i];
+			break;
+		}
+		if(cache[i].used < victim->used)
+			victim = &cache[i];
+	}
+	if(dc && dc->dev == st.st_dev && dc->ino == st.st_ino
+	   && dc->mtime.tv_sec == st.st_mtim.tv_sec && dc->mtime.tv_nsec == st.st_mtim.tv_nsec
+	   && dc->read_at > dc->mtime.tv_sec + 1) {
+		dc->used = ++clock_hand;
+		return dc;
+	}
+	if(!dc) {
+		dc = victim;
+		free(dc->path);
+		if(!(dc->path = strdup(path)))
+			return NULL;
+	}
+	if(!read_names(dc)) {
+		free(dc->path);
+		dc->path = NULL;
+		return NULL;
+	}
+	dc->used = ++clock_hand;
+	return dc;
+}
+
+static bool add_result(results_t *r, const char *path) {
+	if(r->n == r->cap) {
+		char **grown = realloc(r->v, (r->cap = r->cap ? r->cap * 2 : 16) * sizeof(char *));
+		if(!grown)
+			return false;
+		r->v = grown;
+	}
+	if(!(r->v[r->n] = strdup(path)))
+		return false;
+	r->n++;
+	return true;
+}
+
+/* Expands the components in rest below prefix, which holds the path so far
+ * (len bytes, ending in '/' unless it is empty). */
+static bool expand(char *prefix, size_t len, const char *rest, results_t *r) {
+	size_t clen = strcspn(rest, "/");
+	bool last = rest[clen] == '\0';
+	struct stat st;
+
+	if(len + clen + 2 > PATH_MAX)
+		return true; /* too long to exist */
+	if(memchr(rest, '*', clen) == NULL && memchr(rest, '?', clen) == NULL
+	   && memchr(rest, '[', clen) == NULL) { /* a literal component */
+		memcpy(prefix + len, rest, clen);
+		prefix[len + clen] = '\0';
+		if(last)
+			return lstat(prefix, &st) < 0 || add_result(r, prefix);
+		prefix[len + clen] = '/';
+		return expand(prefix, len + clen + 1, rest + clen + 1, r);
+	}
+
+	gtoken_t *t = (gtoken_t *)malloc((clen + 1) * sizeof(gtoken_t));
+	if(!t)
+		return false;
+	int n = compile_pattern(rest, clen, t);
+	prefix[len] = '\0';
+	globdir_t *dc = lookup_dir(len ? prefix : ".");
+	size_t off, dlen = dc ? dc->len : 0;
+	char *names = dlen ? (char *)malloc(dlen) : NULL;
+	bool ok = true;
+
+	if(dlen && !names)
+		ok = false;
+	else if(dlen) /* a deeper component may replace this cache entry */
+		memcpy(names, dc->names, dlen);
+	for(off = 0; ok && off < dlen; off += strlen(names + off) + 1) {
+		const char *name = names + off;
+		size_t nlen = strlen(name);
+		if(!match(t, n, name) || len + nlen + 2 > PATH_MAX)
+			continue;
+		memcpy(prefix + len, name, nlen + 1);
+		if(last)
+			ok = add_result(r, prefix);
+		else {
+			prefix[len + nlen] = '/';
+			ok = expand(prefix, len + nlen + 1, rest + clen + 1, r);
+		}
+	}
+	free(names);
+	free(t);
+	return ok;
+}
+
+static int cmp_str(const void *a, const void *b) {
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* Expands pattern into the sorted, malloc'ed array *matches of the paths
+ * it names. Returns their number: 0 if nothing matched, -1 if out of
+ * memory. */
+int glob_word(const char *pattern, char ***matches) {
+	char prefix[PATH_MAX];
+	results_t r = { NULL, 0, 0 };
+	size_t len = 0;
+
+	while(pattern[len] == '/') /* an absolute pattern */
+		len++;
+	if(len >= PATH_MAX)
+		len = PATH_MAX - 1;
+	memset(prefix, '/', len);
+	if(!expand(prefix, len, pattern + len, &r)) {
+		while(r.n--)
+			free(r.v[r.n]);
+		free(r.v);
+		*matches = NULL;
+		return -1;
+	}
+	qsort(r.v, r.n, sizeof(char *), cmp_str);
+	*matches = r.v;
+	return r.n;
+}
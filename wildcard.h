@@ -0,0 +1,24 @@
+#ifndef __WILDCARD_H__       /* check if this header file is already defined elsewhere */
+#define __WILDCARD_H__
+
+#include "dsh.h"
+
+#define GLOB_CACHE    16        /* directories whose listings are kept */
+#define GETDENTS_BUF  (1 << 16) /* bytes read per getdents64() call */
+
+/* A directory listing kept between globs */
+typedef struct globdir {
+        char *path;
+        dev_t dev;
+        ino_t ino;
+        struct timespec mtime;      /* of the directory when it was read */
+        time_t read_at;             /* CLOCK_REALTIME seconds of the read */
+        char *names;                /* NUL separated, without . and .. */
+        size_t len;
+        unsigned long used;         /* for LRU replacement */
+} globdir_t;
+
+bool has_glob(const char *word);
+int glob_word(const char *pattern, char ***matches);
+
+#endif /* __WILDCARD_H__ */
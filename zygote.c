@@ -0,0 +1,292 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <sched.h>
+#include "zygote.h"
+#include "affinity.h"
+#include "vars.h"
+#include "trace.h"
+
+/* The zygote: a fork server started by init_shell() when DSH_ZYGOTE is
+ * set, before the shell grows its history, caches and helper threads.
+ * spawn_job() sends it one message per process over a SOCK_SEQPACKET
+ * socketpair: argv, the FOO=1 prefixes, the dup2 plan with its descriptors
+ * as SCM_RIGHTS, the process group and the CPUs. The zygote clones itself
+ * with CLONE_PARENT, so the new process is the shell's child and the
+ * usual wait4() reaping and job control apply, and answers with its pid.
+ * Cloning the small zygote costs the same however big the shell is.
+ *
+ * The zygote keeps its own copy of the environment, sent again only when
+ * the shell's cached envp changes, and its own working directory, which
+ * follows the shell's after a cd. Relay stages and requests that do not
+ * fit in one message are forked by the shell as before, and so is
+ * everything once the zygote is gone. */
+
+static int zsock = -1;                  /* shell's end of the socketpair */
+static unsigned long sent_env = ~0UL;   /* var_env_version() the zygote has */
+static bool cwd_stale = false;          /* the shell changed directory since */
+static union {                          /* request being built or served */
+	zygote_req_t req;
+	char bytes[ZYGOTE_MSG_MAX];
+} msg;
+
+/* Fills the strings of a request; false if they do not fit */
+static bool put_strings(size_t *len, char **v, int n) {
+	int i;
+	for(i = 0; i < n; i++) {
+		size_t l = strlen(v[i]) + 1;
+		if(*len + l > sizeof(msg))
+			return false;
+		memcpy(msg.bytes + *len, v[i], l);
+		*len += l;
+	}
+	return true;
+}
+
+/* Points v at the n strings starting at *s, which must end before end */
+static bool get_strings(char **s, char *end, char **v, int n) {
+	int i;
+	for(i = 0; i < n; i++) {
+		char *nul = memchr(*s, '\0', end - *s);
+		if(!nul)
+			return false;
+		v[i] = *s;
+		*s = nul + 1;
+	}
+	v[n] = NULL;
+	return true;
+}
+
+/* In the new process: the same steps as the child of a fork in spawn_job() */
+static void start_child(zygote_req_t *req, int *fds, char **argv, char **assigns, char **env) {
+	int i;
+	pid_t pgid = req->pgid ? req->pgid : getpid();
+	if(!setpgid(0, pgid) && req->fg)
+		tcsetpgrp(STDIN_FILENO, pgid);
+	signal(SIGINT, SIG_DFL);
+	signal(SIGQUIT, SIG_DFL);
+	signal(SIGTSTP, SIG_DFL);
+	signal(SIGTTIN, SIG_DFL);
+	signal(SIGTTOU, SIG_DFL);
+	if(req->pin)
+		sched_setaffinity(0, sizeof(req->cpus), &req->cpus);
+	for(i = 0; i < req->nplan; i++)
+		if(req->plan[i].owned)
+			req->plan[i].src = fds[req->plan[i].src];
+	apply_plan(req->plan, req->nplan);
+	environ = req->nassigns ? env_overlay(env, assigns, req->nassigns) : env;
+	execvp(argv[0], argv);
+	perror("execvp");
+	_exit(1);
+}
+
+static void serve(int sock) {
+	char **env = environ, *block = NULL;
+	int fds[MAX_PLAN];
+	union {
+		struct cmsghdr h;
+		char buf[CMSG_SPACE(sizeof(fds))];
+	} ctl;
+
+	for(;;) {
+		struct iovec iov = { msg.bytes, sizeof(msg) };
+		struct msghdr mh = { NULL, 0, &iov, 1, &ctl, sizeof(ctl), 0 };
+		struct cmsghdr *c;
+		zygote_req_t *req = &msg.req;
+		int nfds = 0, i;
+		ssize_t n = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC);
+
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n <= 0)
+			_exit(0); /* the shell is gone */
+		for(c = CMSG_FIRSTHDR(&mh); c; c = CMSG_NXTHDR(&mh, c))
+			if(c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+				nfds = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+				memcpy(fds, CMSG_DATA(c), nfds * sizeof(int));
+			}
+
+		char *s = msg.bytes + sizeof(zygote_req_t), *end = msg.bytes + n;
+		pid_t pid = -1;
+		if(n < (ssize_t) sizeof(zygote_req_t) || req->nfds != nfds)
+			;
+		else if(req->type == ZYGOTE_ENV) {
+			size_t len = end - s;
+			char **fresh = (char **)malloc((req->nenv + 1) * sizeof(char *));
+			char *copy = (char *)malloc(len + 1), *t = copy;
+			if(fresh && copy) {
+				memcpy(copy, s, len);
+				if(get_strings(&t, copy + len, fresh, req->nenv)) {
+					if(env != environ)
+						free(env);
+					free(block);
+					env = fresh;
+					block = copy;
+					fresh = NULL;
+					copy = NULL;
+					pid = 0;
+				}
+			}
+			free(fresh);
+			free(copy);
+		}
+		else if(req->type == ZYGOTE_CWD && nfds == 1) {
+			if(fchdir(fds[0]) == 0)
+				pid = 0;
+		}
+		else if(req->type == ZYGOTE_SPAWN && req->argc > 0 && req->nplan <= MAX_PLAN) {
+			char **argv = (char **)malloc((req->argc + 1) * sizeof(char *));
+			char **assigns = (char **)malloc((req->nassigns + 1) * sizeof(char *));
+			if(argv && assigns && get_strings(&s, end, argv, req->argc)
+			   && get_strings(&s, end, assigns, req->nassigns)) {
+				pid = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, NULL, NULL, NULL, NULL);
+				if(pid == 0)
+					start_child(req, fds, argv, assigns, env);
+			}
+			free(argv);
+			free(assigns);
+		}
+		for(i = 0; i < nfds; i++)
+			close(fds[i]);
+		if(send(sock, &pid, sizeof(pid), MSG_NOSIGNAL) < 0)
+			_exit(0);
+	}
+}
+
+/* Starts the zygote if DSH_ZYGOTE is set to anything but 0 */
+void zygote_init() {
+	char *on = getenv("DSH_ZYGOTE");
+	int sv[2];
+
+	if(!on || !*on || strcmp(on, "0") == 0)
+		return;
+	if(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+		perror("socketpair");
+		return;
+	}
+	switch(fork()) {
+	   case -1:
+		perror("fork");
+		close(sv[0]);
+		close(sv[1]);
+		return;
+	   case 0:
+		close(sv[0]);
+		serve(sv[1]);
+	}
+	close(sv[1]);
+	zsock = sv[0];
+}
+
+/* Sends a request and returns the zygote's answer; -1 if it is gone */
+static pid_t transact(size_t len, int *fds, int nfds) {
+	union {
+		struct cmsghdr h;
+		char buf[CMSG_SPACE(sizeof(int) * (MAX_PLAN))];
+	} ctl;
+	struct iovec iov = { msg.bytes, len };
+	struct msghdr mh = { NULL, 0, &iov, 1, NULL, 0, 0 };
+	pid_t pid;
+	ssize_t n;
+
+	if(nfds > 0) {
+		mh.msg_control = &ctl;
+		mh.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+		struct cmsghdr *c = CMSG_FIRSTHDR(&mh);
+		c->cmsg_level = SOL_SOCKET;
+		c->cmsg_type = SCM_RIGHTS;
+		c->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+		memcpy(CMSG_DATA(c), fds, nfds * sizeof(int));
+	}
+	while((n = sendmsg(zsock, &mh, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+		;
+	if(n >= 0)
+		while((n = recv(zsock, &pid, sizeof(pid), 0)) < 0 && errno == EINTR)
+			;
+	if(n != sizeof(pid)) {
+		fprintf(stderr, "zygote: lost, forking from the shell\n");
+		close(zsock);
+		zsock = -1;
+		return -1;
+	}
+	return pid;
+}
+
+static bool send_env(char **envp) {
+	size_t len = sizeof(zygote_req_t);
+	int n = 0;
+	while(envp[n])
+		n++;
+	memset(&msg.req, 0, sizeof(msg.req));
+	msg.req.type = ZYGOTE_ENV;
+	msg.req.nenv = n;
+	if(!put_strings(&len, envp, n) || transact(len, NULL, 0) != 0)
+		return false;
+	sent_env = var_env_version();
+	return true;
+}
+
+/* Hands the zygote the shell's new working directory */
+static bool send_cwd() {
+	int fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+	pid_t answer;
+	if(fd < 0)
+		return false;
+	memset(&msg.req, 0, sizeof(msg.req));
+	msg.req.type = ZYGOTE_CWD;
+	msg.req.nfds = 1;
+	answer = transact(sizeof(zygote_req_t), &fd, 1);
+	close(fd);
+	if(answer != 0)
+		return false;
+	cwd_stale = false;
+	return true;
+}
+
+/* Called after the shell changes directory: the zygote follows before
+ * its next spawn */
+void zygote_chdir() {
+	cwd_stale = zsock >= 0;
+}
+
+/* fork() for spawn_job(): returns the pid of a process the zygote started
+ * for p, or, if that is not possible, forks the shell. */
+pid_t zygote_fork(job_t *j, process_t *p, int stage, bool fg, dup_step_t *plan, int nplan, char **envp) {
+	zygote_req_t *req = &msg.req;
+	int fds[MAX_PLAN], i;
+	size_t len = sizeof(zygote_req_t);
+	pid_t pid;
+
+	if(zsock < 0 || p->relay || (sent_env != var_env_version() && !send_env(envp))
+	   || (cwd_stale && !send_cwd()))
+		return fork();
+	memset(req, 0, sizeof(*req));
+	req->type = ZYGOTE_SPAWN;
+	req->pgid = j->pgid < 0 ? 0 : j->pgid;
+	req->fg = fg;
+	req->pin = placement_cpus(j, stage, &req->cpus);
+	req->nplan = nplan;
+	for(i = 0; i < nplan; i++) {
+		req->plan[i] = plan[i];
+		if(plan[i].owned || plan[i].src >= FIRST_SHELL_FD) { /* a shell descriptor */
+			fds[req->nfds] = plan[i].src;
+			req->plan[i].src = req->nfds++;
+			req->plan[i].owned = true;
+		}
+	}
+	req->argc = p->argc;
+	req->nassigns = p->nassigns;
+	if(!put_strings(&len, p->argv, p->argc) || !put_strings(&len, p->assigns, p->nassigns))
+		return fork();
+	if((pid = transact(len, fds, req->nfds)) <= 0)
+		return fork();
+	TRACE(trace_spawned(p, pid)); /* the new process never runs trace_exec() */
+	return pid;
+}
@@ -0,0 +1,31 @@
+#ifndef __ZYGOTE_H__         /* check if this header file is already defined elsewhere */
+#define __ZYGOTE_H__
+
+#include "dsh.h"
+
+#define ZYGOTE_MSG_MAX (1 << 16)  /* largest request; bigger ones fork in the shell */
+
+enum { ZYGOTE_ENV, ZYGOTE_CWD, ZYGOTE_SPAWN };
+
+/* A request to the zygote. The strings follow it in the same message: for
+ * ZYGOTE_ENV the nenv environment entries, for ZYGOTE_SPAWN argc argv words
+ * then nassigns NAME=value words. The descriptors the plan refers to come
+ * as SCM_RIGHTS; an owned step's src is an index into them. ZYGOTE_CWD
+ * comes with one descriptor, the shell's working directory. */
+typedef struct zygote_req {
+        int type;
+        pid_t pgid;                 /* 0 starts a new process group */
+        bool fg;                    /* give the new process the terminal */
+        bool pin;                   /* apply cpus */
+        cpu_set_t cpus;
+        int nplan;
+        dup_step_t plan[MAX_PLAN];
+        int nfds;
+        int argc, nassigns, nenv;
+} zygote_req_t;
+
+void zygote_init();
+void zygote_chdir();
+pid_t zygote_fork(job_t *j, process_t *p, int stage, bool fg, dup_step_t *plan, int nplan, char **envp);
+
+#endif /* __ZYGOTE_H__ */